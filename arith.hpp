@@ -70,5 +70,8 @@ inline size_t size_sub(size_t x, size_t y) {
     logic_check(y <= x, "size_sub overflow %zu - %zu", x, y);
     return x - y;
 }
+inline size_t ceil_divide(size_t x, size_t y) {
+    return x / y + (x % y != 0);
+}
 
 #endif  // QWERTILLION_ARITH_HPP_
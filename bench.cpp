@@ -0,0 +1,1037 @@
+// Benchmarks of editor internals -- not built by default.  Build with
+// -DQWI_BUILD_BENCH=ON and run ./qwi_bench --help.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer.hpp"
+#include "char_scan.hpp"
+#include "editing.hpp"
+#include "io.hpp"
+#include "line_index.hpp"
+#include "mark_tree.hpp"
+#include "region_stats.hpp"
+#include "term_ui.hpp"
+#include "text_storage.hpp"
+#include "undo_file.hpp"
+
+namespace qwi {
+
+// Lines of 0 to 120 chars, of mostly letters, some spaces and tabs.
+buffer_string generate_text(size_t size, uint32_t seed) {
+    std::mt19937 rng(seed);
+    buffer_string ret;
+    ret.reserve(size);
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyz    \t";
+    while (ret.size() < size) {
+        size_t line_length = std::min<size_t>(rng() % 121, size - ret.size());
+        for (size_t i = 0; i < line_length; ++i) {
+            ret.push_back(buffer_char::from_char(alphabet[rng() % (sizeof(alphabet) - 1)]));
+        }
+        if (ret.size() < size) {
+            ret.push_back(buffer_char{'\n'});
+        }
+    }
+    return ret;
+}
+
+// Returns the best time of `reps` runs, in seconds.
+double time_best(int reps, const std::function<void()>& fn) {
+    double best = 1e100;
+    for (int i = 0; i < reps; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+void report(const char *name, size_t bytes, double seconds) {
+    printf("%-32s %10.3f ms %8.2f GB/s\n", name, seconds * 1000, bytes / seconds / 1e9);
+}
+
+// Keeps the compiler from optimizing away a computation.
+volatile size_t sink;
+
+void bench_stats(size_t size) {
+    buffer_string text = generate_text(size, 1);
+    region_stats serial, parallel;
+    report("compute_stats_serial", size, time_best(5, [&] {
+        serial = compute_stats_serial(text.data(), text.size());
+    }));
+    report("compute_stats", size, time_best(5, [&] {
+        parallel = compute_stats(text.data(), text.size());
+    }));
+    if (serial.newline_count != parallel.newline_count
+        || serial.last_line_size != parallel.last_line_size) {
+        fprintf(stderr, "compute_stats results differ!\n");
+        exit(1);
+    }
+}
+
+void bench_chars(size_t size) {
+    buffer_string text = generate_text(size, 3);
+    // One long line of printable chars, the worst case for searches and width checks.
+    buffer_string line(size, buffer_char{'a'});
+    size_t expected_newlines = char_scan().count_newlines(text.data(), text.size());
+    for (const char_scan_kernels *k : supported_char_scans()) {
+        std::string name = k->name;
+        size_t newlines = 0;
+        report((name + " count_newlines").c_str(), size, time_best(5, [&] {
+            newlines = k->count_newlines(text.data(), text.size());
+        }));
+        report((name + " find_after_last").c_str(), size, time_best(5, [&] {
+            sink = k->find_after_last(line.data(), line.size(), buffer_char{'\n'});
+        }));
+        bool single_width = false;
+        report((name + " is_single_width").c_str(), size, time_best(5, [&] {
+            single_width = k->is_single_width(line.data(), line.size());
+        }));
+        if (newlines != expected_newlines || !single_width) {
+            fprintf(stderr, "%s kernels gave wrong results!\n", k->name);
+            exit(1);
+        }
+    }
+}
+
+void bench_load(size_t size) {
+    buffer_string text = generate_text(size, 2);
+    report("text_storage construction", size, time_best(3, [&] {
+        text_storage storage{std::span<const buffer_char>{text.data(), text.size()}};
+        sink = storage.size();
+    }));
+}
+
+void bench_lines(size_t size) {
+    buffer_string text = generate_text(size, 4);
+    text_storage storage{std::span<const buffer_char>{text.data(), text.size()}};
+    line_index lines;
+    report("line_index construction", size, time_best(3, [&] {
+        lines = line_index(storage);
+    }));
+
+    // Random lookups, reported per lookup.
+    constexpr size_t LOOKUPS = 100000;
+    std::mt19937 rng(5);
+    std::vector<size_t> positions(LOOKUPS);
+    for (size_t& p : positions) {
+        p = rng() % (size + 1);
+    }
+    const size_t newlines = lines.newline_count();
+    auto per_lookup = [](const char *name, double seconds) {
+        printf("%-32s %10.3f us\n", name, seconds / LOOKUPS * 1e6);
+    };
+    per_lookup("stats_at", time_best(3, [&] {
+        for (size_t p : positions) {
+            sink = storage.stats_at(p).newline_count;
+        }
+    }));
+    per_lookup("line_index::line_at", time_best(3, [&] {
+        for (size_t p : positions) {
+            sink = lines.line_at(storage, p);
+        }
+    }));
+    per_lookup("line_index::line_start", time_best(3, [&] {
+        for (size_t p : positions) {
+            sink = lines.line_start(storage, p % (newlines + 1));
+        }
+    }));
+    per_lookup("line_index::line_beginning", time_best(3, [&] {
+        for (size_t p : positions) {
+            sink = lines.line_beginning(storage, p);
+        }
+    }));
+}
+
+// Typing and backspacing in a buffer with many marks.  The size is the number of marks,
+// 1024 per MiB of --size.
+void bench_marks(size_t size) {
+    const size_t num_marks = std::max<size_t>(1, size >> 20) * 1024;
+    const size_t text_size = num_marks * 64;
+    std::mt19937 rng(11);
+    mark_tree marks;
+    for (size_t i = 0; i < num_marks; ++i) {
+        marks.add(i, rng() % (text_size + 1));
+    }
+    constexpr size_t EDITS = 1000000;
+    size_t cursor = text_size / 2;
+    size_t squeezed = 0;
+    double seconds = time_best(1, [&] {
+        for (size_t n = 0; n < EDITS; ++n) {
+            if (n % 3 == 2) {
+                marks.collapse_range(cursor - 1, cursor, cursor - 1, 1, [&](size_t, size_t) { ++squeezed; });
+                --cursor;
+            } else {
+                marks.shift_from(cursor + 1, 1);
+                ++cursor;
+            }
+        }
+    });
+    printf("%-32s %10.3f us  (%zu marks)\n", "edit", seconds / EDITS * 1e6, num_marks);
+    sink = squeezed;
+}
+
+// Snapshots (copies) of text storage, read on another thread while this one edits.
+void bench_snapshot(size_t size) {
+    buffer_string text = generate_text(size, 9);
+    text_storage storage{std::span<const buffer_char>{text.data(), text.size()}};
+    report("snapshot", size, time_best(5, [&] {
+        text_storage snapshot = storage;
+        sink = snapshot.size();
+    }));
+    buffer_string copy(size, buffer_char{});
+    report("copy_to", size, time_best(5, [&] {
+        storage.copy_to(0, storage.size(), copy.data());
+    }));
+
+    constexpr size_t EDITS = 100000;
+    std::mt19937 rng(10);
+    auto random_edit = [&](size_t n) {
+        size_t pos = rng() % (storage.size() + 1);
+        if (n % 2 == 0 || pos == storage.size()) {
+            buffer_char ch = buffer_char::from_char(n % 7 == 0 ? '\n' : 'x');
+            storage.insert(pos, &ch, 1);
+        } else {
+            storage.erase(pos, 1, nullptr);
+        }
+    };
+    double seconds = time_best(1, [&] {
+        for (size_t n = 0; n < EDITS; ++n) {
+            random_edit(n);
+        }
+    });
+    printf("%-32s %10.3f us\n", "edit", seconds / EDITS * 1e6);
+
+    // The reader checks every snapshot it gets against the stats of when it was taken.
+    std::mutex mu;
+    std::optional<std::pair<text_storage, region_stats>> latest;
+    bool done = false;
+    size_t snapshots_checked = 0;
+    std::thread reader([&] {
+        for (;;) {
+            std::optional<std::pair<text_storage, region_stats>> snapshot;
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                if (done && !latest.has_value()) {
+                    return;
+                }
+                std::swap(snapshot, latest);
+            }
+            if (!snapshot.has_value()) {
+                std::this_thread::yield();
+                continue;
+            }
+            region_stats stats{};
+            snapshot->first.for_each_span(0, snapshot->first.size(), [&](std::span<const buffer_char> span) {
+                stats = append_stats(stats, compute_stats(span.data(), span.size()));
+            });
+            if (stats.newline_count != snapshot->second.newline_count
+                || stats.last_line_size != snapshot->second.last_line_size) {
+                fprintf(stderr, "snapshot changed while it was read!\n");
+                exit(1);
+            }
+            ++snapshots_checked;
+        }
+    });
+    seconds = time_best(1, [&] {
+        for (size_t n = 0; n < EDITS; ++n) {
+            random_edit(n);
+            if (n % 1000 == 0) {
+                region_stats stats = storage.stats_at(storage.size());
+                std::lock_guard<std::mutex> lock(mu);
+                latest.emplace(storage, stats);
+            }
+        }
+    });
+    printf("%-32s %10.3f us\n", "edit, snapshot every 1000", seconds / EDITS * 1e6);
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        done = true;
+    }
+    reader.join();
+    printf("%zu snapshots checked\n", snapshots_checked);
+}
+
+// The same random editing session, run against each text storage backend.  The ops are
+// drawn from one seeded rng, so every backend sees the same sequence -- as long as they
+// agree on the text, which we check.
+enum class session_op { type, backspace, paste, jump, render, line_info, COUNT };
+const char *const session_op_names[] = {
+    "type", "backspace", "paste", "jump", "render", "line_info",
+};
+static_assert(std::size(session_op_names) == size_t(session_op::COUNT));
+
+struct session_result {
+    // Total seconds and count of each op.
+    double seconds[size_t(session_op::COUNT)] = {};
+    size_t counts[size_t(session_op::COUNT)] = {};
+    double max_seconds[size_t(session_op::COUNT)] = {};
+    // Folds together everything the session read, to compare backends.
+    size_t checksum = 0;
+    buffer_string final_text;
+};
+
+session_op pick_session_op(std::mt19937& rng) {
+    // Mostly typing and redisplay, like an interactive session.
+    uint32_t r = rng() % 100;
+    return r < 40 ? session_op::type
+        : r < 55 ? session_op::backspace
+        : r < 56 ? session_op::paste
+        : r < 61 ? session_op::jump
+        : r < 80 ? session_op::render
+        : session_op::line_info;
+}
+
+template <text_storage_backend Storage>
+session_result run_session(const buffer_string& initial, size_t num_ops) {
+    session_result ret;
+    Storage storage{std::span<const buffer_char>{initial.data(), initial.size()}};
+    std::mt19937 rng(7);
+    const buffer_string clip = generate_text(4096, 8);
+    size_t cursor = storage.size() / 2;
+    for (size_t n = 0; n < num_ops; ++n) {
+        session_op op = pick_session_op(rng);
+        const uint32_t r = rng();
+        auto start = std::chrono::steady_clock::now();
+        switch (op) {
+        case session_op::type: {
+            buffer_char ch = buffer_char::from_char(r % 8 == 0 ? '\n' : char('a' + r % 26));
+            storage.insert(cursor, &ch, 1);
+            ++cursor;
+        } break;
+        case session_op::backspace: {
+            size_t count = std::min<size_t>(cursor, 1 + r % 4);
+            buffer_string deleted;
+            storage.erase(cursor - count, count, &deleted);
+            cursor -= count;
+            ret.checksum += deleted.size();
+        } break;
+        case session_op::paste: {
+            storage.insert(cursor, clip.data(), clip.size());
+            cursor += clip.size();
+        } break;
+        case session_op::jump: {
+            cursor = r % (storage.size() + 1);
+        } break;
+        case session_op::render: {
+            // Read a screenful after the cursor, a char at a time.
+            size_t end = std::min(storage.size(), cursor + 4000);
+            for (size_t i = cursor; i < end; ++i) {
+                ret.checksum += storage.get(i).value;
+            }
+        } break;
+        case session_op::line_info: {
+            region_stats stats = storage.stats_at(cursor);
+            ret.checksum += stats.newline_count * 1000 + stats.last_line_size;
+        } break;
+        default:
+            logic_fail("run_session: bad op");
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ret.seconds[size_t(op)] += elapsed.count();
+        ret.max_seconds[size_t(op)] = std::max(ret.max_seconds[size_t(op)], elapsed.count());
+        ret.counts[size_t(op)] += 1;
+    }
+    ret.final_text.resize(storage.size());
+    storage.copy_to(0, storage.size(), ret.final_text.data());
+    return ret;
+}
+
+void bench_backends(size_t size) {
+    buffer_string text = generate_text(size, 6);
+    constexpr size_t NUM_OPS = 20000;
+    struct backend {
+        const char *name;
+        session_result (*run)(const buffer_string& initial, size_t num_ops);
+    };
+    const backend backends[] = {
+        {"rope", run_session<rope>},
+        {"gap_buffer", run_session<gap_buffer>},
+        {"piece_table", run_session<piece_table>},
+    };
+    std::optional<session_result> first;
+    for (const backend& b : backends) {
+        session_result result = b.run(text, NUM_OPS);
+        printf("%s:\n", b.name);
+        for (size_t op = 0; op < size_t(session_op::COUNT); ++op) {
+            printf("  %-30s %10.3f us mean %10.3f us max  (%zu ops)\n", session_op_names[op],
+                   result.seconds[op] / std::max<size_t>(1, result.counts[op]) * 1e6,
+                   result.max_seconds[op] * 1e6, result.counts[op]);
+        }
+        if (!first.has_value()) {
+            first = std::move(result);
+        } else if (result.checksum != first->checksum || result.final_text != first->final_text) {
+            fprintf(stderr, "%s disagrees with %s!\n", b.name, backends[0].name);
+            exit(1);
+        }
+    }
+}
+
+// A buffer of the given text, with a window on it.
+struct bench_buffer {
+    state st;
+    buffer buf;
+    ui_window_ctx ui;
+
+    explicit bench_buffer(buffer_string&& text)
+        : buf(buffer::from_data(st.gen_buf_id(), std::move(text))), ui{buf.add_mark(0), buf.add_mark(0)} { }
+    ~bench_buffer() { detach_ui_window_ctx(&buf, &ui); }
+
+    NO_COPY(bench_buffer);
+};
+
+// Undoing 100k edits, then redoing them -- undoing the undos, which took them off a
+// mountain.
+void bench_undo(size_t size) {
+    constexpr size_t EDITS = 100000;
+    constexpr size_t EDIT_SIZE = 256;
+    bench_buffer ed(generate_text(std::min(size, size_t(16) << 20), 12));
+    const buffer_string insertion = generate_text(EDIT_SIZE, 13);
+    std::mt19937 rng(14);
+    for (size_t n = 0; n < EDITS; ++n) {
+        set_ctx_cursor(&ed.ui, &ed.buf, rng() % (ed.buf.size() + 1));
+        (void)note_action(&ed.st, &ed.buf, insert_chars(ed.st.scratch(), &ed.ui, &ed.buf, insertion.data(), insertion.size()));
+    }
+    const size_t edited_size = ed.buf.size();
+
+    auto undo_all = [&] {
+        for (size_t n = 0; n < EDITS; ++n) {
+            perform_undo(&ed.st, &ed.ui, &ed.buf);
+        }
+    };
+    double undo_seconds = time_best(1, undo_all);
+    add_nop_edit(&ed.buf.undo_info);
+    double redo_seconds = time_best(1, undo_all);
+    printf("%-32s %10.3f us\n", "undo", undo_seconds / EDITS * 1e6);
+    printf("%-32s %10.3f us\n", "redo", redo_seconds / EDITS * 1e6);
+    printf("%-32s %10.3f MiB\n", "undo memory", ed.buf.undo_info.memory_used / 1048576.0);
+    if (ed.buf.size() != edited_size) {
+        fprintf(stderr, "redo did not restore the text!\n");
+        exit(1);
+    }
+
+    // In a window, each undo step checks whether the cursor went offscreen, unless the
+    // steps are batched.
+    constexpr size_t STEPS = 10000;
+    ed.ui.set_last_rendered_window(window_size{.rows = 50, .cols = 120});
+    double stepwise_seconds = time_best(1, [&] {
+        for (size_t n = 0; n < STEPS; ++n) {
+            perform_undo(&ed.st, &ed.ui, &ed.buf);
+        }
+    });
+    double batched_seconds = time_best(1, [&] { perform_undo_steps(&ed.st, &ed.ui, &ed.buf, STEPS); });
+    printf("%-32s %10.3f ms\n", "10k undos in a window", stepwise_seconds * 1e3);
+    printf("%-32s %10.3f ms\n", "10k undos, batched", batched_seconds * 1e3);
+}
+
+// Holding backspace over 1M characters, which coalesces into one undo item, then undoing
+// it.
+void bench_backspace(size_t size) {
+    constexpr size_t KEYPRESSES = 1000000;
+    bench_buffer ed(generate_text(std::clamp(size, 2 * KEYPRESSES, size_t(16) << 20), 15));
+    const buffer_string original = ed.buf.copy_substr(0, ed.buf.size());
+    set_ctx_cursor(&ed.ui, &ed.buf, ed.buf.size());
+
+    double backspace_seconds = time_best(1, [&] {
+        for (size_t n = 0; n < KEYPRESSES; ++n) {
+            (void)note_coalescent_action(&ed.st, &ed.buf, delete_left(ed.st.scratch(), &ed.ui, &ed.buf, 1));
+        }
+    });
+    double undo_seconds = time_best(1, [&] { perform_undo(&ed.st, &ed.ui, &ed.buf); });
+    printf("%-32s %10.3f us\n", "backspace", backspace_seconds / KEYPRESSES * 1e6);
+    printf("%-32s %10.3f ms\n", "undo 1M backspaces", undo_seconds * 1e3);
+    if (ed.buf.copy_substr(0, ed.buf.size()) != original) {
+        fprintf(stderr, "undo did not restore the text!\n");
+        exit(1);
+    }
+}
+
+// Consecutive word kills with M-Backspace, which make one kill ring entry, then yanking it.
+void bench_kills(size_t size) {
+    constexpr size_t KILLS = 100000;
+    bench_buffer ed(generate_text(std::clamp(size, 16 * KILLS, size_t(16) << 20), 16));
+    ed.ui.set_last_rendered_window(window_size{.rows = 50, .cols = 120});
+    set_ctx_cursor(&ed.ui, &ed.buf, ed.buf.size());
+
+    double kill_seconds = time_best(1, [&] {
+        for (size_t n = 0; n < KILLS; ++n) {
+            (void)delete_backward_word(&ed.st, &ed.ui, &ed.buf);
+        }
+    });
+    const size_t killed = ed.st.clipboard.bytes;
+    set_ctx_cursor(&ed.ui, &ed.buf, 0);
+    double yank_seconds = time_best(1, [&] { (void)yank_from_clipboard(&ed.st, &ed.ui, &ed.buf); });
+    printf("%-32s %10.3f us\n", "word kill", kill_seconds / KILLS * 1e6);
+    printf("%-32s %10.3f ms (%.1f MiB)\n", "yank", yank_seconds * 1e3, killed / 1048576.0);
+}
+
+// C-w on the whole text, then yanking it back.
+void bench_kill_region(size_t size) {
+    bench_buffer ed(generate_text(size, 17));
+    set_mark(&ed.ui, &ed.buf);
+    set_ctx_cursor(&ed.ui, &ed.buf, ed.buf.size());
+
+    double kill_seconds = time_best(1, [&] { (void)kill_region(&ed.st, &ed.ui, &ed.buf); });
+    double yank_seconds = time_best(1, [&] { (void)yank_from_clipboard(&ed.st, &ed.ui, &ed.buf); });
+    printf("%-32s %10.3f ms\n", "kill region", kill_seconds * 1e3);
+    printf("%-32s %10.3f ms\n", "yank region", yank_seconds * 1e3);
+}
+
+// Typing into a 200x60 terminal, and then scrolling line by line, writing each frame in
+// full and writing only what changed.
+void bench_frames(size_t size) {
+    constexpr size_t KEYPRESSES = 10000;
+    constexpr size_t SCROLLS = 10000;
+    const terminal_size window = {.rows = 60, .cols = 200};
+    // The last row is a status line.
+    const window_size winsize = {.rows = window.rows - 1, .cols = window.cols};
+    bench_buffer ed(generate_text(std::min(size, size_t(16) << 20), 18));
+    ed.ui.set_last_rendered_window(winsize);
+    set_ctx_cursor(&ed.ui, &ed.buf, 1000);
+
+    terminal_frame frame;
+    auto encode_frames = [&](const char *what, size_t count, const std::function<void(size_t)>& step) {
+        terminal_screen full, incremental;
+        encode_frame(frame, &incremental);
+        incremental.frames = incremental.total_bytes = 0;
+        double step_seconds = 0, render_seconds = 0, seconds = 0;
+        for (size_t n = 0; n < count; ++n) {
+            step_seconds += time_best(1, [&] { step(n); });
+            reinit_frame(&frame, window);
+            render_coord coords[1] = { {ed.buf.get_mark_offset(ed.ui.cursor_mark), std::nullopt} };
+            render_seconds += time_best(1, [&] {
+                render_into_frame(&frame, terminal_coord{}, winsize, ed.ui, ed.buf, std::span{coords});
+                ed.buf.rendered_lines().end_redraw();
+            });
+            if (coords[0].rendered_pos.has_value()) {
+                frame.cursor = terminal_coord{coords[0].rendered_pos->row, coords[0].rendered_pos->col};
+            }
+            const std::string status = std::to_string(n);
+            for (size_t i = 0; i < status.size(); ++i) {
+                frame.data[size_t(winsize.rows) * window.cols + i] = terminal_char{uint8_t(status[i])};
+            }
+            full.valid = false;
+            encode_frame(frame, &full);
+            seconds += time_best(1, [&] { encode_frame(frame, &incremental); });
+        }
+        printf("%s:\n", what);
+        printf("%-32s %10.1f bytes\n", "  full frame", double(full.total_bytes) / full.frames);
+        printf("%-32s %10.1f bytes\n", "  changed cells", double(incremental.total_bytes) / incremental.frames);
+        printf("%-32s %10.3f us\n", "  editing or scrolling", step_seconds / count * 1e6);
+        printf("%-32s %10.3f us\n", "  rendering", render_seconds / count * 1e6);
+        printf("%-32s %10.3f us\n", "  encoding changed cells", seconds / count * 1e6);
+    };
+
+    encode_frames("typing", KEYPRESSES, [&](size_t n) {
+        (void)insert_char(ed.st.scratch(), &ed.ui, &ed.buf, uint8_t(n % 80 == 79 ? '\n' : 'a' + n % 26));
+    });
+    encode_frames("scrolling", SCROLLS, [&](size_t) {
+        size_t pos = ed.buf.get_mark_offset(ed.ui.first_visible_offset);
+        while (pos < ed.buf.size() && ed.buf.get(pos) != buffer_char{'\n'}) {
+            ++pos;
+        }
+        ed.buf.replace_mark(ed.ui.first_visible_offset, std::min(pos + 1, ed.buf.size()));
+        set_ctx_cursor(&ed.ui, &ed.buf, std::min(pos + 1, ed.buf.size()));
+    });
+}
+
+// Jumping around in a few very long lines in a 200x60 window, recentering the window on the
+// cursor after each jump.
+void bench_wrapped(size_t size) {
+    constexpr size_t JUMPS = 1000;
+    constexpr size_t LINES = 4;
+    const window_size winsize = {.rows = 60, .cols = 200};
+    buffer_string text = generate_text(size, 19);
+    std::replace(text.begin(), text.end(), buffer_char{'\n'}, buffer_char{' '});
+    for (size_t i = 1; i < LINES; ++i) {
+        text[i * text.size() / LINES] = buffer_char{'\n'};
+    }
+    bench_buffer ed(std::move(text));
+    ed.ui.set_last_rendered_window(winsize);
+    std::mt19937 rng(19);
+    std::vector<size_t> targets(JUMPS);
+    for (size_t& t : targets) {
+        t = rng() % (ed.buf.size() + 1);
+    }
+
+    terminal_frame frame = init_frame(terminal_size{winsize.rows, winsize.cols});
+    double jump_seconds = 0, render_seconds = 0;
+    size_t rendered = 0;
+    for (size_t t : targets) {
+        jump_seconds += time_best(1, [&] {
+            set_ctx_cursor(&ed.ui, &ed.buf, t);
+            recenter_cursor_if_offscreen(&ed.ui, &ed.buf);
+        });
+        render_coord coords[1] = { {t, std::nullopt} };
+        render_seconds += time_best(1, [&] {
+            render_into_frame(&frame, terminal_coord{}, winsize, ed.ui, ed.buf, std::span{coords});
+            ed.buf.rendered_lines().end_redraw();
+        });
+        rendered += coords[0].rendered_pos.has_value();
+    }
+    printf("%-32s %10.3f us\n", "jump and recenter", jump_seconds / JUMPS * 1e6);
+    printf("%-32s %10.3f us\n", "rendering", render_seconds / JUMPS * 1e6);
+    if (rendered != JUMPS) {
+        fprintf(stderr, "the cursor was offscreen after recentering!\n");
+    }
+}
+
+// The checks below exit if they fail.
+void expect(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "check failed: %s\n", what);
+        exit(1);
+    }
+}
+
+bool same_chars(const std::vector<terminal_char>& a, const std::vector<terminal_char>& b) {
+    return a.size() == b.size() && 0 == memcmp(as_chars(a.data()), as_chars(b.data()), a.size());
+}
+
+// Random edits of a mark_tree, checked against a plain array of offsets.
+void check_mark_tree() {
+    constexpr size_t SLOTS = 1000;
+    constexpr size_t OPS = 200000;
+    std::mt19937 rng(20);
+    mark_tree marks;
+    // Each slot's offset, or NONE.
+    std::vector<size_t> expected(SLOTS, mark_tree::NONE);
+    size_t text_size = 100000;
+    for (size_t n = 0; n < OPS; ++n) {
+        const size_t slot = rng() % SLOTS;
+        const size_t pos = rng() % (text_size + 1);
+        switch (rng() % 5) {
+        case 0:
+            if (expected[slot] == mark_tree::NONE) {
+                marks.add(slot, pos);
+                expected[slot] = pos;
+            } else {
+                marks.remove(slot);
+                expected[slot] = mark_tree::NONE;
+            }
+            break;
+        case 1:
+            if (expected[slot] != mark_tree::NONE) {
+                marks.set_offset(slot, pos);
+                expected[slot] = pos;
+            }
+            break;
+        case 2: {
+            const size_t count = 1 + rng() % 100;
+            marks.shift_from(pos, count);
+            for (size_t& e : expected) {
+                if (e != mark_tree::NONE && e >= pos) {
+                    e += count;
+                }
+            }
+            text_size += count;
+        } break;
+        case 3: {
+            // Deleting [pos, pos + count).
+            const size_t count = std::min<size_t>(rng() % 100, text_size - pos);
+            size_t moved = 0;
+            marks.collapse_range(pos, pos + count, pos, count, [&](size_t s, size_t old_offset) {
+                expect(s < SLOTS && expected[s] == old_offset, "mark_tree::collapse_range old offsets");
+                ++moved;
+            });
+            for (size_t& e : expected) {
+                if (e == mark_tree::NONE) {
+                    continue;
+                } else if (e >= pos + count) {
+                    e -= count;
+                } else if (e >= pos) {
+                    e = pos;
+                    --moved;
+                }
+            }
+            expect(moved == 0, "mark_tree::collapse_range visited marks");
+            text_size -= count;
+        } break;
+        case 4: {
+            size_t offset = 0;
+            const size_t found = marks.last_at_or_before(pos, &offset);
+            size_t best = mark_tree::NONE;
+            for (size_t e : expected) {
+                if (e != mark_tree::NONE && e <= pos && (best == mark_tree::NONE || e > best)) {
+                    best = e;
+                }
+            }
+            expect(best == mark_tree::NONE ? found == mark_tree::NONE
+                   : found < SLOTS && offset == best && expected[found] == best,
+                   "mark_tree::last_at_or_before");
+        } break;
+        }
+        if (n % 1000 == 0) {
+            for (size_t s = 0; s < SLOTS; ++s) {
+                expect(expected[s] == mark_tree::NONE || marks.offset(s) == expected[s], "mark_tree offsets");
+            }
+        }
+    }
+}
+
+// Edits a buffer and redraws it, checking each redraw -- which uses the lines of the
+// buffer's render_cache that its edits didn't invalidate -- against a fresh buffer's.
+void check_render_cache() {
+    constexpr size_t EDITS = 3000;
+    buffer_string text = generate_text(1 << 16, 21);
+    // One line longer than CHECKPOINT_BYTES, for its checkpoints.
+    std::replace(text.begin(), text.begin() + text.size() / 4, buffer_char{'\n'}, buffer_char{' '});
+    bench_buffer ed(std::move(text));
+    std::mt19937 rng(22);
+    const char alphabet[] = "abc\t\n";
+    for (size_t n = 0; n < EDITS; ++n) {
+        set_ctx_cursor(&ed.ui, &ed.buf, rng() % (ed.buf.size() + 1));
+        const size_t cursor = ed.buf.get_mark_offset(ed.ui.cursor_mark);
+        switch (rng() % 3) {
+        case 0: {
+            buffer_string insertion(1 + rng() % 20, buffer_char{});
+            for (buffer_char& ch : insertion) {
+                ch = buffer_char::from_char(alphabet[rng() % (sizeof(alphabet) - 1)]);
+            }
+            (void)insert_chars(ed.st.scratch(), &ed.ui, &ed.buf, insertion.data(), insertion.size());
+        } break;
+        case 1:
+            (void)delete_left(ed.st.scratch(), &ed.ui, &ed.buf, std::min<size_t>(cursor, 1 + rng() % 20));
+            break;
+        case 2:
+            (void)delete_right(ed.st.scratch(), &ed.ui, &ed.buf, std::min<size_t>(ed.buf.size() - cursor, 1 + rng() % 20));
+            break;
+        }
+
+        // Windows of different widths share the cache.
+        const window_size winsize = {.rows = 20, .cols = n % 3 == 0 ? 37u : 80u};
+        ed.ui.set_last_rendered_window(winsize);
+        recenter_cursor_if_offscreen(&ed.ui, &ed.buf);
+        bench_buffer fresh(ed.buf.copy_substr(0, ed.buf.size()));
+        fresh.buf.replace_mark(fresh.ui.first_visible_offset, ed.buf.get_mark_offset(ed.ui.first_visible_offset));
+        set_ctx_cursor(&fresh.ui, &fresh.buf, ed.buf.get_mark_offset(ed.ui.cursor_mark));
+        fresh.ui.set_last_rendered_window(winsize);
+        expect(current_column(&ed.ui, &ed.buf) == current_column(&fresh.ui, &fresh.buf), "render_cache columns");
+
+        terminal_frame frames[2];
+        bench_buffer *bufs[2] = {&ed, &fresh};
+        std::optional<window_coord> cursors[2];
+        for (size_t i = 0; i < 2; ++i) {
+            frames[i] = init_frame(terminal_size{winsize.rows, winsize.cols});
+            render_coord coords[1] = { {bufs[i]->buf.get_mark_offset(bufs[i]->ui.cursor_mark), std::nullopt} };
+            render_into_frame(&frames[i], terminal_coord{}, winsize, bufs[i]->ui, bufs[i]->buf, std::span{coords});
+            bufs[i]->buf.rendered_lines().end_redraw();
+            cursors[i] = coords[0].rendered_pos;
+        }
+        expect(same_chars(frames[0].data, frames[1].data) && frames[0].style_data == frames[1].style_data,
+               "render_cache renderings");
+        expect(cursors[0].has_value() && cursors[1].has_value() && cursors[0]->row == cursors[1]->row
+               && cursors[0]->col == cursors[1]->col, "render_cache cursor");
+    }
+}
+
+void write_file(const std::filesystem::path& path, const buffer_string& text) {
+    file_descriptor fd;
+    expect(!open_file_for_overwrite(path, &fd).errored() && !write_all(fd.fd, text.data(), text.size()).errored()
+           && !sync_and_close(&fd, path).errored(), "writing a file");
+}
+
+// Saves undo history (appending to the undo file the second time), and checks that the
+// history loaded back undoes to the same texts.  Then checks that a changed file with the
+// same size and modification time doesn't get the history.
+void check_undo_file() {
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() / ("qwi_bench_checks." + std::to_string(getpid()));
+    fs::create_directories(dir);
+    const fs::path path = dir / "text";
+    bench_buffer ed(generate_text(1 << 16, 23));
+    std::mt19937 rng(24);
+    // The text before each edit.
+    std::vector<buffer_string> versions;
+    auto edit = [&](size_t count) {
+        for (size_t n = 0; n < count; ++n) {
+            versions.push_back(ed.buf.copy_substr(0, ed.buf.size()));
+            set_ctx_cursor(&ed.ui, &ed.buf, rng() % (ed.buf.size() + 1));
+            if (rng() % 2 == 0) {
+                const buffer_string insertion = generate_text(1 + rng() % 100, rng());
+                (void)note_action(&ed.st, &ed.buf, insert_chars(ed.st.scratch(), &ed.ui, &ed.buf, insertion.data(), insertion.size()));
+            } else {
+                const size_t cursor = ed.buf.get_mark_offset(ed.ui.cursor_mark);
+                set_mark(&ed.ui, &ed.buf);
+                set_ctx_cursor(&ed.ui, &ed.buf, std::min<size_t>(ed.buf.size(), cursor + 1 + rng() % 100));
+                (void)kill_region(&ed.st, &ed.ui, &ed.buf);
+            }
+        }
+    };
+    auto save_and_load = [&] {
+        const buffer_string text = ed.buf.copy_substr(0, ed.buf.size());
+        write_file(path, text);
+        expect(!save_undo_file(path, ed.buf.text(), &ed.buf.undo_info).errored(), "save_undo_file");
+        bench_buffer loaded{buffer_string(text)};
+        expect(load_undo_file(path, std::nullopt, &loaded.buf.undo_info), "load_undo_file");
+        for (size_t i = versions.size(); i-- > 0; ) {
+            perform_undo(&loaded.st, &loaded.ui, &loaded.buf);
+            expect(loaded.buf.copy_substr(0, loaded.buf.size()) == versions[i], "undo after load_undo_file");
+        }
+    };
+    edit(100);
+    save_and_load();
+    edit(100);
+    save_and_load();
+
+    buffer_string changed = ed.buf.copy_substr(0, ed.buf.size());
+    changed[changed.size() / 2] = buffer_char{changed[changed.size() / 2] == buffer_char{'a'} ? uint8_t('b') : uint8_t('a')};
+    const fs::file_time_type mtime = fs::last_write_time(path);
+    write_file(path, changed);
+    fs::last_write_time(path, mtime);
+    undo_history history;
+    expect(!load_undo_file(path, std::nullopt, &history), "load_undo_file of a changed file");
+    fs::remove_all(dir);
+}
+
+// Moves rows top..bottom of a window's cells up by `shift` rows, or down if it's negative,
+// filling the rows left behind with `blank`.
+template <class T>
+void shift_rows(std::vector<T> *cells, size_t cols, uint32_t top, uint32_t bottom, int32_t shift, T blank) {
+    const uint32_t distance = uint32_t(std::abs(shift));
+    auto row = [&](uint32_t i) { return cells->begin() + i * cols; };
+    if (shift > 0) {
+        std::copy(row(top + distance), row(bottom + 1), row(top));
+        std::fill(row(bottom + 1 - distance), row(bottom + 1), blank);
+    } else {
+        std::copy_backward(row(top), row(bottom + 1 - distance), row(bottom + 1));
+        std::fill(row(top), row(top + distance), blank);
+    }
+}
+
+// A terminal that knows the escape sequences encode_frame writes.
+struct mock_terminal {
+    terminal_size window;
+    std::vector<terminal_char> data;
+    std::vector<terminal_style> style_data;
+    terminal_coord pos;
+    bool cursor_shown = true;
+    terminal_style pen = terminal_style::zero();
+    // The scrolling region.
+    uint32_t top = 0, bottom;
+    size_t scrolls = 0;
+
+    explicit mock_terminal(const terminal_size& w)
+        : window(w), data(size_t(w.rows) * w.cols, terminal_char{' '}),
+          style_data(size_t(w.rows) * w.cols, terminal_style::zero()), bottom(w.rows - 1) { }
+
+    void scroll(int32_t shift) {
+        expect(uint32_t(std::abs(shift)) <= bottom + 1 - top, "scrolling too far");
+        shift_rows(&data, window.cols, top, bottom, shift, terminal_char{' '});
+        shift_rows(&style_data, window.cols, top, bottom, shift, pen);
+        ++scrolls;
+    }
+
+    void write(const std::string& s) {
+        for (size_t i = 0; i < s.size(); ) {
+            const char c = s[i++];
+            if (c == '\r') {
+                pos.col = 0;
+            } else if (c == '\n') {
+                expect(pos.row + 1 < window.rows, "newline on the last row");
+                ++pos.row;
+            } else if (c == '\x1b') {
+                expect(i < s.size() && s[i] == '[', "escape sequence");
+                ++i;
+                const bool dec_private = i < s.size() && s[i] == '?';
+                i += dec_private;
+                std::vector<uint32_t> params{0};
+                bool has_params = false;
+                for (; i < s.size() && (isdigit(uint8_t(s[i])) || s[i] == ';'); ++i) {
+                    if (s[i] == ';') {
+                        params.push_back(0);
+                    } else {
+                        params.back() = params.back() * 10 + (s[i] - '0');
+                    }
+                    has_params = true;
+                }
+                expect(i < s.size(), "unterminated escape sequence");
+                const char final_char = s[i++];
+                auto param = [&](size_t j) { return j < params.size() && params[j] != 0 ? params[j] : 1; };
+                if (dec_private) {
+                    expect(params[0] == 25 && (final_char == 'h' || final_char == 'l'), "DEC private mode");
+                    cursor_shown = final_char == 'h';
+                } else if (final_char == 'H') {
+                    pos = terminal_coord{param(0) - 1, param(1) - 1};
+                    expect(pos.row < window.rows && pos.col < window.cols, "cursor move off the screen");
+                } else if (final_char == 'C') {
+                    pos.col += param(0);
+                    expect(pos.col < window.cols, "cursor move off the screen");
+                } else if (final_char == 'r') {
+                    top = has_params ? param(0) - 1 : 0;
+                    bottom = has_params ? param(1) - 1 : window.rows - 1;
+                    expect(top < bottom && bottom < window.rows, "scrolling region");
+                    pos = terminal_coord{};
+                } else if (final_char == 'S' || final_char == 'T') {
+                    scroll(final_char == 'S' ? int32_t(param(0)) : -int32_t(param(0)));
+                } else if (final_char == 'm') {
+                    for (uint32_t p : params) {
+                        if (p == 0) {
+                            pen = terminal_style::zero();
+                        } else if (p == 1) {
+                            pen.mask |= terminal_style::BOLD_BIT;
+                        } else if ((p >= 30 && p < 38) || (p >= 90 && p < 98)) {
+                            pen.mask |= terminal_style::FOREGROUND_BIT;
+                            pen.foreground = p >= 90 ? terminal_style::BRIGHT + (p - 90) : p - 30;
+                        } else {
+                            expect(false, "SGR parameter");
+                        }
+                    }
+                } else {
+                    expect(false, "escape sequence");
+                }
+            } else {
+                expect(pos.row < window.rows && pos.col < window.cols, "writing off the screen");
+                const size_t offset = size_t(pos.row) * window.cols + pos.col;
+                data[offset] = terminal_char{uint8_t(c)};
+                style_data[offset] = pen;
+                ++pos.col;
+            }
+        }
+    }
+};
+
+// Frames that scroll part of the screen, and change some cells, written to a mock terminal
+// as changed cells, checking that it shows each frame.
+void check_encode_frame() {
+    constexpr size_t FRAMES = 5000;
+    const terminal_size window = {.rows = 30, .cols = 40};
+    std::mt19937 rng(25);
+    const terminal_style styles[] = {terminal_style::zero(), terminal_style::bold(), terminal_style::red_text()};
+    terminal_frame frame = init_frame(window);
+    auto randomize_row = [&](uint32_t i) {
+        for (size_t j = size_t(i) * window.cols; j < size_t(i + 1) * window.cols; ++j) {
+            frame.data[j] = terminal_char{uint8_t("abc xyz"[rng() % 7])};
+            frame.style_data[j] = styles[rng() % 8 == 0 ? 1 + rng() % 2 : 0];
+        }
+    };
+    for (uint32_t i = 0; i < window.rows; ++i) {
+        randomize_row(i);
+    }
+    mock_terminal term(window);
+    terminal_screen screen;
+    for (size_t n = 0; n < FRAMES; ++n) {
+        if (n != 0) {
+            // Rows top..bottom move by shift, like a window scrolling.
+            const uint32_t top = rng() % 2 == 0 ? 0 : rng() % window.rows;
+            const uint32_t bottom = top + rng() % (window.rows - top);
+            const uint32_t distance = 1 + rng() % (bottom + 1 - top);
+            const int32_t shift = rng() % 2 == 0 ? int32_t(distance) : -int32_t(distance);
+            shift_rows(&frame.data, window.cols, top, bottom, shift, terminal_char{' '});
+            shift_rows(&frame.style_data, window.cols, top, bottom, shift, terminal_style::zero());
+            for (uint32_t i = 0; i < distance; ++i) {
+                randomize_row(shift > 0 ? bottom - i : top + i);
+            }
+            for (size_t k = rng() % 5; k > 0; --k) {
+                frame.data[rng() % frame.data.size()] = terminal_char{'#'};
+            }
+        }
+        frame.cursor = rng() % 4 == 0 ? std::nullopt
+            : std::optional<terminal_coord>{terminal_coord{uint32_t(rng() % window.rows), uint32_t(rng() % window.cols)}};
+
+        encode_frame(frame, &screen);
+        term.write(screen.write_buffer);
+        expect(same_chars(term.data, frame.data) && term.style_data == frame.style_data, "encode_frame cells");
+        expect(frame.cursor.has_value() ? term.cursor_shown && term.pos.row == frame.cursor->row
+               && term.pos.col == frame.cursor->col : !term.cursor_shown, "encode_frame cursor");
+    }
+    expect(term.scrolls != 0, "encode_frame scrolled");
+    printf("%zu frames checked, %zu scrolls, %.1f bytes per frame\n", FRAMES, term.scrolls,
+           double(screen.total_bytes) / screen.frames);
+}
+
+void bench_checks(size_t) {
+    check_mark_tree();
+    check_render_cache();
+    check_undo_file();
+    check_encode_frame();
+    printf("all checks passed\n");
+}
+
+struct benchmark {
+    const char *name;
+    const char *description;
+    void (*fn)(size_t size);
+};
+
+const benchmark benchmarks[] = {
+    {"stats", "compute_stats, serial and parallel", bench_stats},
+    {"chars", "char_scan kernels, for each instruction set", bench_chars},
+    {"load", "building text storage from a file's contents", bench_load},
+    {"lines", "line_index construction and lookups", bench_lines},
+    {"marks", "mark updates on typing and backspace (--size N means 1024 * N marks)", bench_marks},
+    {"snapshot", "text storage snapshots, read on another thread during edits", bench_snapshot},
+    {"backends", "one editing session on every text storage, checking they agree", bench_backends},
+    {"undo", "undoing and redoing 100k edits", bench_undo},
+    {"backspace", "1M coalesced backspaces, then undoing them", bench_backspace},
+    {"kills", "100k consecutive word kills, then yanking them", bench_kills},
+    {"killregion", "killing all the text, then yanking it", bench_kill_region},
+    {"frames", "terminal output per keypress and scroll step, full frames and changed cells only", bench_frames},
+    {"wrapped", "jumping around in a few very long lines, recentering the window", bench_wrapped},
+    {"checks", "round trips and invalidation: mark_tree, render_cache, undo files, encode_frame", bench_checks},
+};
+
+}  // namespace qwi
+
+void print_help(FILE *fp) {
+    fprintf(fp, "Usage: qwi_bench [benchmark...] [--size MiB]\n"
+            "  Runs the given benchmarks (or all of them) on generated text (default 256 MiB).\n"
+            "Benchmarks:\n");
+    for (const qwi::benchmark& b : qwi::benchmarks) {
+        fprintf(fp, "  %-10s %s\n", b.name, b.description);
+    }
+}
+
+int main(int argc, const char **argv) {
+    size_t size = size_t(256) << 20;
+    std::vector<const qwi::benchmark *> selected;
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--help")) {
+            print_help(stdout);
+            return 0;
+        } else if (0 == strcmp(argv[i], "--size") && i + 1 < argc) {
+            size = size_t(strtoull(argv[++i], nullptr, 10)) << 20;
+        } else {
+            const qwi::benchmark *found = nullptr;
+            for (const qwi::benchmark& b : qwi::benchmarks) {
+                if (0 == strcmp(argv[i], b.name)) {
+                    found = &b;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "Unknown benchmark '%s'.  See --help for usage.\n", argv[i]);
+                return 2;
+            }
+            selected.push_back(found);
+        }
+    }
+    if (selected.empty()) {
+        for (const qwi::benchmark& b : qwi::benchmarks) {
+            selected.push_back(&b);
+        }
+    }
+
+    printf("text storage: %s, size: %zu MiB\n",
+           QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_ROPE ? "rope"
+           : QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_GAP_BUFFER ? "gap buffer" : "piece table",
+           size >> 20);
+    for (const qwi::benchmark *b : selected) {
+        printf("== %s\n", b->name);
+        b->fn(size);
+    }
+    return 0;
+}
@@ -2,7 +2,6 @@
 
 #include <string.h>
 
-#include "arith.hpp"
 #include "error.hpp"
 
 // TODO: Slightly unhappy about this include dependency -- should the ui logic updates be
@@ -17,85 +16,89 @@ namespace qwi {
 
 static const std::string NO_ERROR{};
 
-void load_ctx_cursor(ui_window_ctx *ui, buffer *buf) {
-    buf->set_cursor_(get_ctx_cursor(ui, buf));
+// Edits of a file's text get journaled.
+void journal_insert(buffer *buf, size_t pos, const buffer_char *chs, size_t count) {
+    if (buf->married_file.has_value() && count != 0) {
+        buf->journal.note_insert(pos, chs, count);
+    }
 }
 
-void save_ctx_cursor(ui_window_ctx *ui, buffer *buf) {
-    buf->replace_mark(ui->cursor_mark, buf->cursor_());
+void journal_erase(buffer *buf, size_t pos, size_t count) {
+    if (buf->married_file.has_value() && count != 0) {
+        buf->journal.note_erase(pos, count);
+    }
 }
 
 void add_to_marks_as_of(buffer *buf, size_t first_offset, size_t count) {
-    for (size_t i = 0; i < buf->marks.size(); ++i) {
-        if (buf->marks[i].version != buffer::mark_data::unused && buf->marks[i].offset >= first_offset) {
-            buf->marks[i].offset = size_add(buf->marks[i].offset, count);
-        }
-    }
+    buf->mark_offsets.shift_from(first_offset, count);
 }
 
 // keep_marks_left (default to true) says keep the buffer's marks (other than the window's
 // cursor) on the left side of the insertion.  This is normal editor behavior.  We set to
 // false when undoing a deletion, which is used for one interval edge of careful mark
 // un-adjustment logic.
-insert_result insert_chars(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf, const buffer_char *chs, size_t count, bool keep_marks_left) {
-    // TODO: We don't want to load_ctx_cursor for read-only bufs (for performance).  In
-    // other functions here as well.
+insert_result insert_chars(scratch_frame *, ui_window_ctx *ui, buffer *buf, shared_text text, bool keep_marks_left) {
     const size_t og_cursor = get_ctx_cursor(ui, buf);
     if (buf->read_only) {
         return {
             .new_cursor = og_cursor,
-            .insertedText = buffer_string{},
+            .insertedText = shared_text{},
             .side = Side::left,
             .error_message = "Buffer is read-only",  // TODO: UI logic
         };
     }
 
-    buf->set_cursor_(og_cursor);
-    buf->bef_.append(chs, count);
-    const size_t new_cursor = buf->bef_.size();
-    buf->bef_stats_ = append_stats(buf->bef_stats_, compute_stats(chs, count));
+    const buffer_char *chs = text.data();
+    const size_t count = text.size();
+    buf->text_.insert(og_cursor, chs, count);
+    buf->lines_.note_insert(buf->text_, og_cursor, chs, count);
+    buf->rendered_lines_.note_insert(og_cursor, count);
+    journal_insert(buf, og_cursor, chs, count);
+    const size_t new_cursor = og_cursor + count;
     add_to_marks_as_of(buf, og_cursor + keep_marks_left, count);
 
     ui->virtual_column = std::nullopt;
 
-    set_ctx_cursor(ui, buf);
+    set_ctx_cursor(ui, buf, new_cursor);
 
-    recenter_cursor_if_offscreen(scratch, ui, buf);
+    recenter_cursor_if_offscreen(ui, buf);
 
     return {
         .new_cursor = new_cursor,
-        .insertedText = buffer_string(chs, count),
+        .insertedText = std::move(text),
         .side = Side::left,
         .error_message = NO_ERROR };
 }
 
-insert_result insert_chars_right(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, const buffer_char *chs, size_t count) {
+insert_result insert_chars_right(scratch_frame *, ui_window_ctx *ui, buffer *buf, shared_text text) {
     const size_t og_cursor = get_ctx_cursor(ui, buf);
-    load_ctx_cursor(ui, buf);
     if (buf->read_only) {
         return {
             .new_cursor = og_cursor,
-            .insertedText = buffer_string{},
+            .insertedText = shared_text{},
             .side = Side::right,
             .error_message = "Buffer is read-only",  // TODO: UI logic
         };
     }
 
-    buf->set_cursor_(og_cursor);
-    buf->aft_.insert(0, chs, count);
-    buf->aft_stats_ = append_stats(compute_stats(chs, count), buf->aft_stats_);
+    const buffer_char *chs = text.data();
+    const size_t count = text.size();
+    buf->text_.insert(og_cursor, chs, count);
+    buf->lines_.note_insert(buf->text_, og_cursor, chs, count);
+    buf->rendered_lines_.note_insert(og_cursor, count);
+    journal_insert(buf, og_cursor, chs, count);
     add_to_marks_as_of(buf, og_cursor + 1, count);
 
     ui->virtual_column = std::nullopt;
 
     // Actually necessary, as long as add_to_marks_as_of above pushes cursor_mark to the right.
-    set_ctx_cursor(ui, buf);
+    set_ctx_cursor(ui, buf, og_cursor);
 
-    recenter_cursor_if_offscreen(scratch_frame, ui, buf);
+    recenter_cursor_if_offscreen(ui, buf);
 
     return {
         .new_cursor = og_cursor,
-        .insertedText = buffer_string(chs, count),
+        .insertedText = std::move(text),
         .side = Side::right,
         .error_message = NO_ERROR,
     };
@@ -105,14 +108,15 @@ insert_result insert_chars_right(scratch_frame *scratch_frame, ui_window_ctx *ui
 // cursor (it's per-window, part of ui_window_ctx now).
 void force_insert_chars_end_before_cursor(buffer *buf,
                                           const buffer_char *chs, size_t count) {
-    region_stats stats = compute_stats(chs, count);
-
     // TODO: We want to update the cursor for every window where the *Messages* buf is
     // active, if the cursor is at the end of the buf.  Our logic here is currently silly,
     // in the multi-window case.
 
-    buf->aft_stats_ = append_stats(buf->aft_stats_, stats);
-    buf->aft_.append(chs, count);
+    const size_t og_size = buf->text_.size();
+    buf->text_.insert(og_size, chs, count);
+    buf->lines_.note_insert(buf->text_, og_size, chs, count);
+    buf->rendered_lines_.note_insert(og_size, count);
+    journal_insert(buf, og_size, chs, count);
 
     // TODO: We'll want this for every window where the *Messages* buf is active, likewise.
 #if 0
@@ -125,84 +129,72 @@ void force_insert_chars_end_before_cursor(buffer *buf,
     // We _don't_ recenter cursor if offscreen.
 }
 
+void append_loaded_text(buffer *buf, text_storage&& chunk, line_index&& chunk_lines) {
+    const size_t og_size = buf->text_.size();
+    buf->text_.append(std::move(chunk));
+    buf->lines_.append(std::move(chunk_lines));
+    buf->rendered_lines_.note_insert(og_size, buf->text_.size() - og_size);
+}
+
 // squeezed_marks has different values for delete_left than delete_right -- see comment in
 // atomic_undo_item, undo logic, etc.
 void update_marks_for_delete_left_range(buffer *buf, size_t range_beg, size_t range_end,
                                          std::vector<std::pair<weak_mark_id, size_t>> *squeezed_marks_append) {
-    for (size_t i = 0; i < buf->marks.size(); ++i) {
-        const buffer::mark_data& elem = buf->marks[i];
-        if (elem.version == 0) {
-            continue;
-        }
-
-        size_t offset = elem.offset;
-        if (offset >= range_end) {
-            offset -= (range_end - range_beg);
-        } else if (offset >= range_beg) {
+    // Marks in [range_beg, range_end) get squeezed.
+    buf->mark_offsets.collapse_range(
+        range_beg, range_end, range_beg, range_end - range_beg, [&](size_t i, size_t offset) {
             // A squeezed mark is the value, in (0, N], where N = range_end - range_beg,
             // that we subtract from the end of the range, when moving the mark back to
             // its final position.
-            squeezed_marks_append->emplace_back(weak_mark_id{.version = elem.version, .index = i},
+            squeezed_marks_append->emplace_back(weak_mark_id{.version = buf->marks[i].version, .index = i},
                                                 range_end - offset);
-            offset = range_beg;
-        }
-        buf->marks[i].offset = offset;
-    }
+        });
 }
 
 void update_marks_for_delete_right_range(buffer *buf, size_t range_beg, size_t range_end,
                                          std::vector<std::pair<weak_mark_id, size_t>> *squeezed_marks_append) {
-    for (size_t i = 0; i < buf->marks.size(); ++i) {
-        const buffer::mark_data& elem = buf->marks[i];
-        if (elem.version == 0) {
-            continue;
-        }
-
-        size_t offset = elem.offset;
-        if (offset > range_end) {
-            offset -= (range_end - range_beg);
-        } else if (offset > range_beg) {
-            squeezed_marks_append->emplace_back(weak_mark_id{.version = elem.version, .index = i},
+    // Marks in (range_beg, range_end] get squeezed.
+    buf->mark_offsets.collapse_range(
+        range_beg + 1, range_end + 1, range_beg, range_end - range_beg, [&](size_t i, size_t offset) {
+            squeezed_marks_append->emplace_back(weak_mark_id{.version = buf->marks[i].version, .index = i},
                                                 offset - range_beg);
-            offset = range_beg;
-        }
-        buf->marks[i].offset = offset;
-    }
+        });
 }
 
-delete_result delete_left(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, size_t og_count) {
+delete_result delete_left(scratch_frame *, ui_window_ctx *ui, buffer *buf, size_t og_count) {
     const size_t og_cursor = get_ctx_cursor(ui, buf);
     if (buf->read_only) {
         return {
             .new_cursor = og_cursor,
-            .deletedText = buffer_string{},
+            .deletedText = {},
             .side = Side::left,
             .squeezed_marks = {},
             .error_message = "Buffer is read-only",  // TODO: UI logic
         };
     }
 
-    buf->set_cursor_(og_cursor);
-
     const size_t count = std::min<size_t>(og_count, og_cursor);
     const size_t new_cursor = og_cursor - count;
 
     delete_result ret;
     ret.new_cursor = new_cursor;
-    ret.deletedText.assign(buf->bef_, new_cursor, count);
+    buffer_string deleted;
+    buf->text_.erase(new_cursor, count, &deleted);
+    buf->lines_.note_erase(new_cursor, deleted.data(), deleted.size());
+    buf->rendered_lines_.note_erase(new_cursor, count);
+    // The only copy of the text -- the undo history and kill ring share it.
+    ret.deletedText = shared_text(std::move(deleted));
+    journal_erase(buf, new_cursor, count);
     ret.side = Side::left;
 
-    buf->bef_stats_ = subtract_stats_right(buf->bef_stats_,
-                                           buf->bef_.data(), new_cursor, buf->bef_.size());
-    buf->bef_.resize(new_cursor);
     update_marks_for_delete_left_range(buf, new_cursor, og_cursor, &ret.squeezed_marks);
     // TODO: XXX: Where should we filter the current window ctx's cursor in squeezed_marks?
 
     ui->virtual_column = std::nullopt;
 
-    set_ctx_cursor(ui, buf);  // Should be a no-op, but whatever.
+    set_ctx_cursor(ui, buf, new_cursor);  // Should be a no-op, but whatever.
 
-    recenter_cursor_if_offscreen(scratch_frame, ui, buf);
+    recenter_cursor_if_offscreen(ui, buf);
 
     if (count < og_count) {
         ret.error_message = "Beginning of buffer";  // TODO: Bad place for UI logic
@@ -210,39 +202,40 @@ delete_result delete_left(scratch_frame *scratch_frame, ui_window_ctx *ui, buffe
     return ret;
 }
 
-delete_result delete_right(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, size_t og_count) {
+delete_result delete_right(scratch_frame *, ui_window_ctx *ui, buffer *buf, size_t og_count) {
     const size_t cursor = get_ctx_cursor(ui, buf);
     if (buf->read_only) {
         return {
             .new_cursor = cursor,
-            .deletedText = buffer_string{},
+            .deletedText = {},
             .side = Side::right,
             .squeezed_marks = {},
             .error_message = "Buffer is read-only",  // TODO: UI logic
         };
     }
 
-    buf->set_cursor_(cursor);
-
-    const size_t count = std::min<size_t>(og_count, buf->aft_.size());
+    const size_t count = std::min<size_t>(og_count, buf->size() - cursor);
 
     delete_result ret;
     ret.new_cursor = cursor;
-    ret.deletedText.assign(buf->aft_, 0, count);
+    buffer_string deleted;
+    buf->text_.erase(cursor, count, &deleted);
+    buf->lines_.note_erase(cursor, deleted.data(), deleted.size());
+    buf->rendered_lines_.note_erase(cursor, count);
+    // The only copy of the text -- the undo history and kill ring share it.
+    ret.deletedText = shared_text(std::move(deleted));
+    journal_erase(buf, cursor, count);
     ret.side = Side::right;
 
-    buf->aft_stats_ = subtract_stats_left(buf->aft_stats_, compute_stats(buf->aft_.data(), count),
-                                          buf->aft_.data() + count, buf->aft_.size() - count);
-    buf->aft_.erase(0, count);
     update_marks_for_delete_right_range(buf, cursor, cursor + count, &ret.squeezed_marks);
     // TODO: XXX: squeezed_marks might include the current window ctx's cursor.  Keep it clean.
 
     // TODO: We don't do this for doDeleteRight (or doAppendRight) in jsmacs -- the bug is in jsmacs!
     ui->virtual_column = std::nullopt;
 
-    set_ctx_cursor(ui, buf);  // Definitely a no-op.
+    set_ctx_cursor(ui, buf, cursor);  // Definitely a no-op.
 
-    recenter_cursor_if_offscreen(scratch_frame, ui, buf);
+    recenter_cursor_if_offscreen(ui, buf);
 
     if (count < og_count) {
         ret.error_message = "End of buffer";  // TODO: Bad place for UI logic
@@ -250,26 +243,23 @@ delete_result delete_right(scratch_frame *scratch_frame, ui_window_ctx *ui, buff
     return ret;
 }
 
-void move_right_by(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, size_t count) {
+void move_right_by(scratch_frame *, ui_window_ctx *ui, buffer *buf, size_t count) {
     const size_t cursor = get_ctx_cursor(ui, buf);
     count = std::min<size_t>(count, buf->size() - cursor);
-    // Calling set_cursor isn't necessary, but it reduces (line, col) computation cost when rendering.
-    buf->set_cursor_(cursor + count);
+    // We don't move the buffer's gap -- navigation shouldn't relocate text.
     // TODO: Should we set virtual_column if count is 0?  (Can count be 0?)
     ui->virtual_column = std::nullopt;
-    set_ctx_cursor(ui, buf);
-    recenter_cursor_if_offscreen(scratch_frame, ui, buf);
+    set_ctx_cursor(ui, buf, cursor + count);
+    recenter_cursor_if_offscreen(ui, buf);
 }
 
-void move_left_by(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, size_t count) {
+void move_left_by(scratch_frame *, ui_window_ctx *ui, buffer *buf, size_t count) {
     const size_t cursor = get_ctx_cursor(ui, buf);
     count = std::min<size_t>(count, cursor);
-    // Calling set_cursor isn't necessary, but it reduces (line, col) computation cost when rendering.
-    buf->set_cursor_(cursor - count);
     // TODO: Should we set virtual_column if count is 0?  (Can count be 0?)
     ui->virtual_column = std::nullopt;
-    set_ctx_cursor(ui, buf);
-    recenter_cursor_if_offscreen(scratch_frame, ui, buf);
+    set_ctx_cursor(ui, buf, cursor - count);
+    recenter_cursor_if_offscreen(ui, buf);
 }
 
 void set_mark(ui_window_ctx *ui, buffer *buf) {
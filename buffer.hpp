@@ -8,13 +8,18 @@ namespace qwi {
 struct [[nodiscard]] insert_result {
     // Cursor position _after_ insertion
     size_t new_cursor;
-    // Returned only to make implementing opposite(const undo_info&) easier.
-    buffer_string insertedText;
+    // Returned only to make implementing opposite(const undo_info&) easier.  It's the text
+    // passed in, shared, if that was a shared_text.
+    shared_text insertedText;
     Side side;
     std::string error_message;  // "" or "Buffer is read only"
 };
 
-insert_result insert_chars(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, const buffer_char *chs, size_t count, bool keep_marks_left = true);
+insert_result insert_chars(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, shared_text text, bool keep_marks_left = true);
+
+inline insert_result insert_chars(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, const buffer_char *chs, size_t count, bool keep_marks_left = true) {
+    return insert_chars(scratch_frame, ui, buf, shared_text(buffer_string(chs, count)), keep_marks_left);
+}
 
 inline insert_result insert_char(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, buffer_char sch) {
     return insert_chars(scratch_frame, ui, buf, &sch, 1);
@@ -24,16 +29,21 @@ inline insert_result insert_char(scratch_frame *scratch_frame, ui_window_ctx *ui
     return insert_chars(scratch_frame, ui, buf, &ch, 1);
 }
 
-insert_result insert_chars_right(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, const buffer_char *chs, size_t count);
+insert_result insert_chars_right(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, shared_text text);
 
 void force_insert_chars_end_before_cursor(ui_window_ctx *ui, buffer *buf,
                                           const buffer_char *chs, size_t count);
 
+// Appends a chunk of a file being loaded, with its line index.  Like
+// force_insert_chars_end_before_cursor, this bypasses read-only and undo.  Marks are
+// unaffected because they're all left of the end.
+void append_loaded_text(buffer *buf, text_storage&& chunk, line_index&& chunk_lines);
+
 // TODO: Maximal efficiency: don't construct a delete_result on exactly the funcalls that don't use it.
 struct [[nodiscard]] delete_result {
     // Cursor position _after_ deletion.
     size_t new_cursor;
-    buffer_string deletedText;
+    shared_text deletedText;
     Side side;
     // Given the text in interval [a, b) got deleted, a list of all marks in the interval
     // (a, b], whose positions got "squashed" to `a`, and might get unsquashed upon an
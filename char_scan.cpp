@@ -0,0 +1,229 @@
+#include "char_scan.hpp"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QWI_CHAR_SCAN_X86 1
+#else
+#define QWI_CHAR_SCAN_X86 0
+#endif
+
+namespace qwi {
+
+namespace {
+
+bool is_control_char(uint8_t ch) {
+    return ch < 32 || ch == 127;
+}
+
+size_t scalar_count_newlines(const buffer_char *data, size_t count) {
+    size_t ret = 0;
+    for (size_t i = 0; i < count; ++i) {
+        ret += (data[i] == buffer_char{'\n'});
+    }
+    return ret;
+}
+
+size_t scalar_find_after_last(const buffer_char *data, size_t count, buffer_char ch) {
+    size_t i = count - 1;
+    // Playing games with underflow.
+    for (; i != size_t(-1); --i) {
+        if (data[i] == ch) {
+            break;
+        }
+    }
+    return i + 1;
+}
+
+bool scalar_is_single_width(const buffer_char *data, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (is_control_char(data[i].value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const char_scan_kernels scalar_kernels = {
+    .name = "scalar",
+    .count_newlines = scalar_count_newlines,
+    .find_after_last = scalar_find_after_last,
+    .is_single_width = scalar_is_single_width,
+};
+
+#if QWI_CHAR_SCAN_X86
+
+// The SSE2 and AVX2 kernels have the same shape:  whole vectors, then the scalar kernel
+// on what's left over.
+//
+// Newline counts accumulate per byte lane (cmpeq gives -1 on a match, which we subtract),
+// and get summed with sad_epu8 before a lane can overflow.
+
+// The number of vectors we can accumulate before a byte lane could overflow.
+constexpr size_t MAX_LANE_ACCUMULATIONS = 255;
+
+__attribute__((target("sse2")))
+size_t sse2_count_newlines(const buffer_char *data, size_t count) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t ret = 0;
+    size_t i = 0;
+    while (count - i >= 16) {
+        __m128i acc = zero;
+        for (size_t n = 0; n < MAX_LANE_ACCUMULATIONS && count - i >= 16; ++n, i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, newline));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        ret += size_t(_mm_extract_epi16(sums, 0)) + size_t(_mm_extract_epi16(sums, 4));
+    }
+    return ret + scalar_count_newlines(data + i, count - i);
+}
+
+__attribute__((target("sse2")))
+size_t sse2_find_after_last(const buffer_char *data, size_t count, buffer_char ch) {
+    const __m128i needle = _mm_set1_epi8(char(ch.value));
+    size_t i = count;
+    for (; i >= 16; i -= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i - 16));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask != 0) {
+            return i - 16 + (32 - __builtin_clz(mask));
+        }
+    }
+    return scalar_find_after_last(data, i, ch);
+}
+
+__attribute__((target("sse2")))
+bool sse2_is_single_width(const buffer_char *data, size_t count) {
+    // Control chars are those <= 31 (as unsigned bytes) and 127.
+    const __m128i max_control = _mm_set1_epi8(31);
+    const __m128i del = _mm_set1_epi8(127);
+    size_t i = 0;
+    for (; count - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i control = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, max_control), v),
+                                       _mm_cmpeq_epi8(v, del));
+        if (_mm_movemask_epi8(control) != 0) {
+            return false;
+        }
+    }
+    return scalar_is_single_width(data + i, count - i);
+}
+
+const char_scan_kernels sse2_kernels = {
+    .name = "sse2",
+    .count_newlines = sse2_count_newlines,
+    .find_after_last = sse2_find_after_last,
+    .is_single_width = sse2_is_single_width,
+};
+
+__attribute__((target("avx2")))
+size_t avx2_count_newlines(const buffer_char *data, size_t count) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t ret = 0;
+    size_t i = 0;
+    while (count - i >= 32) {
+        __m256i acc = zero;
+        for (size_t n = 0; n < MAX_LANE_ACCUMULATIONS && count - i >= 32; ++n, i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, newline));
+        }
+        __m256i sums = _mm256_sad_epu8(acc, zero);
+        ret += size_t(_mm256_extract_epi16(sums, 0)) + size_t(_mm256_extract_epi16(sums, 4))
+            + size_t(_mm256_extract_epi16(sums, 8)) + size_t(_mm256_extract_epi16(sums, 12));
+    }
+    return ret + sse2_count_newlines(data + i, count - i);
+}
+
+__attribute__((target("avx2")))
+size_t avx2_find_after_last(const buffer_char *data, size_t count, buffer_char ch) {
+    const __m256i needle = _mm256_set1_epi8(char(ch.value));
+    size_t i = count;
+    for (; i >= 32; i -= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i - 32));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask != 0) {
+            return i - 32 + (32 - __builtin_clz(mask));
+        }
+    }
+    return sse2_find_after_last(data, i, ch);
+}
+
+__attribute__((target("avx2")))
+bool avx2_is_single_width(const buffer_char *data, size_t count) {
+    const __m256i max_control = _mm256_set1_epi8(31);
+    const __m256i del = _mm256_set1_epi8(127);
+    size_t i = 0;
+    // Two vectors per check of the movemask.
+    for (; count - i >= 64; i += 64) {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32));
+        __m256i control = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v0, max_control), v0),
+                            _mm256_cmpeq_epi8(v0, del)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v1, max_control), v1),
+                            _mm256_cmpeq_epi8(v1, del)));
+        if (_mm256_movemask_epi8(control) != 0) {
+            return false;
+        }
+    }
+    return sse2_is_single_width(data + i, count - i);
+}
+
+const char_scan_kernels avx2_kernels = {
+    .name = "avx2",
+    .count_newlines = avx2_count_newlines,
+    .find_after_last = avx2_find_after_last,
+    .is_single_width = avx2_is_single_width,
+};
+
+#endif  // QWI_CHAR_SCAN_X86
+
+}  // namespace
+
+size_t find_after_nth_newline(const buffer_char *data, size_t count, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    // Skip whole blocks by their newline count, then find the newline in the last one.
+    constexpr size_t BLOCK_SIZE = 4096;
+    size_t i = 0;
+    for (; count - i > BLOCK_SIZE; i += BLOCK_SIZE) {
+        size_t block_newlines = count_newlines(data + i, BLOCK_SIZE);
+        if (block_newlines >= n) {
+            break;
+        }
+        n -= block_newlines;
+    }
+    for (; i < count; ++i) {
+        i += find_first(data + i, count - i, buffer_char{'\n'});
+        if (i == count || --n == 0) {
+            break;
+        }
+    }
+    return std::min(i + 1, count);
+}
+
+std::vector<const char_scan_kernels *> supported_char_scans() {
+    std::vector<const char_scan_kernels *> ret = { &scalar_kernels };
+#if QWI_CHAR_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        ret.push_back(&sse2_kernels);
+        if (__builtin_cpu_supports("avx2")) {
+            ret.push_back(&avx2_kernels);
+        }
+    }
+#endif
+    return ret;
+}
+
+const char_scan_kernels& char_scan() {
+    static const char_scan_kernels *const best = supported_char_scans().back();
+    return *best;
+}
+
+}  // namespace qwi
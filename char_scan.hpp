@@ -0,0 +1,59 @@
+#ifndef QWERTILLION_CHAR_SCAN_HPP_
+#define QWERTILLION_CHAR_SCAN_HPP_
+
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#include "chars.hpp"
+
+namespace qwi {
+
+// Scans of buffer text that stats computation and line movement spend their time in.  On
+// x86 they're vectorized, with SSE2 or AVX2 chosen at runtime by what the CPU supports.
+struct char_scan_kernels {
+    const char *name;
+    size_t (*count_newlines)(const buffer_char *data, size_t count);
+    // Returns one past the index of the last ch in [data, data + count), or 0 if there is
+    // none.
+    size_t (*find_after_last)(const buffer_char *data, size_t count, buffer_char ch);
+    // True if there are no tabs, newlines, or other control characters -- i.e. every char
+    // renders in one column, and the text's width is its length.
+    bool (*is_single_width)(const buffer_char *data, size_t count);
+};
+
+// The best kernels this CPU supports.
+const char_scan_kernels& char_scan();
+// All the kernels this CPU supports, starting with the scalar ones.  For benchmarks.
+std::vector<const char_scan_kernels *> supported_char_scans();
+
+inline size_t count_newlines(const buffer_char *data, size_t count) {
+    return char_scan().count_newlines(data, count);
+}
+
+inline size_t find_after_last(const buffer_char *data, size_t count, buffer_char ch) {
+    return char_scan().find_after_last(data, count, ch);
+}
+
+inline bool is_single_width(const buffer_char *data, size_t count) {
+    return char_scan().is_single_width(data, count);
+}
+
+// Returns the index of the first ch in [data, data + count), or count if there is none.
+// (memchr is vectorized already.)
+inline size_t find_first(const buffer_char *data, size_t count, buffer_char ch) {
+    if (count == 0) {
+        return 0;
+    }
+    const void *p = memchr(data, ch.value, count);
+    return p ? static_cast<const buffer_char *>(p) - data : count;
+}
+
+// Returns one past the index of the n'th newline (counting from 1) in [data, data +
+// count), or count if there are fewer than n.
+size_t find_after_nth_newline(const buffer_char *data, size_t count, size_t n);
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_CHAR_SCAN_HPP_
@@ -1,5 +1,8 @@
 #include "chars.hpp"
 
+#include <algorithm>
+#include <utility>
+
 namespace qwi {
 
 buffer_string to_buffer_string(const std::string& s) {
@@ -7,4 +10,19 @@ buffer_string to_buffer_string(const std::string& s) {
     return ret;
 }
 
+void front_slack_string::prepend(const buffer_char *chs, size_t count) {
+    if (front < count) {
+        // As much slack as the resulting text's size.
+        const size_t slack = size() + count;
+        buffer_string grown;
+        grown.reserve(slack + size());
+        grown.resize(slack);
+        grown.append(storage, front);
+        storage = std::move(grown);
+        front = slack;
+    }
+    front -= count;
+    std::copy(chs, chs + count, storage.begin() + front);
+}
+
 }  // namespace qwi
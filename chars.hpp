@@ -22,6 +22,20 @@ using buffer_string = std::basic_string<buffer_char>;
 
 buffer_string to_buffer_string(const std::string& s);
 
+// A string that grows cheaply at both ends:  prepending goes into slack kept in front of
+// the text, which gets reallocated geometrically, like the capacity at the end.
+struct front_slack_string {
+    // The slack, then the text.
+    buffer_string storage;
+    size_t front = 0;
+
+    std::span<const buffer_char> span() const { return std::span<const buffer_char>(storage).subspan(front); }
+    size_t size() const { return storage.size() - front; }
+    // Amortized O(count).
+    void prepend(const buffer_char *chs, size_t count);
+    void append(const buffer_char *chs, size_t count) { storage.append(chs, count); }
+};
+
 // Does "Side" belong here?  The side of some insertion or deletion relative to the
 // cursor?  Not really, but where should it go?
 enum class Side { left, right, };
@@ -1,12 +1,19 @@
 #include "editing.hpp"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
 #include <filesystem>
-#include <fstream>
 #include <unordered_set>
 
+#include "arith.hpp"
 #include "io.hpp"
 #include "movement.hpp"
 #include "layout.hpp"
+#include "undo_file.hpp"
 #include "util.hpp"
 
 namespace fs = std::filesystem;
@@ -17,7 +24,7 @@ atomic_undo_item make_reverse_action(const undo_history *history, insert_result&
     atomic_undo_item item = {
         .beg = i_res.new_cursor,
         .text_deleted = std::move(i_res.insertedText),
-        .text_inserted = buffer_string{},
+        .text_inserted = shared_text{},
         .side = i_res.side,  // We inserted on left (right), hence we delete on left (right)
         .mark_adjustments = {},
         .before_node = history->unused_node_number(),
@@ -163,6 +170,12 @@ prompt buffer_close_prompt(buffer&& initialBuf) {
                     needs_new_target.push_back(win_needs_new_target);
                 }
 
+                if (state->lookup(closed_id)->loading) {
+                    std::erase_if(state->file_loaders, [&](const std::unique_ptr<file_loader>& loader) {
+                        return loader->buf_id() == closed_id;
+                    });
+                }
+                discard_journal(state, state->lookup(closed_id));
                 state->buf_set.erase(closed_id);
 
                 // buf_set or the window's tab set might be empty.  Not allowed.
@@ -226,6 +239,9 @@ undo_killring_handled cancel_action(state *state, buffer *buf) {
     // We break the yank and undo sequence in `buf` -- of course, when creating the status
     // prompt, we already broke the yank and undo sequence in the _original_ buf.
     undo_killring_handled ret = note_backout_action(state, buf);
+    if (buf->loading) {
+        cancel_file_load(state, buf);
+    }
 
     return ret;
 }
@@ -289,7 +305,7 @@ undo_killring_handled kill_region(state *state, ui_window_ctx *ui, buffer *buf)
         // that we can't "do nothing" -- if state->clipboard.justRecorded is false, we
         // need to create an empty string clipboard entry.  That's what this record_yank
         // call does.
-        record_yank(&state->clipboard, buffer_string{}, yank_side::right);
+        record_yank(&state->clipboard, shared_text{}, yank_side::right);
         note_nop_undo(buf);
         return handled_undo_killring(state, buf);
     }
@@ -308,7 +324,7 @@ undo_killring_handled copy_region(state *state, ui_window_ctx *ui, buffer *buf)
     size_t region_end = std::max(mark, cursor);
 
     note_nop_undo(buf);
-    record_yank(&state->clipboard, buf->copy_substr(region_beg, region_end), yank_side::none);
+    record_yank(&state->clipboard, shared_text(buf->copy_substr(region_beg, region_end)), yank_side::none);
     return handled_undo_killring(state, buf);
 }
 
@@ -340,7 +356,7 @@ prompt file_open_prompt(buffer_id promptBufId) {
                 state->buf_set.emplace(buf_id, std::make_unique<buffer>(std::move(buf)));
                 apply_number_to_buf(state, buf_id);
                 state->active_window()->point_at(buf_id, state);
-
+                offer_journal_recovery(state);
             } else {
                 state->note_error_message("No filename given");
             }
@@ -359,22 +375,89 @@ undo_killring_handled open_file_action(state *state, buffer *active_buf) {
     return ret;
 }
 
-[[nodiscard]] ui_result save_buf_to_married_file_and_mark_unmodified(buffer *buf) {
+static ui_result write_text(int fd, const text_storage& text) {
+    ui_result res = ui_result::success();
+    text.for_each_span(0, text.size(), [&](std::span<const buffer_char> span) {
+        if (!res.errored()) {
+            res = write_all(fd, span.data(), span.size());
+        }
+    });
+    return res;
+}
+
+// Writes buf's text to path, straight from its text storage.  (A snapshot would be a deep
+// copy for gap_buffer, and for piece_table once it's unmapped.)  Where we can, we write a
+// new file and rename it over the old one, so that a mapping of the old file (see
+// piece_table) stays intact.  That would split hard links and lose the owner of a file
+// that isn't ours, so then we overwrite the file in place -- as we do with text storages
+// that never map files, and when we can't create a file in the directory.
+static ui_result write_buf_to_file(buffer *buf, const fs::path& path) {
+    struct stat st;
+    const bool exists = stat(path.c_str(), &st) == 0;
+#if QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_PIECE_TABLE
+    const bool in_place = exists && (st.st_nlink > 1 || st.st_uid != geteuid());
+#else
+    const bool in_place = true;
+#endif
+    if (!in_place) {
+        file_descriptor fd;
+        std::string tmp_path;
+        ui_result res = open_replacement_file(path, &fd, &tmp_path);
+        if (!res.errored()) {
+            res = write_text(fd.fd, buf->text());
+            if (res.errored()) {
+                int discard = unlink(tmp_path.c_str());
+                (void)discard;
+                return ui_result::error("error writing to file " + path.native() + ": " + res.message);
+            }
+            return commit_replacement_file(&fd, tmp_path, path);
+        }
+        if (!exists) {
+            return res;
+        }
+    }
+
+#if QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_PIECE_TABLE
+    // Truncating the file would pull the text out from under the piece table.
+    buf->unmap_text();
+#endif
+    file_descriptor fd;
+    ui_result res = open_file_for_overwrite(path, &fd);
+    if (res.errored()) {
+        return res;
+    }
+    res = write_text(fd.fd, buf->text());
+    if (res.errored()) {
+        return ui_result::error("error writing to file " + path.native() + ": " + res.message);
+    }
+    return sync_and_close(&fd, path);
+}
+
+[[nodiscard]] ui_result save_buf_to_married_file_and_mark_unmodified(state *state, buffer *buf) {
     // TODO: Display that save succeeded, somehow.
     logic_check(buf->married_file.has_value(), "save_buf_to_married_file with unmarried buf");
-    std::ofstream fstream(*buf->married_file, std::ios::binary | std::ios::trunc);
-    if (fstream.fail()) {
-        return ui_result::error("error opening file " + *buf->married_file + " for write");
+    if (buf->loading) {
+        return ui_result::error("Cannot save a file that is still loading");
     }
-    // TODO: Write a temporary file and rename it.  Use pwrite.  Etc.
-    fstream.write(as_chars(buf->bef_.data()), buf->bef_.size());
-    fstream.write(as_chars(buf->aft_.data()), buf->aft_.size());
-    fstream.close();
-    if (fstream.fail()) {
-        return ui_result::error("error writing to file " + *buf->married_file);
+    const fs::path path = *buf->married_file;
+    // If the file is a symlink, we save to its target, instead of replacing the link.
+    std::error_code ec;
+    fs::path target = fs::canonical(path, ec);
+    ui_result res = write_buf_to_file(buf, ec ? path : target);
+    if (res.errored()) {
+        return res;
     }
 
     buf->non_modified_undo_node = buf->undo_info.current_node;
+    // The file has our edits now.  (After a save-as, the journal is the old file's.)
+    discard_journal(state, buf);
+    buf->journal.file_header = journal_header(path);
+
+    // Undo history gets written only now, to stay off the keystroke path.
+    res = save_undo_file(path, buf->text(), &buf->undo_info);
+    if (res.errored()) {
+        return ui_result::error("saved file, but not its undo history: " + res.message);
+    }
     return ui_result::success();
 }
 
@@ -393,7 +476,7 @@ prompt file_save_prompt(buffer_id promptBufId) {
                 buffer_id buf_id = state->active_window()->active_buf().first;
                 buffer *buf = state->lookup(buf_id);
                 buf->married_file = text;
-                ui_result res = save_buf_to_married_file_and_mark_unmodified(buf);
+                ui_result res = save_buf_to_married_file_and_mark_unmodified(state, buf);
                 if (res.errored()) {
                     state->note_error(std::move(res));
                     // fall through
@@ -418,7 +501,7 @@ undo_killring_handled save_file_action(state *state, buffer *active_buf) {
     }
 
     if (active_buf->married_file.has_value()) {
-        ui_result res = save_buf_to_married_file_and_mark_unmodified(active_buf);
+        ui_result res = save_buf_to_married_file_and_mark_unmodified(state, active_buf);
         if (res.errored()) {
             state->note_error(std::move(res));
         }
@@ -531,11 +614,88 @@ undo_killring_handled buffer_switch_action(state *state, buffer *active_buf) {
     return ret;
 }
 
+static std::string load_cost_message(const std::string& path, uintmax_t filesize, const resource_usage& cost) {
+    return "Loaded " + path + " (" + std::to_string(filesize) + " bytes) in "
+        + std::to_string(int64_t(cost.seconds * 1000)) + " ms, "
+        + std::to_string(cost.minor_faults) + " minor and "
+        + std::to_string(cost.major_faults) + " major page faults";
+}
+
+// Sets *background_out if we started a file_loader for buf_id (and *out is empty).
+static ui_result load_file_text(state *state, const fs::path& path, buffer_id buf_id,
+                                text_storage *out, bool *background_out) {
+    *background_out = false;
+    std::error_code ec;
+    uintmax_t filesize = fs::file_size(path, ec);
+    if (ec) {
+        filesize = 0;
+    }
+#if QWI_TEXT_STORAGE != QWI_TEXT_STORAGE_PIECE_TABLE
+    if (filesize < MAP_FILE_THRESHOLD) {
+        buffer_string data;
+        ui_result ret = read_file(path, &data);
+        if (ret.errored()) {
+            return ret;
+        }
+        *out = text_storage(std::move(data));
+        return ui_result::success();
+    }
+
+    if (filesize >= BACKGROUND_LOAD_THRESHOLD) {
+        file_descriptor fd{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+        if (fd.fd == -1) {
+            return ui_result::error("error opening file " + path.native());
+        }
+        state->file_loaders.push_back(std::make_unique<file_loader>(buf_id, std::move(fd), filesize));
+        *background_out = true;
+        return ui_result::success();
+    }
+#else
+    // The piece table maps the file instead of copying it.  A big file's stats and line
+    // index still take a read of the whole file, which the file_loader does in the
+    // background, handing over pieces of the mapping.
+    if (filesize >= BACKGROUND_LOAD_THRESHOLD) {
+        std::shared_ptr<const mapped_file> file;
+        ui_result ret = map_file(path, true /* sequential */, &file);
+        if (ret.errored()) {
+            return ret;
+        }
+        state->file_loaders.push_back(std::make_unique<file_loader>(buf_id, std::move(file)));
+        *background_out = true;
+        return ui_result::success();
+    }
+#endif
+
+    // Big files are mapped, so the only copy we make is into the text storage (or none,
+    // with the piece table).  We report the cost, it being noticeable.
+    const resource_usage before = resource_usage::now();
+    std::shared_ptr<const mapped_file> file;
+    ui_result ret = map_file(path, true /* sequential */, &file);
+    if (ret.errored()) {
+        return ret;
+    }
+#if QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_PIECE_TABLE
+    *out = text_storage(std::move(file));
+#else
+    *out = text_storage(std::span<const buffer_char>{file->data, file->size});
+    file = nullptr;
+#endif
+    if (filesize >= MAP_FILE_THRESHOLD) {
+        state->add_message(load_cost_message(path.native(), filesize, resource_usage::now() - before));
+    }
+    return ui_result::success();
+}
+
 // Caller needs to call set_window on the buf, generally, or other ui-specific stuff.
 ui_result open_file_into_detached_buffer(state *state, const std::string& dirty_path, buffer *out) {
     fs::path path = dirty_path;
     fs::file_status status = fs::status(path);
-    buffer_string data;
+    const buffer_id buf_id = state->gen_buf_id();
+    text_storage text;
+    bool loading = false;
+    // Taken before reading the file, so that if it changes meanwhile, a journal of our
+    // edits won't match it.
+    buffer_string file_header = journal_header(path);
     if (!fs::exists(status)) {
         if (!path.has_parent_path()) {
             // Such a bad error message.
@@ -558,23 +718,330 @@ ui_result open_file_into_detached_buffer(state *state, const std::string& dirty_
             // Maybe be some portability issues with native(), on Windows, idk.
             return ui_result::error("Tried opening non-regular file " + path.native());
         }
-        ui_result ret = read_file(path, &data);
+        ui_result ret = load_file_text(state, path, buf_id, &text, &loading);
         if (ret.errored()) {
             return ret;
         }
     }
     std::string name = buf_name_from_file_path(path);
 
-    buffer buf(state->gen_buf_id());
+    buffer buf(buf_id, std::move(text));
     buf.name_str = std::move(name);
     buf.married_file = path.string();
-    buf.aft_ = std::move(data);
-    buf.aft_stats_ = compute_stats(buf.aft_);
+    buf.read_only = loading;
+    buf.loading = loading;
+    buf.journal.file_header = std::move(file_header);
+    // A file loading in the background gets its history once it's loaded (see
+    // apply_file_loader_progress).
+    if (!loading && load_undo_file(path, std::nullopt, &buf.undo_info)) {
+        buf.non_modified_undo_node = buf.undo_info.current_node;
+    }
     *out = std::move(buf);
 
     return ui_result::success();
 }
 
+const file_loader *find_file_loader(const state *state, buffer_id buf_id) {
+    for (const std::unique_ptr<file_loader>& loader : state->file_loaders) {
+        if (loader->buf_id() == buf_id) {
+            return loader.get();
+        }
+    }
+    return nullptr;
+}
+
+void enforce_undo_budget(state *state) {
+    size_t total = 0;
+    for (auto& elem : state->buf_set) {
+        undo_history *history = &elem.second->undo_info;
+        evict_old_undo_items(history, state->undo_limits.per_buffer);
+        total += history->memory_used;
+    }
+    while (total > state->undo_limits.total) {
+        undo_history *biggest = nullptr;
+        for (auto& elem : state->buf_set) {
+            undo_history *history = &elem.second->undo_info;
+            if (history->past.size() > 1 && (biggest == nullptr || history->memory_used > biggest->memory_used)) {
+                biggest = history;
+            }
+        }
+        if (biggest == nullptr) {
+            break;
+        }
+        const size_t before = biggest->memory_used;
+        const size_t excess = total - state->undo_limits.total;
+        evict_old_undo_items(biggest, before - std::min(excess, before));
+        total -= before - biggest->memory_used;
+    }
+}
+
+undo_killring_handled undo_memory_report(state *state) {
+    std::vector<std::pair<std::string, const undo_history *>> rows;
+    size_t total = 0;
+    for (const auto& elem : state->buf_set) {
+        rows.emplace_back(buffer_name_str(state, elem.first), &elem.second->undo_info);
+        total += elem.second->undo_info.memory_used;
+    }
+    std::sort(rows.begin(), rows.end());
+
+    auto kib = [](size_t bytes) { return std::to_string(ceil_divide(bytes, size_t(1024))) + " KiB"; };
+    std::string text = "Undo memory:\n";
+    for (const auto& row : rows) {
+        text += row.first + ": " + kib(row.second->memory_used) + " (" + std::to_string(row.second->past.size())
+            + " undo, " + std::to_string(row.second->future.size()) + " redo items)\n";
+    }
+    text += "\nTotal: " + kib(total) + "\n";
+    text += "Budget: " + kib(state->undo_limits.per_buffer) + " per buffer, " + kib(state->undo_limits.total) + " total\n";
+
+    state->popup_display = popup{
+        buffer(state->gen_buf_id(), to_buffer_string(text)),
+    };
+    return note_nop_action(state);
+}
+
+prompt undo_steps_prompt(buffer_id promptBufId) {
+    // TODO: UI logic
+    return {prompt::type::proc, buffer(promptBufId), "undo steps: ",
+        [](state *state, buffer&& promptBuf, bool *) {
+            // killring important, undo not because we're destructing the status_prompt buf.
+            undo_killring_handled ret = note_backout_action(state, &promptBuf);
+            std::string text = promptBuf.copy_to_string();
+            size_t count;
+            const char *end = text.data() + text.size();
+            auto [ptr, ec] = std::from_chars(text.data(), end, count);
+            if (text.empty() || ec != std::errc{} || ptr != end) {
+                state->note_error_message("Not a number of steps");
+                return ret;
+            }
+            const auto& active = state->active_window()->active_buf();
+            no_yank(&state->clipboard);
+            perform_undo_steps(state, active.second.get(), state->lookup(active.first), count);
+            return ret;
+        }};
+}
+
+undo_killring_handled undo_steps_action(state *state, buffer *active_buf) {
+    undo_killring_handled ret = note_navigation_action(state, active_buf);
+    if (state->status_prompt.has_value()) {
+        return ret;
+    }
+
+    state->status_prompt = undo_steps_prompt(state->gen_buf_id());
+    return ret;
+}
+
+undo_killring_handled undo_to_saved_action(state *state, ui_window_ctx *ui, buffer *active_buf) {
+    no_yank(&state->clipboard);
+    std::optional<size_t> steps = undo_steps_to_node(active_buf->undo_info, active_buf->non_modified_undo_node);
+    if (!steps.has_value()) {
+        state->note_error_message("Undo history does not reach the saved text");  // TODO: UI logic
+    } else if (*steps == 0) {
+        state->note_error_message("No changes since the last save");  // TODO: UI logic
+    } else {
+        perform_undo_steps(state, ui, active_buf, *steps);
+    }
+    return handled_undo_killring(state, active_buf);
+}
+
+bool has_idle_work(const state& state) {
+    if (state.journals_unsynced) {
+        return true;
+    }
+    for (const auto& elem : state.buf_set) {
+        if (elem.second->has_dead_mark_refs()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void do_idle_work(state *state) {
+    if (state->journals_unsynced) {
+        // One group commit for everything journaled since the user started typing.
+        state->journals()->sync();
+        state->journals_unsynced = false;
+    }
+    for (auto& elem : state->buf_set) {
+        if (elem.second->has_dead_mark_refs()) {
+            elem.second->sweep_dead_mark_refs();
+        }
+    }
+}
+
+void flush_journals(state *state) {
+    for (auto& elem : state->buf_set) {
+        buffer *buf = elem.second.get();
+        edit_journal *journal = &buf->journal;
+        if (journal->pending.empty()) {
+            continue;
+        }
+        if (journal->path.empty()) {
+            const fs::path file = *buf->married_file;
+            journal->path = journal_file_path(file).native();
+            // This replaces any journal an earlier process left, so we don't offer it later.
+            journal->recovery_offered = true;
+            state->journals()->start(journal->path, buffer_string(journal->file_header));
+        }
+        state->journals()->append(journal->path, std::move(journal->pending));
+        journal->pending.clear();
+        state->journals_unsynced = true;
+    }
+    if (state->journal_writer_) {
+        std::string error = state->journal_writer_->take_error();
+        if (!error.empty()) {
+            state->note_error_message(std::move(error));
+        }
+    }
+}
+
+void discard_journal(state *state, buffer *buf) {
+    buf->journal.pending.clear();
+    if (!buf->journal.path.empty()) {
+        state->journals()->remove(buf->journal.path);
+        buf->journal.path.clear();
+    }
+}
+
+void discard_all_journals(state *state) {
+    for (auto& elem : state->buf_set) {
+        discard_journal(state, elem.second.get());
+    }
+}
+
+namespace {
+
+// Applies the journal's edits to buf as ordinary undoable edits (which get journaled
+// afresh).  Returns false if an edit doesn't fit the text, in which case it stops there.
+bool replay_journal(state *state, buffer *buf, const std::vector<journal_edit>& edits) {
+    ui_window_ctx ui{buf->add_mark(0), buf->add_mark(0)};
+    bool ok = true;
+    for (const journal_edit& edit : edits) {
+        if (edit.pos > buf->size() || (!edit.insert && edit.count > buf->size() - edit.pos)) {
+            ok = false;
+            break;
+        }
+        set_ctx_cursor(&ui, buf, edit.pos);
+        if (edit.insert) {
+            note_undo(buf, insert_chars(state->scratch(), &ui, buf, edit.text.data(), edit.text.size()));
+        } else {
+            note_undo(buf, delete_right(state->scratch(), &ui, buf, edit.count));
+        }
+    }
+    detach_ui_window_ctx(buf, &ui);
+    return ok;
+}
+
+prompt journal_recovery_prompt(buffer_id buf_id, std::vector<journal_edit>&& edits,
+                               std::string&& messageText, buffer&& initialBuf) {
+    std::string message = messageText;
+    return {prompt::type::proc, std::move(initialBuf), std::move(message),
+        [buf_id, MOVE(edits), MOVE(messageText)](state *state, buffer&& promptBuf, bool *) mutable {
+            // killring important, undo not because we're destructing the status_prompt buf.
+            undo_killring_handled ret = note_backout_action(state, &promptBuf);
+            std::string text = promptBuf.copy_to_string();
+            buffer *buf = state->lookup(buf_id);
+            if (text == "yes") {
+                if (!replay_journal(state, buf, edits)) {
+                    state->note_error_message("Journal does not match the file, recovered only part of it");
+                }
+            } else if (text == "no") {
+                state->journals()->remove(journal_file_path(*buf->married_file).native());
+            } else {
+                state->note_error_message("Please type yes or no");
+                state->status_prompt = journal_recovery_prompt(buf_id, std::move(edits), std::move(messageText),
+                                                               std::move(promptBuf));
+                return ret;
+            }
+            offer_journal_recovery(state);
+            return ret;
+        }};
+}
+
+}  // namespace
+
+void offer_journal_recovery(state *state) {
+    if (state->status_prompt.has_value()) {
+        return;
+    }
+    for (auto& elem : state->buf_set) {
+        buffer *buf = elem.second.get();
+        if (buf->journal.recovery_offered || !buf->married_file.has_value() || buf->loading) {
+            continue;
+        }
+        buf->journal.recovery_offered = true;
+        std::vector<journal_edit> edits;
+        if (!read_journal(*buf->married_file, &edits) || edits.empty()) {
+            continue;
+        }
+        // TODO: UI logic
+        std::string messageText = "recover unsaved edits to " + buffer_name_str(state, elem.first)
+            + " from its journal? (yes/no): ";
+        state->status_prompt = journal_recovery_prompt(elem.first, std::move(edits), std::move(messageText),
+                                                       buffer(state->gen_buf_id()));
+        return;
+    }
+}
+
+void apply_file_loader_progress(state *state) {
+    for (size_t i = 0; i < state->file_loaders.size(); ) {
+        file_loader *loader = state->file_loaders[i].get();
+        file_loader::progress progress = loader->take_progress();
+        auto it = state->buf_set.find(loader->buf_id());
+        if (it == state->buf_set.end()) {
+            // The buffer got closed.
+            state->file_loaders.erase(state->file_loaders.begin() + i);
+            continue;
+        }
+        buffer *buf = it->second.get();
+        for (file_loader::chunk& chunk : progress.chunks) {
+            append_loaded_text(buf, std::move(chunk.text), std::move(chunk.lines));
+        }
+        if (!progress.finished) {
+            ++i;
+            continue;
+        }
+
+        buf->loading = false;
+        if (progress.result.errored()) {
+            // The buffer has part of the file -- we don't want it to get saved over the
+            // whole.
+            buf->married_file = std::nullopt;
+            state->note_error_message(progress.result.message
+                                      + " (the buffer has part of the file, and is no longer tied to it)");
+        } else {
+            buf->read_only = false;
+            state->add_message(load_cost_message(*buf->married_file, loader->file_size(),
+                                                 resource_usage::now() - loader->start_usage));
+            // Nothing could edit the buffer while it was loading.
+            if (load_undo_file(*buf->married_file, progress.file_hash, &buf->undo_info)) {
+                buf->non_modified_undo_node = buf->undo_info.current_node;
+            }
+        }
+        state->file_loaders.erase(state->file_loaders.begin() + i);
+    }
+    offer_journal_recovery(state);
+}
+
+void cancel_file_load(state *state, buffer *buf) {
+    for (size_t i = 0; i < state->file_loaders.size(); ++i) {
+        if (state->file_loaders[i]->buf_id() == buf->id) {
+            // Keep what we've read, in a buffer that isn't married to the file (so that
+            // we don't save part of the file over the whole).
+            std::unique_ptr<file_loader> loader = std::move(state->file_loaders[i]);
+            state->file_loaders.erase(state->file_loaders.begin() + i);
+            loader->cancel();
+            for (file_loader::chunk& chunk : loader->take_progress().chunks) {
+                append_loaded_text(buf, std::move(chunk.text), std::move(chunk.lines));
+            }
+            buf->loading = false;
+            buf->married_file = std::nullopt;
+            state->note_error_message("Loading cancelled: the buffer has part of the file, is read-only, "
+                                      "and is no longer tied to it");
+            return;
+        }
+    }
+}
+
 void apply_number_to_buf(state *state, buffer_id buf_id) {
     buffer *the_buf = state->lookup(buf_id);
     const std::string& name = the_buf->name_str;
@@ -664,9 +1131,9 @@ undo_killring_handled rotate_buf_left(state *state, buffer *active_buf) {
 }
 
 undo_killring_handled yank_from_clipboard(state *state, ui_window_ctx *ui, buffer *buf) {
-    std::optional<const buffer_string *> text = do_yank(&state->clipboard);
+    std::optional<shared_text> text = do_yank(&state->clipboard);
     if (text.has_value()) {
-        insert_result res = insert_chars(state->scratch(), ui, buf, (*text)->data(), (*text)->size());
+        insert_result res = insert_chars(state->scratch(), ui, buf, std::move(*text));
         note_undo(buf, std::move(res));
         return handled_undo_killring(state, buf);
     } else {
@@ -683,11 +1150,11 @@ undo_killring_handled alt_yank_from_clipboard(state *state, ui_window_ctx *ui, b
         // TODO: this code will be wrong with undo impled -- the deletion and insertion should be a single undo chunk -- not a problem here but is this a bug in jsmacs?
         size_t amount_to_delete = *state->clipboard.justYanked;
         state->clipboard.stepPasteNumber();
-        std::optional<const buffer_string *> text = do_yank(&state->clipboard);
+        std::optional<shared_text> text = do_yank(&state->clipboard);
         logic_check(text.has_value(), "with justYanked non-null, do_yank returns null");
 
         delete_result delres = delete_left(state->scratch(), ui, buf, amount_to_delete);
-        insert_result insres = insert_chars(state->scratch(), ui, buf, (*text)->data(), (*text)->size());
+        insert_result insres = insert_chars(state->scratch(), ui, buf, std::move(*text));
 
         // Add the reverse action to undo history.
         atomic_undo_item item = {
@@ -788,9 +1255,11 @@ void help_duplicate_window(state *state, window_number duplicee, size_t insertio
     buffer_id buf_id = ab.first;
     buffer *buf = state->lookup(buf_id);
     size_t fvo = buf->get_mark_offset(ab.second->first_visible_offset);
+    size_t cursor = get_ctx_cursor(ab.second.get(), buf);
     ui_window window{state->layout.gen_next_window_id()};
     ui_window_ctx *ctx = window.point_at(buf_id, state);
     buf->replace_mark(ctx->first_visible_offset, fvo);
+    set_ctx_cursor(ctx, buf, cursor);
     state->layout.windows.insert(state->layout.windows.begin() + insertion_point,
                                  std::move(window));
     state->layout.row_relsizes.insert(state->layout.row_relsizes.begin() + insertion_point,
@@ -993,6 +1462,9 @@ undo_killring_handled help_menu(state *state) {
         "M-s save as...\n"
         "F5/F6 switch buffers left/right\n"
         "F7 switch buffer by name\n"
+        "F2 undo memory usage\n"
+        "C-x u undo some number of steps\n"
+        "C-x r undo back to the last save\n"
         "M-f/M-b forward/backward word\n"
         "C-w cut (or append to cut)\n"
         "M-w copy\n"
@@ -37,6 +37,29 @@ undo_killring_handled save_as_file_action(state *state, buffer *active_buf);
 undo_killring_handled exit_cleanly(state *state, buffer *active_buf, bool *exit_loop);  // L312
 undo_killring_handled buffer_switch_action(state *state, buffer *active_buf);
 [[nodiscard]] ui_result open_file_into_detached_buffer(state *state, const std::string& dirty_path, buffer *out);
+const file_loader *find_file_loader(const state *state, buffer_id buf_id);
+// Appends what file loaders have read to their buffers.
+void apply_file_loader_progress(state *state);
+// Stops loading the buffer's file, keeping what was read so far.
+void cancel_file_load(state *state, buffer *buf);
+// Evicts old undo history from buffers over their budget, then from the buffers using the
+// most undo memory until all of them fit in the total budget.
+void enforce_undo_budget(state *state);
+undo_killring_handled undo_memory_report(state *state);
+// Prompts for a number of steps to undo at once.
+undo_killring_handled undo_steps_action(state *state, buffer *active_buf);
+// Undoes every edit since the buffer was last saved (or opened).
+undo_killring_handled undo_to_saved_action(state *state, ui_window_ctx *ui, buffer *active_buf);
+// Housekeeping that waits until the user stops typing (and needs no redraw).
+bool has_idle_work(const state& state);
+void do_idle_work(state *state);
+// Hands buffers' newly journaled edits to the journal writer (see journal.hpp).
+void flush_journals(state *state);
+// Removes the buffer's journal, once the file has its edits or they're abandoned.
+void discard_journal(state *state, buffer *buf);
+void discard_all_journals(state *state);
+// Prompts to replay the journal of a file we haven't yet looked for one, if it has one.
+void offer_journal_recovery(state *state);
 void apply_number_to_buf(state *state, buffer_id buf_id);
 buffer scratch_buffer(buffer_id id);
 undo_killring_handled enter_handle_status_prompt(state *state, bool *exit_loop);
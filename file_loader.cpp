@@ -0,0 +1,132 @@
+#include "file_loader.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utility>
+
+namespace qwi {
+
+// The first chunk is small, so that the first screenful shows up quickly.
+constexpr size_t FIRST_CHUNK_SIZE = 64 << 10;
+constexpr size_t CHUNK_SIZE = 4 << 20;
+
+file_loader::file_loader(buffer_id buf_id, file_descriptor&& fd, size_t file_size)
+    : start_usage(resource_usage::now()), buf_id_(buf_id), file_size_(file_size) {
+    open_wakeup_pipe();
+    thread_ = std::thread([this, raw_fd = std::exchange(fd.fd, -1)] {
+        run(file_descriptor{raw_fd});
+    });
+}
+
+#if QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_PIECE_TABLE
+file_loader::file_loader(buffer_id buf_id, std::shared_ptr<const mapped_file> file)
+    : start_usage(resource_usage::now()), buf_id_(buf_id), file_size_(file->size) {
+    open_wakeup_pipe();
+    thread_ = std::thread([this, file = std::move(file)]() mutable {
+        run_mapped(std::move(file));
+    });
+}
+#endif
+
+file_loader::~file_loader() {
+    cancel();
+    thread_.join();
+}
+
+void file_loader::open_wakeup_pipe() {
+    int fds[2];
+    int res = pipe2(fds, O_CLOEXEC | O_NONBLOCK);
+    runtime_check(res == 0, "pipe2 failed: %s", runtime_check_strerror);
+    wakeup_pipe_[0].fd = fds[0];
+    wakeup_pipe_[1].fd = fds[1];
+}
+
+file_loader::progress file_loader::take_progress() {
+    char discard[64];
+    while (read(wakeup_pipe_[0].fd, discard, sizeof(discard)) > 0) { }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    progress ret = std::move(pending_);
+    pending_.chunks.clear();
+    return ret;
+}
+
+void file_loader::wake() {
+    // If the pipe is full, the main loop has a wakeup coming anyway.
+    char ch = 0;
+    ssize_t res = write(wakeup_pipe_[1].fd, &ch, 1);
+    (void)res;
+}
+
+void file_loader::add_chunk(text_storage&& text) {
+    // Indexing and hashing the chunk here (like building it) keeps that work off the main
+    // thread.
+    line_index lines(text);
+    text.for_each_span(0, text.size(), [&](std::span<const buffer_char> span) {
+        hash_.add(span.data(), span.size());
+    });
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.chunks.push_back(chunk{std::move(text), std::move(lines)});
+}
+
+void file_loader::finish(ui_result&& result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.finished = true;
+    pending_.result = std::move(result);
+    pending_.file_hash = hash_.finish();
+    wake();
+}
+
+void file_loader::run(file_descriptor fd) {
+    ui_result result = ui_result::success();
+    buffer_string buf;
+    size_t chunk_size = FIRST_CHUNK_SIZE;
+    while (!cancelled_) {
+        buf.resize(chunk_size);
+        size_t count = 0;
+        while (count < chunk_size) {
+            ssize_t res = read(fd.fd, buf.data() + count, chunk_size - count);
+            if (res == -1 && errno == EINTR) {
+                continue;
+            }
+            if (res == -1) {
+                result = ui_result::error(std::string("error reading file: ") + strerror(errno));
+                break;
+            }
+            if (res == 0) {
+                break;
+            }
+            count += res;
+        }
+
+        if (count > 0) {
+            // Building the chunk here (and its stats) keeps that work off the main thread.
+            add_chunk(text_storage{std::span<const buffer_char>{buf.data(), count}});
+        }
+        wake();
+        if (count < chunk_size) {
+            // EOF or error.
+            break;
+        }
+        chunk_size = CHUNK_SIZE;
+    }
+    finish(std::move(result));
+}
+
+#if QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_PIECE_TABLE
+void file_loader::run_mapped(std::shared_ptr<const mapped_file> file) {
+    size_t chunk_size = FIRST_CHUNK_SIZE;
+    for (size_t off = 0; off < file->size && !cancelled_; chunk_size = CHUNK_SIZE) {
+        const size_t end = off + std::min(chunk_size, file->size - off);
+        // Reading the mapping for the chunk's stats and line index is the load.
+        add_chunk(text_storage(file, off, end));
+        wake();
+        off = end;
+    }
+    finish(ui_result::success());
+}
+#endif
+
+}  // namespace qwi
@@ -0,0 +1,91 @@
+#ifndef QWERTILLION_FILE_LOADER_HPP_
+#define QWERTILLION_FILE_LOADER_HPP_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "error.hpp"
+#include "io.hpp"
+#include "line_index.hpp"
+#include "state_types.hpp"
+#include "text_storage.hpp"
+#include "undo_file.hpp"
+
+namespace qwi {
+
+// Files at least this big get loaded in the background with a file_loader.
+constexpr size_t BACKGROUND_LOAD_THRESHOLD = 16 << 20;
+
+// Reads a file into text_storage chunks on a background thread, and indexes their lines.
+// The main loop appends the chunks to the buffer as they arrive (see
+// apply_file_loader_progress), so that the start of a big file shows up right away.
+class file_loader {
+public:
+    file_loader(buffer_id buf_id, file_descriptor&& fd, size_t file_size);
+#if QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_PIECE_TABLE
+    // The chunks are pieces of the mapped file, which the buffer's text shares instead of
+    // copying.
+    file_loader(buffer_id buf_id, std::shared_ptr<const mapped_file> file);
+#endif
+    // Cancels the load and waits for the thread.
+    ~file_loader();
+    NO_COPY(file_loader);
+
+    buffer_id buf_id() const { return buf_id_; }
+    size_t file_size() const { return file_size_; }
+    // Becomes readable (for poll) when there's progress to take.  Drained by take_progress.
+    int wakeup_fd() const { return wakeup_pipe_[0].fd; }
+
+    struct chunk {
+        text_storage text;
+        line_index lines;
+    };
+    struct progress {
+        std::vector<chunk> chunks;
+        // No more chunks will come.
+        bool finished = false;
+        ui_result result = ui_result::success();
+        // Once finished, the content_hash of the chunks, for checking the file's undo file.
+        uint64_t file_hash = 0;
+    };
+    progress take_progress();
+
+    // Stops reading soon.  Chunks already read can still be taken.
+    void cancel() { cancelled_ = true; }
+
+    // When the load was started.
+    resource_usage start_usage;
+
+private:
+    void open_wakeup_pipe();
+    void run(file_descriptor fd);
+#if QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_PIECE_TABLE
+    void run_mapped(std::shared_ptr<const mapped_file> file);
+#endif
+    void add_chunk(text_storage&& text);
+    void finish(ui_result&& result);
+    void wake();
+
+    buffer_id buf_id_;
+    size_t file_size_;
+    file_descriptor wakeup_pipe_[2];
+    std::atomic<bool> cancelled_ = false;
+
+    // Of the chunks so far.  Used by the thread.
+    content_hash hash_;
+
+    std::mutex mutex_;
+    // Guarded by mutex_.
+    progress pending_;
+
+    std::thread thread_;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_FILE_LOADER_HPP_
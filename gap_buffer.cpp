@@ -0,0 +1,127 @@
+#include "gap_buffer.hpp"
+
+#include <string.h>
+
+#include "arith.hpp"
+
+namespace qwi {
+
+// When the gap runs out, we make it this big, or 1/GAP_GROWTH_DIVISOR of the text size,
+// whichever's bigger, so that the cost of growth is amortized O(1) per inserted char.
+constexpr size_t MIN_GAP_SIZE = 4096;
+constexpr size_t GAP_GROWTH_DIVISOR = 8;
+
+gap_buffer::gap_buffer(buffer_string&& str)
+    : data_(std::move(str)), gap_beg_(0), gap_end_(0) {
+    aft_stats_ = compute_stats(aft_data(), aft_size());
+}
+
+void gap_buffer::move_gap(size_t pos) {
+    logic_check(pos <= size(), "move_gap outside buf range");
+    buffer_char *data = data_.data();
+    if (pos < gap_beg_) {
+        const size_t n = gap_beg_ - pos;
+        bef_stats_ = subtract_stats_right(bef_stats_, data, pos, gap_beg_);
+        aft_stats_ = append_stats(compute_stats(data + pos, n), aft_stats_);
+        memmove(data + gap_end_ - n, data + pos, n);
+        gap_beg_ = pos;
+        gap_end_ -= n;
+    } else if (pos > gap_beg_) {
+        const size_t n = pos - gap_beg_;
+        region_stats segstats = compute_stats(aft_data(), n);
+        bef_stats_ = append_stats(bef_stats_, segstats);
+        aft_stats_ = subtract_stats_left(aft_stats_, segstats, aft_data() + n, aft_size() - n);
+        memmove(data + gap_beg_, data + gap_end_, n);
+        gap_beg_ = pos;
+        gap_end_ += n;
+    }
+}
+
+void gap_buffer::grow_gap(size_t min_gap) {
+    const size_t new_gap = std::max(min_gap, std::max(MIN_GAP_SIZE, size() / GAP_GROWTH_DIVISOR));
+    const size_t aft = aft_size();
+    const size_t new_capacity = size_add(size_add(gap_beg_, new_gap), aft);
+    data_.resize(new_capacity);
+    buffer_char *data = data_.data();
+    memmove(data + new_capacity - aft, data + gap_end_, aft);
+    gap_end_ = new_capacity - aft;
+}
+
+void gap_buffer::insert(size_t pos, const buffer_char *chs, size_t count) {
+    move_gap(pos);
+    if (gap_size() < count) {
+        grow_gap(count);
+    }
+    memcpy(data_.data() + gap_beg_, chs, count);
+    gap_beg_ += count;
+    bef_stats_ = append_stats(bef_stats_, compute_stats(chs, count));
+}
+
+void gap_buffer::erase(size_t pos, size_t count, buffer_string *deleted_out) {
+    logic_check(count <= size() && pos <= size() - count, "gap_buffer::erase out of range");
+    if (deleted_out) {
+        for_each_span(pos, pos + count, [&](std::span<const buffer_char> span) {
+            deleted_out->append(span.data(), span.size());
+        });
+    }
+
+    if (gap_beg_ == pos + count) {
+        // Typical for backspace -- delete at the end of the text before the gap.
+        bef_stats_ = subtract_stats_right(bef_stats_, data_.data(), pos, gap_beg_);
+        gap_beg_ = pos;
+    } else {
+        move_gap(pos);
+        region_stats removed = compute_stats(aft_data(), count);
+        aft_stats_ = subtract_stats_left(aft_stats_, removed, aft_data() + count, aft_size() - count);
+        gap_end_ += count;
+    }
+}
+
+region_stats gap_buffer::stats_at(size_t pos) const {
+    const buffer_char *data = data_.data();
+    if (pos == gap_beg_) {
+        return bef_stats_;
+    } else if (pos < gap_beg_) {
+        // Unsure what fraction is optimal; we're just making a Statement that
+        // subtract_stats_right is more complicated.
+        if (pos < (gap_beg_ / 4) * 3) {
+            return compute_stats(data, pos);
+        } else {
+            return subtract_stats_right(bef_stats_, data, pos, gap_beg_);
+        }
+    } else {
+        logic_check(pos <= size(),
+                    "stats_at: pos=%zu, gap_beg_=%zu, aft_size()=%zu, size()=%zu",
+                    pos, gap_beg_, aft_size(), size());
+        size_t apos = pos - gap_beg_;
+        if (apos < (aft_size() / 4) * 3) {
+            return append_stats(bef_stats_, compute_stats(aft_data(), apos));
+        } else {
+            return append_stats(bef_stats_,
+                                subtract_stats_right(aft_stats_, aft_data(), apos, aft_size()));
+        }
+    }
+}
+
+void gap_buffer::copy_to(size_t beg, size_t end, buffer_char *out) const {
+    for_each_span(beg, end, [&](std::span<const buffer_char> span) {
+        memcpy(out, span.data(), span.size());
+        out += span.size();
+    });
+}
+
+void gap_buffer::append(gap_buffer&& other) {
+    const size_t count = other.size();
+    move_gap(size());
+    if (gap_size() < count) {
+        grow_gap(count);
+    }
+    other.for_each_span(0, count, [&](std::span<const buffer_char> span) {
+        memcpy(data_.data() + gap_beg_, span.data(), span.size());
+        gap_beg_ += span.size();
+    });
+    bef_stats_ = append_stats(bef_stats_, append_stats(other.bef_stats_, other.aft_stats_));
+    other = gap_buffer();
+}
+
+}  // namespace qwi
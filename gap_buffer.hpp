@@ -0,0 +1,93 @@
+#ifndef QWERTILLION_GAPBUFFER_HPP_
+#define QWERTILLION_GAPBUFFER_HPP_
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <span>
+
+#include "chars.hpp"
+#include "error.hpp"
+#include "region_stats.hpp"
+
+namespace qwi {
+
+// Buffer text, stored in a single allocation with a movable gap.  Text before the gap is
+// [0, gap_beg_) and text after the gap is [gap_end_, data_.size()).  Edits at the gap
+// are O(1) amortized, moving the gap costs O(distance).
+//
+// We also maintain region_stats for the text on either side of the gap, which makes
+// stats_at cheap near the gap.
+class gap_buffer {
+public:
+    gap_buffer() = default;
+    // Takes ownership of str's memory, placing a zero-length gap at the front.
+    explicit gap_buffer(buffer_string&& str);
+    explicit gap_buffer(std::span<const buffer_char> text)
+        : gap_buffer(buffer_string(text.data(), text.size())) { }
+
+    size_t size() const { return data_.size() - gap_size(); }
+    buffer_char get(size_t i) const {
+        return i < gap_beg_ ? data_[i] : data_[i + gap_size()];
+    }
+
+    size_t gap_position() const { return gap_beg_; }
+    void move_gap(size_t pos);
+
+    // Leaves the gap right after the inserted text.
+    void insert(size_t pos, const buffer_char *chs, size_t count);
+    // Erases [pos, pos + count), appending the erased text to *deleted_out (if non-null).
+    void erase(size_t pos, size_t count, buffer_string *deleted_out);
+    // Appends other's text, reusing its stats.
+    void append(gap_buffer&& other);
+
+    // Stats of the text in [0, pos).
+    region_stats stats_at(size_t pos) const;
+
+    void copy_to(size_t beg, size_t end, buffer_char *out) const;
+
+    // Returns the contiguous piece of text containing i (for i < size()) -- the text on
+    // one side of the gap -- setting *beg_out to its offset.
+    std::span<const buffer_char> chunk_at(size_t i, size_t *beg_out) const {
+        logic_check(i < size(), "gap_buffer::chunk_at out of range");
+        if (i < gap_beg_) {
+            *beg_out = 0;
+            return {data_.data(), gap_beg_};
+        }
+        *beg_out = gap_beg_;
+        return {aft_data(), aft_size()};
+    }
+
+    // Calls fn(std::span<const buffer_char>) on (at most two) contiguous pieces of [beg,
+    // end), in order.
+    template <class Callable>
+    void for_each_span(size_t beg, size_t end, Callable&& fn) const {
+        logic_check(beg <= end && end <= size(), "gap_buffer::for_each_span out of range");
+        if (beg < gap_beg_) {
+            size_t e = std::min(end, gap_beg_);
+            fn(std::span<const buffer_char>{data_.data() + beg, e - beg});
+            beg = e;
+        }
+        if (beg < end) {
+            fn(std::span<const buffer_char>{data_.data() + beg + gap_size(), end - beg});
+        }
+    }
+
+private:
+    size_t gap_size() const { return gap_end_ - gap_beg_; }
+    const buffer_char *aft_data() const { return data_.data() + gap_end_; }
+    size_t aft_size() const { return data_.size() - gap_end_; }
+    void grow_gap(size_t min_gap);
+
+    // The gap's contents are garbage.
+    buffer_string data_;
+    size_t gap_beg_ = 0;
+    size_t gap_end_ = 0;
+
+    region_stats bef_stats_;
+    region_stats aft_stats_;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_GAPBUFFER_HPP_
@@ -1,9 +1,14 @@
 #include "io.hpp"
 
+#include <fcntl.h>
 #include <limits.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
-#include <fstream>
+#include <utility>
 
 namespace fs = std::filesystem;
 
@@ -40,37 +45,177 @@ void close_fd(int fd) {
 
 ui_result read_file(const fs::path& path, qwi::buffer_string *out) {
     static_assert(sizeof(qwi::buffer_char) == 1);
-    qwi::buffer_string ret;
-    // TODO: Use system lib at some point (like, when we care, if ever).
-    std::ifstream f{path, std::ios::binary};
-    if (f.fail()) {
+    file_descriptor fd{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd.fd == -1) {
         return ui_result::error("error opening file " + path.native());
     }
-    f.seekg(0, std::ios::end);
-    if (f.fail()) {
-        return ui_result::error("error seeking to end of file " + path.native());
-    }
-    int64_t filesize = f.tellg();
-    if (filesize == -1) {
+    struct stat st;
+    if (fstat(fd.fd, &st) == -1) {
         return ui_result::error("error reading file size of " + path.native());
     }
-    if (filesize > SSIZE_MAX) {
+    if (uint64_t(st.st_size) > SSIZE_MAX) {
         return ui_result::error("size of file " + path.native() + " is too big for this program");
     }
+    const size_t filesize = st.st_size;
 
-    // TODO: Use resize_and_overwrite (to avoid having to write memory).
+    qwi::buffer_string ret;
+    size_t count = 0;
+    bool failed = false;
+    auto read_into = [&](qwi::buffer_char *data, size_t size) -> size_t {
+        while (count < size) {
+            ssize_t res = ::read(fd.fd, data + count, size - count);
+            if (res == -1 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                // The file shrank (or the read failed) -- we check which below.
+                failed = res == -1;
+                break;
+            }
+            count += res;
+        }
+        return count;
+    };
+#ifdef __cpp_lib_string_resize_and_overwrite
+    // Avoids zero-filling the string before reading into it.
+    ret.resize_and_overwrite(filesize, read_into);
+#else
     ret.resize(filesize);
-
-    f.seekg(0);
-    if (f.fail()) {
-        return ui_result::error("could not seek back to beginning of file " + path.native());
+    ret.resize(read_into(ret.data(), filesize));
+#endif
+    if (failed) {
+        return ui_result::error("error reading file " + path.native());
     }
 
-    f.read(as_chars(ret.data()), ret.size());
-    if (f.fail()) {
-        return ui_result::error("error reading file " + path.native());
+    *out = std::move(ret);
+    return ui_result::success();
+}
+
+mapped_file::~mapped_file() {
+    if (data != nullptr) {
+        int res = munmap(const_cast<qwi::buffer_char *>(data), size);
+        (void)res;
     }
+}
 
+ui_result map_file(const fs::path& path, bool sequential, std::shared_ptr<const mapped_file> *out) {
+    file_descriptor fd{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd.fd == -1) {
+        return ui_result::error("error opening file " + path.native());
+    }
+    struct stat st;
+    if (fstat(fd.fd, &st) == -1) {
+        return ui_result::error("error reading file size of " + path.native());
+    }
+    if (uint64_t(st.st_size) > SSIZE_MAX) {
+        return ui_result::error("size of file " + path.native() + " is too big for this program");
+    }
+    auto ret = std::make_shared<mapped_file>();
+    if (st.st_size != 0) {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.fd, 0);
+        if (addr == MAP_FAILED) {
+            return ui_result::error("error mapping file " + path.native());
+        }
+        ret->data = static_cast<const qwi::buffer_char *>(addr);
+        ret->size = st.st_size;
+        if (sequential) {
+            // Just advice, so we don't care if it fails.
+            int res = madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            (void)res;
+        }
+    }
+    // The mapping outlives the fd.
+    fd.close();
     *out = std::move(ret);
     return ui_result::success();
 }
+
+ui_result open_replacement_file(const fs::path& path, file_descriptor *fd_out, std::string *tmp_path_out,
+                                std::optional<mode_t> mode) {
+    std::string tmp_path = path.native() + ".qwi-XXXXXX";
+    file_descriptor fd{mkostemp(tmp_path.data(), O_CLOEXEC)};
+    if (fd.fd == -1) {
+        return ui_result::error("error opening temporary file " + tmp_path + " for write");
+    }
+    // mkostemp makes the file 0600 -- unless we were given a mode, keep the old file's mode,
+    // or use the default.
+    if (!mode.has_value()) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            mode = st.st_mode & 07777;
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            mode = 0666 & ~mask;
+        }
+    }
+    if (fchmod(fd.fd, *mode) == -1) {
+        int discard = unlink(tmp_path.c_str());
+        (void)discard;
+        return ui_result::error("error setting permissions of temporary file " + tmp_path);
+    }
+    logic_check(fd_out->fd == -1, "open_replacement_file with open fd_out");
+    fd_out->fd = std::exchange(fd.fd, -1);
+    *tmp_path_out = std::move(tmp_path);
+    return ui_result::success();
+}
+
+ui_result write_all(int fd, const qwi::buffer_char *data, size_t count) {
+    while (count > 0) {
+        ssize_t res = write(fd, data, count);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ui_result::error(std::string("write failed: ") + strerror(errno));
+        }
+        data += res;
+        count -= res;
+    }
+    return ui_result::success();
+}
+
+ui_result commit_replacement_file(file_descriptor *fd, const std::string& tmp_path, const fs::path& path) {
+    // The data has to be on disk before the rename is, or a crash could leave an empty
+    // file in place of the old one.
+    ui_result res = sync_and_close(fd, path);
+    if (res.errored() || rename(tmp_path.c_str(), path.c_str()) == -1) {
+        int discard = unlink(tmp_path.c_str());
+        (void)discard;
+        return ui_result::error("error writing to file " + path.native());
+    }
+    return ui_result::success();
+}
+
+ui_result open_file_for_overwrite(const fs::path& path, file_descriptor *fd_out) {
+    file_descriptor fd{::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)};
+    if (fd.fd == -1) {
+        return ui_result::error("error opening file " + path.native() + " for write");
+    }
+    logic_check(fd_out->fd == -1, "open_file_for_overwrite with open fd_out");
+    fd_out->fd = std::exchange(fd.fd, -1);
+    return ui_result::success();
+}
+
+ui_result sync_and_close(file_descriptor *fd, const fs::path& path) {
+    const int fd_value = std::exchange(fd->fd, -1);
+    const bool synced = fsync(fd_value) == 0;
+    if (::close(fd_value) == -1 || !synced) {
+        return ui_result::error("error writing to file " + path.native());
+    }
+    return ui_result::success();
+}
+
+resource_usage resource_usage::now() {
+    struct timespec ts;
+    int res = clock_gettime(CLOCK_MONOTONIC, &ts);
+    runtime_check(res == 0, "clock_gettime failed: %s", runtime_check_strerror);
+    struct rusage usage;
+    res = getrusage(RUSAGE_SELF, &usage);
+    runtime_check(res == 0, "getrusage failed: %s", runtime_check_strerror);
+    return {
+        .seconds = ts.tv_sec + ts.tv_nsec * 1e-9,
+        .minor_faults = usage.ru_minflt,
+        .major_faults = usage.ru_majflt,
+    };
+}
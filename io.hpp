@@ -2,7 +2,10 @@
 #define QWERTILLION_IO_HPP_
 
 #include <filesystem>
+#include <memory>
+#include <optional>
 
+#include <sys/types.h>
 #include <unistd.h>
 
 #include "chars.hpp"
@@ -15,6 +18,37 @@ void close_fd(int fd);
 // TODO: Also, UI logic (with ui_result)
 ui_result read_file(const std::filesystem::path& path, qwi::buffer_string *out);
 
+// Files at least this big get mapped (with map_file) instead of read, when opened.
+constexpr size_t MAP_FILE_THRESHOLD = 1 << 20;
+
+// A file mapped read-only into memory.  The file must not be truncated by anybody while
+// it's mapped (we'd get SIGBUS) -- which is why we save files by renaming a replacement
+// over them, or copy the text off the mapping before overwriting them.
+struct mapped_file {
+    const qwi::buffer_char *data = nullptr;
+    size_t size = 0;
+
+    mapped_file() = default;
+    ~mapped_file();
+    NO_COPY(mapped_file);
+};
+
+// sequential means we'll read the whole file front to back (so the kernel should read
+// ahead aggressively), which is the case while we load it.
+ui_result map_file(const std::filesystem::path& path, bool sequential, std::shared_ptr<const mapped_file> *out);
+
+// Elapsed time and page faults of this process, for reporting the cost of loading files.
+struct resource_usage {
+    double seconds = 0;
+    long minor_faults = 0;
+    long major_faults = 0;
+
+    static resource_usage now();
+    friend resource_usage operator-(const resource_usage& x, const resource_usage& y) {
+        return {x.seconds - y.seconds, x.minor_faults - y.minor_faults, x.major_faults - y.major_faults};
+    }
+};
+
 struct file_descriptor {
     int fd = -1;
 
@@ -36,4 +70,21 @@ struct file_descriptor {
     NO_COPY(file_descriptor);
 };
 
+// Creates a temporary file next to path, to be written and then renamed over path with
+// commit_replacement_file.  It gets the given mode, or else path's mode (or the default
+// mode, if path doesn't exist).
+ui_result open_replacement_file(const std::filesystem::path& path, file_descriptor *fd_out, std::string *tmp_path_out,
+                                std::optional<mode_t> mode = std::nullopt);
+ui_result write_all(int fd, const qwi::buffer_char *data, size_t count);
+// Syncs and closes the fd and renames the temporary file over path (or removes it, on
+// failure).
+ui_result commit_replacement_file(file_descriptor *fd, const std::string& tmp_path, const std::filesystem::path& path);
+
+// Opens path for writing in place, truncating it (or creating it).  Unlike a replacement
+// file, that keeps its hard links, owner and permissions, and works in a directory we can't
+// create files in.
+ui_result open_file_for_overwrite(const std::filesystem::path& path, file_descriptor *fd_out);
+// Syncs and closes an fd we wrote path through.
+ui_result sync_and_close(file_descriptor *fd, const std::filesystem::path& path);
+
 #endif  // QWERTILLION_IO_HPP_
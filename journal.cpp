@@ -0,0 +1,219 @@
+#include "journal.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include "io.hpp"
+
+namespace fs = std::filesystem;
+
+namespace qwi {
+
+namespace {
+
+// The header is JOURNAL_MAGIC and the file's size and modification time in nanoseconds
+// (or NO_FILE twice, if it didn't exist), as native-endian uint64_t's.  An edit is
+// INSERT_RECORD or ERASE_RECORD, then its position and count, then (for insertions) the
+// text.
+constexpr uint64_t JOURNAL_MAGIC = 0x4c'4e'52'55'4f'4a'57'51;  // "QWJOURNL"
+constexpr uint64_t NO_FILE = UINT64_MAX;
+constexpr size_t WORD = sizeof(uint64_t);
+constexpr size_t HEADER_SIZE = 3 * WORD;
+constexpr uint8_t INSERT_RECORD = '+';
+constexpr uint8_t ERASE_RECORD = '-';
+
+void put(buffer_string *out, uint64_t x) {
+    buffer_char bytes[WORD];
+    memcpy(bytes, &x, WORD);
+    out->append(bytes, WORD);
+}
+
+uint64_t get(const buffer_string& data, size_t pos) {
+    uint64_t x;
+    memcpy(&x, data.data() + pos, WORD);
+    return x;
+}
+
+void put_record(buffer_string *out, uint8_t type, size_t pos, size_t count) {
+    out->push_back(buffer_char{type});
+    put(out, pos);
+    put(out, count);
+}
+
+}  // namespace
+
+fs::path journal_file_path(const fs::path& file_path) {
+    return file_path.parent_path() / ("." + file_path.filename().native() + ".qwi-journal");
+}
+
+void edit_journal::note_insert(size_t pos, const buffer_char *chs, size_t count) {
+    put_record(&pending, INSERT_RECORD, pos, count);
+    pending.append(chs, count);
+}
+
+void edit_journal::note_erase(size_t pos, size_t count) {
+    put_record(&pending, ERASE_RECORD, pos, count);
+}
+
+buffer_string journal_header(const fs::path& file_path) {
+    buffer_string ret;
+    put(&ret, JOURNAL_MAGIC);
+    struct stat st;
+    if (stat(file_path.c_str(), &st) == 0) {
+        put(&ret, st.st_size);
+        put(&ret, uint64_t(st.st_mtim.tv_sec) * 1000000000 + uint64_t(st.st_mtim.tv_nsec));
+    } else {
+        put(&ret, NO_FILE);
+        put(&ret, NO_FILE);
+    }
+    return ret;
+}
+
+bool read_journal(const fs::path& file_path, std::vector<journal_edit> *out) {
+    buffer_string data;
+    if (read_file(journal_file_path(file_path), &data).errored() || data.size() < HEADER_SIZE
+        || data.compare(0, HEADER_SIZE, journal_header(file_path)) != 0) {
+        return false;
+    }
+    std::vector<journal_edit> edits;
+    const size_t record_size = 1 + 2 * WORD;
+    for (size_t i = HEADER_SIZE; data.size() - i >= record_size; ) {
+        const uint8_t type = data[i].value;
+        const size_t pos = get(data, i + 1);
+        const size_t count = get(data, i + 1 + WORD);
+        i += record_size;
+        if (type == INSERT_RECORD) {
+            if (data.size() - i < count) {
+                break;
+            }
+            edits.push_back({.insert = true, .pos = pos, .text = data.substr(i, count), .count = count});
+            i += count;
+        } else if (type == ERASE_RECORD) {
+            edits.push_back({.insert = false, .pos = pos, .text = {}, .count = count});
+        } else {
+            return false;
+        }
+    }
+    *out = std::move(edits);
+    return true;
+}
+
+journal_writer::journal_writer() {
+    thread_ = std::thread([this] { run(); });
+}
+
+journal_writer::~journal_writer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+    for (auto& elem : files_) {
+        int discard = ::close(elem.second.first);
+        (void)discard;
+    }
+}
+
+void journal_writer::enqueue(job&& j) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(j));
+    }
+    cv_.notify_one();
+}
+
+void journal_writer::start(const std::string& path, buffer_string&& header) {
+    enqueue({.typ = job::type::start, .path = path, .data = std::move(header)});
+}
+
+void journal_writer::append(const std::string& path, buffer_string&& records) {
+    enqueue({.typ = job::type::append, .path = path, .data = std::move(records)});
+}
+
+void journal_writer::sync() {
+    enqueue({.typ = job::type::sync, .path = {}, .data = {}});
+}
+
+void journal_writer::remove(const std::string& path) {
+    enqueue({.typ = job::type::remove, .path = path, .data = {}});
+}
+
+std::string journal_writer::take_error() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::exchange(error_, std::string{});
+}
+
+void journal_writer::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+            // We only stop once every job is done.
+            return;
+        }
+        job j = std::move(jobs_.front());
+        jobs_.pop_front();
+        lock.unlock();
+        perform(j);
+        lock.lock();
+    }
+}
+
+void journal_writer::perform(job& j) {
+    ui_result res = ui_result::success();
+    auto it = files_.find(j.path);
+    switch (j.typ) {
+    case job::type::start: {
+        if (it != files_.end()) {
+            int discard = ::close(it->second.first);
+            (void)discard;
+            files_.erase(it);
+        }
+        // The journal has unsaved text, which only the user should read.
+        int fd = ::open(j.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            res = ui_result::error("error opening journal " + j.path);
+            break;
+        }
+        files_.emplace(j.path, std::make_pair(fd, true));
+        res = write_all(fd, j.data.data(), j.data.size());
+    } break;
+    case job::type::append:
+        if (it != files_.end()) {
+            it->second.second = true;
+            res = write_all(it->second.first, j.data.data(), j.data.size());
+        }
+        break;
+    case job::type::sync:
+        for (auto& elem : files_) {
+            if (elem.second.second && fdatasync(elem.second.first) == -1) {
+                res = ui_result::error("error syncing journal " + elem.first);
+            }
+            elem.second.second = false;
+        }
+        break;
+    case job::type::remove:
+        if (it != files_.end()) {
+            int discard = ::close(it->second.first);
+            (void)discard;
+            files_.erase(it);
+        }
+        if (unlink(j.path.c_str()) == -1 && errno != ENOENT) {
+            res = ui_result::error("error removing journal " + j.path);
+        }
+        break;
+    }
+    if (res.errored()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_.empty()) {
+            error_ = std::move(res.message);
+        }
+    }
+}
+
+}  // namespace qwi
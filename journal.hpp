@@ -0,0 +1,104 @@
+#ifndef QWERTILLION_JOURNAL_HPP_
+#define QWERTILLION_JOURNAL_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "chars.hpp"
+#include "error.hpp"
+
+namespace qwi {
+
+// Unsaved edits to a file's buffer get journaled next to the file, as
+// .<filename>.qwi-journal, so that they can be replayed after a crash.  The journal starts
+// with the size and modification time of the file it applies to, followed by the edits:
+// insertions (with their text) and deletions.  It gets removed when the file is saved or
+// the editor exits cleanly.
+std::filesystem::path journal_file_path(const std::filesystem::path& file_path);
+
+// A buffer's journal state.
+struct edit_journal {
+    // Edit records not yet handed to the journal_writer.  Appending to this is all that
+    // happens on the keystroke path.
+    buffer_string pending;
+    // The journal file we started, or empty.
+    std::string path;
+    // The journal header of the file as of when the buffer's text was read from it or last
+    // saved to it -- the text the journaled edits apply to.
+    buffer_string file_header;
+    // Whether we've looked for a journal left behind by an earlier process.
+    bool recovery_offered = false;
+
+    void note_insert(size_t pos, const buffer_char *chs, size_t count);
+    void note_erase(size_t pos, size_t count);
+};
+
+// The journal header for file_path as it currently is on disk.
+buffer_string journal_header(const std::filesystem::path& file_path);
+
+struct journal_edit {
+    bool insert;
+    size_t pos;
+    // Only for insertions -- deletions have just a count.
+    buffer_string text;
+    size_t count;
+};
+
+// Reads the journal left next to file_path, if it applies to file_path as it currently is
+// on disk.  A partially written edit at the end gets dropped.
+bool read_journal(const std::filesystem::path& file_path, std::vector<journal_edit> *out);
+
+// Writes journals on a background thread.  Writes get handed to it as the editor handles
+// input, and it fdatasyncs them as a group when we tell it the editor is idle.
+class journal_writer {
+public:
+    journal_writer();
+    ~journal_writer();
+    NO_COPY(journal_writer);
+
+    // Creates (or truncates) the journal file at path, and writes header to it.
+    void start(const std::string& path, buffer_string&& header);
+    void append(const std::string& path, buffer_string&& records);
+    void sync();
+    // Closes and removes the journal file.
+    void remove(const std::string& path);
+
+    // The first error the writer ran into since the last call, or "".
+    std::string take_error();
+
+private:
+    struct job {
+        enum class type { start, append, sync, remove, };
+        type typ;
+        std::string path;
+        buffer_string data;
+    };
+    void enqueue(job&& j);
+    void run();
+    void perform(job& j);
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // Guarded by mutex_.
+    std::deque<job> jobs_;
+    bool stopping_ = false;
+    std::string error_;
+
+    // Only touched by the writer thread.  The fds, and whether they need syncing.
+    std::unordered_map<std::string, std::pair<int, bool>> files_;
+
+    std::thread thread_;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_JOURNAL_HPP_
@@ -0,0 +1,314 @@
+#include "line_index.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <span>
+
+#include "arith.hpp"
+#include "char_scan.hpp"
+#include "error.hpp"
+#include "parallel.hpp"
+
+namespace qwi {
+
+// Blocks get built at BLOCK_SIZE chars and split when an insertion takes them past
+// MAX_BLOCK_SIZE.  Erasing merges blocks below MIN_BLOCK_SIZE with a neighbor, if the
+// result would fit in MAX_BLOCK_SIZE.  (A small block that can't merge stays small --
+// erasing inside it is still the fast path.)
+constexpr size_t BLOCK_SIZE = 8192;
+constexpr size_t MAX_BLOCK_SIZE = BLOCK_SIZE * 2;
+constexpr size_t MIN_BLOCK_SIZE = BLOCK_SIZE / 4;
+// Counting newlines gets parallelized, with at least this many blocks per thread.
+constexpr size_t PARALLEL_BLOCKS = 128;
+
+namespace {
+
+size_t newlines_in(const text_storage& text, size_t beg, size_t end) {
+    size_t ret = 0;
+    text.for_each_span(beg, end, [&](std::span<const buffer_char> span) {
+        ret += count_newlines(span.data(), span.size());
+    });
+    return ret;
+}
+
+// Returns the offset after the last newline in [beg, end), or beg if there is none.
+size_t after_last_newline_in(const text_storage& text, size_t beg, size_t end) {
+    size_t p = end;
+    while (p > beg) {
+        size_t chunk_beg;
+        std::span<const buffer_char> chunk = text.chunk_at(p - 1, &chunk_beg);
+        const size_t b = std::max(chunk_beg, beg);
+        size_t i = find_after_last(chunk.data() + (b - chunk_beg), p - b, buffer_char{'\n'});
+        if (i != 0) {
+            return b + i;
+        }
+        p = b;
+    }
+    return beg;
+}
+
+// Returns the offset after the n'th newline (counting from 1) in [beg, end), which must
+// have at least n.
+size_t after_nth_newline_in(const text_storage& text, size_t beg, size_t end, size_t n) {
+    size_t ret = SIZE_MAX;
+    size_t off = beg;
+    text.for_each_span(beg, end, [&](std::span<const buffer_char> span) {
+        if (ret != SIZE_MAX) {
+            return;
+        }
+        size_t c = count_newlines(span.data(), span.size());
+        if (c < n) {
+            n -= c;
+            off += span.size();
+        } else {
+            ret = off + find_after_nth_newline(span.data(), span.size(), n);
+        }
+    });
+    logic_check(ret != SIZE_MAX, "after_nth_newline_in ran out of newlines");
+    return ret;
+}
+
+size_t lowest_bit(size_t i) {
+    return i & -i;
+}
+
+}  // namespace
+
+line_index::line_index(const text_storage& text) {
+    blocks_ = make_blocks(text, 0, text.size());
+    rebuild_tree();
+}
+
+std::vector<line_index::block> line_index::make_blocks(const text_storage& text, size_t beg, size_t end) {
+    // Collect the spans first, so that the counting threads only read the text's memory.
+    std::vector<std::span<const buffer_char>> spans;
+    std::vector<size_t> span_offsets;
+    size_t off = beg;
+    text.for_each_span(beg, end, [&](std::span<const buffer_char> span) {
+        spans.push_back(span);
+        span_offsets.push_back(off);
+        off += span.size();
+    });
+
+    const size_t total = end - beg;
+    const size_t count = ceil_divide(total, BLOCK_SIZE);
+    std::vector<block> ret(count);
+    parallel_for(count, PARALLEL_BLOCKS, [&](size_t p) {
+        const size_t b = beg + total * p / count;
+        const size_t e = beg + total * (p + 1) / count;
+        // The last span starting at or before b.
+        size_t s = (std::upper_bound(span_offsets.begin(), span_offsets.end(), b) - span_offsets.begin()) - 1;
+        size_t newlines = 0;
+        for (size_t i = b; i < e; ++s) {
+            const size_t span_off = i - span_offsets[s];
+            const size_t n = std::min(spans[s].size() - span_off, e - i);
+            newlines += count_newlines(spans[s].data() + span_off, n);
+            i += n;
+        }
+        ret[p] = {.size = e - b, .newlines = newlines};
+    });
+    return ret;
+}
+
+void line_index::rebuild_tree() {
+    const size_t n = blocks_.size();
+    tree_.assign(n + 1, block{});
+    for (size_t i = 1; i <= n; ++i) {
+        tree_[i].size += blocks_[i - 1].size;
+        tree_[i].newlines += blocks_[i - 1].newlines;
+        const size_t parent = i + lowest_bit(i);
+        if (parent <= n) {
+            tree_[parent].size += tree_[i].size;
+            tree_[parent].newlines += tree_[i].newlines;
+        }
+    }
+}
+
+void line_index::push_block(const block& b) {
+    if (tree_.empty()) {
+        tree_.push_back(block{});
+    }
+    blocks_.push_back(b);
+    // tree_[i] sums the blocks [i - lowest_bit(i), i).
+    const size_t i = blocks_.size();
+    const block all = prefix(i - 1);
+    const block excluded = prefix(i - lowest_bit(i));
+    tree_.push_back({
+        .size = b.size + all.size - excluded.size,
+        .newlines = b.newlines + all.newlines - excluded.newlines,
+    });
+}
+
+void line_index::adjust_block(size_t i, size_t size_delta, size_t newlines_delta) {
+    blocks_[i].size += size_delta;
+    blocks_[i].newlines += newlines_delta;
+    for (size_t j = i + 1; j < tree_.size(); j += lowest_bit(j)) {
+        tree_[j].size += size_delta;
+        tree_[j].newlines += newlines_delta;
+    }
+}
+
+line_index::block line_index::prefix(size_t i) const {
+    block ret;
+    for (size_t j = i; j > 0; j -= lowest_bit(j)) {
+        ret.size += tree_[j].size;
+        ret.newlines += tree_[j].newlines;
+    }
+    return ret;
+}
+
+size_t line_index::find_block_at(size_t pos, block *prefix_out) const {
+    const size_t n = blocks_.size();
+    logic_check(n > 0, "line_index::find_block_at on empty index");
+    // Find the number of blocks that end at or before pos, descending the tree.
+    size_t i = 0;
+    block pre;
+    for (size_t step = std::bit_floor(n); step > 0; step >>= 1) {
+        if (i + step <= n && pre.size + tree_[i + step].size <= pos) {
+            i += step;
+            pre.size += tree_[i].size;
+            pre.newlines += tree_[i].newlines;
+        }
+    }
+    if (i == n) {
+        logic_check(pos == pre.size, "line_index::find_block_at out of range");
+        --i;
+        pre.size -= blocks_[i].size;
+        pre.newlines -= blocks_[i].newlines;
+    }
+    *prefix_out = pre;
+    return i;
+}
+
+size_t line_index::find_block_with_newline(size_t n, block *prefix_out) const {
+    const size_t count = blocks_.size();
+    // Find the number of blocks with fewer than n newlines in total.
+    size_t i = 0;
+    block pre;
+    for (size_t step = std::bit_floor(count); step > 0; step >>= 1) {
+        if (i + step <= count && pre.newlines + tree_[i + step].newlines < n) {
+            i += step;
+            pre.size += tree_[i].size;
+            pre.newlines += tree_[i].newlines;
+        }
+    }
+    logic_check(i < count, "line_index::find_block_with_newline out of range");
+    *prefix_out = pre;
+    return i;
+}
+
+size_t line_index::newline_count() const {
+    return prefix(blocks_.size()).newlines;
+}
+
+void line_index::note_insert(const text_storage& text, size_t pos, const buffer_char *chs, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (blocks_.empty()) {
+        blocks_ = make_blocks(text, 0, text.size());
+        rebuild_tree();
+        return;
+    }
+    block pre;
+    size_t i = find_block_at(pos, &pre);
+    adjust_block(i, count, count_newlines(chs, count));
+    if (blocks_[i].size > MAX_BLOCK_SIZE) {
+        std::vector<block> split = make_blocks(text, pre.size, pre.size + blocks_[i].size);
+        blocks_.erase(blocks_.begin() + i);
+        blocks_.insert(blocks_.begin() + i, split.begin(), split.end());
+        rebuild_tree();
+    }
+}
+
+void line_index::note_erase(size_t pos, const buffer_char *erased, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    block pre;
+    size_t i = find_block_at(pos, &pre);
+    size_t off = pos - pre.size;
+    // Typically the erased text is inside one block, which stays big enough (or was
+    // already small, having no neighbor to merge with).
+    const size_t size = blocks_[i].size;
+    if (off + count <= size && (size - count >= MIN_BLOCK_SIZE || (size < MIN_BLOCK_SIZE && count < size))) {
+        adjust_block(i, -count, -count_newlines(erased, count));
+        return;
+    }
+
+    size_t j = i;
+    for (size_t done = 0; done < count; ++j) {
+        logic_check(j < blocks_.size(), "line_index::note_erase out of range");
+        const size_t n = std::min(count - done, blocks_[j].size - off);
+        blocks_[j].size -= n;
+        blocks_[j].newlines -= count_newlines(erased + done, n);
+        done += n;
+        off = 0;
+    }
+    blocks_.erase(std::remove_if(blocks_.begin() + i, blocks_.begin() + j,
+                                 [](const block& b) { return b.size == 0; }),
+                  blocks_.begin() + j);
+
+    // Merge what's left of the edited blocks with their neighbors, if it's small.
+    for (size_t k = (i == 0 ? 0 : i - 1); k < std::min(i + 1, blocks_.size()); ) {
+        if (k + 1 < blocks_.size()
+            && (blocks_[k].size < MIN_BLOCK_SIZE || blocks_[k + 1].size < MIN_BLOCK_SIZE)
+            && blocks_[k].size + blocks_[k + 1].size <= MAX_BLOCK_SIZE) {
+            blocks_[k].size += blocks_[k + 1].size;
+            blocks_[k].newlines += blocks_[k + 1].newlines;
+            blocks_.erase(blocks_.begin() + k + 1);
+        } else {
+            ++k;
+        }
+    }
+    rebuild_tree();
+}
+
+void line_index::append(line_index&& other) {
+    for (const block& b : other.blocks_) {
+        push_block(b);
+    }
+    other = line_index();
+}
+
+size_t line_index::line_at(const text_storage& text, size_t pos) const {
+    if (pos == text.size()) {
+        return newline_count();
+    }
+    block pre;
+    find_block_at(pos, &pre);
+    return pre.newlines + newlines_in(text, pre.size, pos);
+}
+
+size_t line_index::line_start(const text_storage& text, size_t n) const {
+    if (n == 0) {
+        return 0;
+    }
+    if (n > newline_count()) {
+        return text.size();
+    }
+    block pre;
+    size_t i = find_block_with_newline(n, &pre);
+    return after_nth_newline_in(text, pre.size, pre.size + blocks_[i].size, n - pre.newlines);
+}
+
+size_t line_index::line_beginning(const text_storage& text, size_t pos) const {
+    if (pos == 0) {
+        return 0;
+    }
+    block pre;
+    find_block_at(pos - 1, &pre);
+    size_t ret = after_last_newline_in(text, pre.size, pos);
+    if (ret != pre.size) {
+        return ret;
+    }
+    if (pre.newlines == 0) {
+        // It's the first line.
+        return 0;
+    }
+    // The line began in an earlier block -- the one with the last newline before this one.
+    size_t i = find_block_with_newline(pre.newlines, &pre);
+    return after_last_newline_in(text, pre.size, pre.size + blocks_[i].size);
+}
+
+}  // namespace qwi
@@ -0,0 +1,71 @@
+#ifndef QWERTILLION_LINE_INDEX_HPP_
+#define QWERTILLION_LINE_INDEX_HPP_
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "chars.hpp"
+#include "text_storage.hpp"
+
+namespace qwi {
+
+// Where the lines of a buffer's text start.  The text is cut into blocks of a few KiB, and
+// we keep each block's size and newline count, plus a Fenwick tree of both.  So offset ->
+// line and line -> offset are O(log B) plus a scan of one block, no matter how long the
+// lines are, or which text_storage holds the text.
+//
+// The index doesn't hold the text.  The buffer calls note_insert, note_erase and append
+// after every edit of its text_storage, and passes the text to queries.
+class line_index {
+public:
+    line_index() = default;
+    explicit line_index(const text_storage& text);
+
+    size_t newline_count() const;
+
+    // Call after text got [pos, pos + count) inserted (with the chars chs).
+    void note_insert(const text_storage& text, size_t pos, const buffer_char *chs, size_t count);
+    // Call after the text [pos, pos + count), which was erased, was removed from text.
+    void note_erase(size_t pos, const buffer_char *erased, size_t count);
+    // Call after text got other's text appended to it.  Takes O(other's blocks), so that the
+    // appended text can get indexed elsewhere (see file_loader).
+    void append(line_index&& other);
+
+    // The number of newlines in [0, pos).
+    size_t line_at(const text_storage& text, size_t pos) const;
+    // The offset after the n'th newline (counting from 1), or text.size() if there are
+    // fewer than n.  0 for n == 0.
+    size_t line_start(const text_storage& text, size_t n) const;
+    // The offset after the last newline in [0, pos), or 0 if there is none.
+    size_t line_beginning(const text_storage& text, size_t pos) const;
+
+private:
+    struct block {
+        size_t size = 0;
+        size_t newlines = 0;
+    };
+
+    static std::vector<block> make_blocks(const text_storage& text, size_t beg, size_t end);
+
+    // Fenwick tree operations.  tree_ has blocks_.size() + 1 entries, and entry 0 is unused.
+    void rebuild_tree();
+    void push_block(const block& b);
+    // Adds (with wraparound, so it can subtract) to blocks_[i] and the tree.
+    void adjust_block(size_t i, size_t size_delta, size_t newlines_delta);
+    // The sum of blocks [0, i).
+    block prefix(size_t i) const;
+    // The block containing pos (the last block, if pos is the text's size), setting
+    // *prefix_out to the sum of the blocks before it.  There must be a block.
+    size_t find_block_at(size_t pos, block *prefix_out) const;
+    // The block containing the n'th newline (counting from 1), setting *prefix_out to the
+    // sum of the blocks before it.  n must be in [1, newline_count()].
+    size_t find_block_with_newline(size_t n, block *prefix_out) const;
+
+    std::vector<block> blocks_;
+    std::vector<block> tree_;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_LINE_INDEX_HPP_
@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -31,62 +32,11 @@ struct command_line_args {
 
 namespace qwi {
 
-void append_new_terminal_style(std::string *buf, const terminal_style& style) {
-
-    // Right now this code is non-general -- it assumes there is _only_ a bold bit.
-    *buf += TESC();
-    *buf += '0';
-    if (style.mask & terminal_style::BOLD_BIT) {
-        *buf += ";1";
-    }
-    if (style.mask & terminal_style::FOREGROUND_BIT) {
-        *buf += ';';
-        *buf += (style.foreground & terminal_style::BRIGHT) ? '9' : '3';
-        *buf += '0' + (style.foreground & 7);
-    }
-    if (style.mask & terminal_style::BACKGROUND_BIT) {
-        *buf += (style.background & terminal_style::BRIGHT) ? ";4" : ";10";
-        *buf += '0' + (style.background & 7);
-    }
-    *buf += 'm';
-}
-
-// Notably, this function does not write any ansi color or style escape sequences if the
-// style is uninital
-void write_frame(int fd, const terminal_frame& frame, std::string *write_buffer) {
-    terminal_style prev = terminal_style::zero();
-
-    write_buffer->resize(0);
-    std::string& buf = *write_buffer;
-    buf += TESC(?25l);
-    buf += TESC(H);
-    for (size_t i = 0; i < frame.window.rows; ++i) {
-        for (size_t j = 0; j < frame.window.cols; ++j) {
-            size_t offset = i * frame.window.cols + j;
-            if (prev != frame.style_data[offset]) {
-                append_new_terminal_style(&buf, frame.style_data[offset]);
-                prev = frame.style_data[offset];
-            }
-            buf += frame.data[offset].as_char();
-        }
-        if (prev != terminal_style::zero()) {
-            append_new_terminal_style(&buf, terminal_style::zero());
-            prev = terminal_style::zero();
-        }
-        if (i < frame.window.rows - 1) {
-            buf += "\r\n";
-        }
-    }
-    if (frame.cursor.has_value()) {
-        buf += TERMINAL_ESCAPE_SEQUENCE;
-        buf += std::to_string(frame.cursor->row + 1);
-        buf += ';';
-        buf += std::to_string(frame.cursor->col + 1);
-        buf += 'H';
-        // TODO: Make cursor visible when exiting program.
-        buf += TESC(?25h);
+void write_frame(int fd, const terminal_frame& frame, terminal_screen *screen) {
+    encode_frame(frame, screen);
+    if (!screen->write_buffer.empty()) {
+        write_data(fd, screen->write_buffer.data(), screen->write_buffer.size());
     }
-    write_data(fd, buf.data(), buf.size());
 }
 
 void draw_empty_frame_for_exit(int fd, const terminal_size& window) {
@@ -99,8 +49,8 @@ void draw_empty_frame_for_exit(int fd, const terminal_size& window) {
     // TODO: Ensure cursor is restored on non-happy-paths.
     frame.cursor = {0, 0};
 
-    std::string write_buffer;
-    write_frame(fd, frame, &write_buffer);
+    terminal_screen screen;
+    write_frame(fd, frame, &screen);
 }
 
 state initial_state(const command_line_args& args) {
@@ -170,6 +120,11 @@ uint32_t render_string(terminal_frame *frame, const terminal_coord& coord, uint3
 void render_normal_status_area(terminal_frame *frame, const state& state, window_number winnum, const ui_window_ctx *ui, const buffer *buf, const terminal_coord status_area_topleft, const uint32_t status_area_width) {
     buffer_string str = buffer_name(&state, buf->id);
     str += to_buffer_string(buf->modified_flag() ? " ** " : "    ");
+    if (const file_loader *loader = find_file_loader(&state, buf->id)) {
+        const size_t percent = loader->file_size() == 0 ? 100
+            : std::min<uint64_t>(100, uint64_t(buf->size()) * 100 / loader->file_size());
+        str += to_buffer_string("Loading " + std::to_string(percent) + "% ");
+    }
 
     uint32_t count = render_string(frame, status_area_topleft, status_area_width, str,
                                    terminal_style::bold());
@@ -275,7 +230,7 @@ struct reused_redraw_state_bufs {
     terminal_frame frame;
     std::vector<uint32_t> columnar_splits;
     std::vector<uint32_t> row_splits;
-    std::string write_buffer;
+    terminal_screen screen;
 };
 
 const std::vector<std::pair<const ui_window_ctx *, window_size>>&
@@ -387,6 +342,11 @@ redraw_state(int term, reused_redraw_state_bufs *reused, const terminal_size& wi
         }
     }
 
+    // Every window has looked up its lines, so the caches can drop the rest.
+    for (const auto& elem : state.buf_set) {
+        elem.second->rendered_lines().end_redraw();
+    }
+
     if (!state.ui_config.ansi_terminal) {
         // Wipe out styling.
         for (terminal_style& style  : frame.style_data) {
@@ -394,7 +354,7 @@ redraw_state(int term, reused_redraw_state_bufs *reused, const terminal_size& wi
         }
     }
 
-    write_frame(term, frame, &reused->write_buffer);
+    write_frame(term, frame, &reused->screen);
 
     return frame.rendered_window_sizes;
 }
@@ -434,7 +394,7 @@ undo_killring_handled insert_keypress(state *state, buffer *buf) {
 }
 
 undo_killring_handled f1_keypress(state *, buffer *) { return nop_keypress(); }
-undo_killring_handled f2_keypress(state *, buffer *) { return nop_keypress(); }
+undo_killring_handled f2_keypress(state *state, buffer *) { return undo_memory_report(state); }
 undo_killring_handled f3_keypress(state *, buffer *) { return nop_keypress(); }
 undo_killring_handled f4_keypress(state *, buffer *) { return nop_keypress(); }
 undo_killring_handled f5_keypress(state *state, buffer *active_buf) { return rotate_buf_right(state, active_buf); }
@@ -587,6 +547,13 @@ undo_killring_handled ctrl_underscore_keypress(state *state, ui_window_ctx *ui,
     return handled_undo_killring(state, active_buf);
 }
 
+undo_killring_handled ctrl_x_u_keypress(state *state, buffer *active_buf) {
+    return undo_steps_action(state, active_buf);
+}
+undo_killring_handled ctrl_x_r_keypress(state *state, ui_window_ctx *ui, buffer *active_buf) {
+    return undo_to_saved_action(state, ui, active_buf);
+}
+
 undo_killring_handled ctrl_x_2_keypress(state *state, buffer *active_buf) {
     return split_horizontally(state, active_buf);
 }
@@ -780,6 +747,10 @@ undo_killring_handled process_keyprefix_in_buf(
                         return ctrl_x_b_keypress(state, active_buf);
                     case 'k':
                         return ctrl_x_k_keypress(state, active_buf);
+                    case 'r':
+                        return ctrl_x_r_keypress(state, ui, active_buf);
+                    case 'u':
+                        return ctrl_x_u_keypress(state, active_buf);
                         // TODO: It would be cool if we had a special mode that made C-x Left Left Left Right stay in "window adjusting mode" for arrow keys only.
                     case keypress::special_to_key_type(special_key::Left):
                         return ctrl_x_arrow_keypress(state, active_buf, ortho_direction::Left);
@@ -867,6 +838,36 @@ undo_killring_handled process_keyprefix_in_buf(
     return handled_undo_killring(state, active_buf);
 }
 
+// How long the tty must be quiet before we do idle work.
+constexpr int IDLE_WORK_DELAY_MS = 1000;
+
+enum class wakeup { tty, file_loader, idle, };
+
+// Waits for tty input or file loader progress.  Returns wakeup::tty if the tty is readable
+// (even if a file loader has progress too), wakeup::file_loader if only a file loader has
+// progress, and wakeup::idle if there's idle work and the tty stayed quiet for
+// IDLE_WORK_DELAY_MS.
+wakeup wait_for_tty_input(int term, const state& state) {
+    std::vector<struct pollfd> fds;
+    fds.push_back({.fd = term, .events = POLLIN, .revents = 0});
+    for (const std::unique_ptr<file_loader>& loader : state.file_loaders) {
+        fds.push_back({.fd = loader->wakeup_fd(), .events = POLLIN, .revents = 0});
+    }
+    const int timeout = has_idle_work(state) ? IDLE_WORK_DELAY_MS : -1;
+    for (;;) {
+        int res = poll(fds.data(), fds.size(), timeout);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        }
+        runtime_check(res != -1, "poll failed: %s", runtime_check_strerror);
+        if (res == 0) {
+            return wakeup::idle;
+        }
+        // We give the tty priority, so that typing stays responsive.
+        return fds[0].revents != 0 ? wakeup::tty : wakeup::file_loader;
+    }
+}
+
 void main_loop(int term, const command_line_args& args) {
     state state = initial_state(args);
 
@@ -883,16 +884,36 @@ void main_loop(int term, const command_line_args& args) {
         }
         state.layout.last_rendered_terminal_size = window;
     };
+    offer_journal_recovery(&state);
     redraw();
 
     bool exit = false;
     for (; !exit; ) {
+        const wakeup woken = wait_for_tty_input(term, state);
+        if (!state.file_loaders.empty()) {
+            // The tty gets priority, so with input coming all the time (a held key), we'd
+            // never get a file_loader wakeup -- take the loaders' progress on every one.
+            apply_file_loader_progress(&state);
+        }
+        switch (woken) {
+        case wakeup::tty:
+            break;
+        case wakeup::file_loader:
+            redraw();
+            continue;
+        case wakeup::idle:
+            do_idle_work(&state);
+            continue;
+        }
+
         undo_killring_handled handled = read_and_process_tty_input(term, &state, &exit);
         {
             // Undo and killring behavior has been handled exhaustively in all branches of
             // read_and_process_tty_input -- here's where we consume that fact.
             (void)handled;
         }
+        enforce_undo_budget(&state);
+        flush_journals(&state);
 
         // TODO: Use SIGWINCH.  Procrastinating this for as long as possible.
         terminal_size new_window = get_terminal_size(term);
@@ -903,6 +924,10 @@ void main_loop(int term, const command_line_args& args) {
 
         redraw();
     }
+
+    // A clean exit, so the unsaved edits were abandoned on purpose.  (After a crash, the
+    // journals stay behind.)
+    discard_all_journals(&state);
 }
 
 int run_program(const command_line_args& args) {
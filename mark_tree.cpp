@@ -0,0 +1,146 @@
+#include "mark_tree.hpp"
+
+namespace qwi {
+
+uint64_t mark_tree::next_priority() {
+    // splitmix64 -- any decent scrambling of a counter makes the treap balanced.
+    uint64_t z = (priority_state_ += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+void mark_tree::detach(size_t t, size_t base) {
+    if (t != NIL) {
+        nodes_[t].rel += base;
+        nodes_[t].parent = NIL;
+    }
+}
+
+void mark_tree::attach(size_t t, size_t p, size_t p_abs, bool as_left) {
+    (as_left ? nodes_[p].left : nodes_[p].right) = t;
+    if (t != NIL) {
+        nodes_[t].rel -= p_abs;
+        nodes_[t].parent = p;
+    }
+}
+
+void mark_tree::split(size_t t, size_t base, size_t key, size_t *lt_out, size_t *ge_out) {
+    if (t == NIL) {
+        *lt_out = NIL;
+        *ge_out = NIL;
+        return;
+    }
+    node& n = nodes_[t];
+    const size_t abs = base + n.rel;
+    n.rel = abs;
+    n.parent = NIL;
+    size_t a, b;
+    if (abs < key) {
+        split(n.right, abs, key, &a, &b);
+        attach(a, t, abs, false);
+        *lt_out = t;
+        *ge_out = b;
+    } else {
+        split(n.left, abs, key, &a, &b);
+        attach(b, t, abs, true);
+        *lt_out = a;
+        *ge_out = t;
+    }
+}
+
+size_t mark_tree::merge(size_t a, size_t b) {
+    if (a == NIL) {
+        return b;
+    }
+    if (b == NIL) {
+        return a;
+    }
+    if (nodes_[a].priority > nodes_[b].priority) {
+        const size_t abs = nodes_[a].rel;
+        size_t child = nodes_[a].right;
+        detach(child, abs);
+        attach(merge(child, b), a, abs, false);
+        return a;
+    } else {
+        const size_t abs = nodes_[b].rel;
+        size_t child = nodes_[b].left;
+        detach(child, abs);
+        attach(merge(a, child), b, abs, true);
+        return b;
+    }
+}
+
+void mark_tree::zero_offsets(size_t t) {
+    if (t != NIL) {
+        nodes_[t].rel = 0;
+        zero_offsets(nodes_[t].left);
+        zero_offsets(nodes_[t].right);
+    }
+}
+
+void mark_tree::add(size_t slot, size_t offset) {
+    if (slot >= nodes_.size()) {
+        nodes_.resize(slot + 1);
+    }
+    logic_check(!nodes_[slot].used, "mark_tree::add on used slot %zu", slot);
+    nodes_[slot] = node{.rel = offset, .priority = next_priority(), .used = true};
+    size_t lt, ge;
+    split(root_, 0, offset, &lt, &ge);
+    root_ = merge(merge(lt, slot), ge);
+}
+
+void mark_tree::remove(size_t slot) {
+    logic_check(slot < nodes_.size() && nodes_[slot].used, "mark_tree::remove on unused slot %zu", slot);
+    const size_t abs = offset(slot);
+    node& n = nodes_[slot];
+    const size_t p = n.parent;
+    const size_t left = n.left, right = n.right;
+    detach(left, abs);
+    detach(right, abs);
+    const size_t replacement = merge(left, right);
+    if (p == NIL) {
+        root_ = replacement;
+    } else {
+        const size_t p_abs = abs - nodes_[slot].rel;
+        attach(replacement, p, p_abs, nodes_[p].left == slot);
+    }
+    nodes_[slot] = node{};
+}
+
+size_t mark_tree::offset(size_t slot) const {
+    logic_check(slot < nodes_.size() && nodes_[slot].used, "mark_tree::offset on unused slot %zu", slot);
+    size_t ret = 0;
+    for (size_t t = slot; t != NIL; t = nodes_[t].parent) {
+        ret += nodes_[t].rel;
+    }
+    return ret;
+}
+
+void mark_tree::shift_from(size_t first_offset, size_t count) {
+    size_t lt, ge;
+    split(root_, 0, first_offset, &lt, &ge);
+    if (ge != NIL) {
+        nodes_[ge].rel += count;
+    }
+    root_ = merge(lt, ge);
+}
+
+size_t mark_tree::last_at_or_before(size_t offset, size_t *offset_out) const {
+    size_t ret = NONE;
+    size_t base = 0;
+    for (size_t t = root_; t != NIL;) {
+        const size_t abs = base + nodes_[t].rel;
+        base = abs;
+        if (abs <= offset) {
+            ret = t;
+            *offset_out = abs;
+            t = nodes_[t].right;
+        } else {
+            t = nodes_[t].left;
+        }
+    }
+    return ret;
+}
+
+}  // namespace qwi
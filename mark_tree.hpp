@@ -0,0 +1,106 @@
+#ifndef QWERTILLION_MARK_TREE_HPP_
+#define QWERTILLION_MARK_TREE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "error.hpp"
+
+namespace qwi {
+
+// The offsets of a buffer's marks, in a treap ordered by offset.  Each node stores its
+// offset relative to its parent's (the root's is absolute), so shifting every mark after
+// an edit point means splitting the tree there and adjusting one root: O(log m) for m
+// marks, instead of touching every mark.
+//
+// Marks are identified by slot numbers (buffer's mark_id::index), which the caller picks.
+// Offsets are unsigned and may wrap around in relative form; absolute offsets never do.
+class mark_tree {
+public:
+    // Slot must not be in use.
+    void add(size_t slot, size_t offset);
+    void remove(size_t slot);
+    size_t offset(size_t slot) const;
+    void set_offset(size_t slot, size_t offset) {
+        remove(slot);
+        add(slot, offset);
+    }
+
+    // Adds count to the offsets of marks at or after first_offset.
+    void shift_from(size_t first_offset, size_t count);
+
+    static constexpr size_t NONE = SIZE_MAX;
+    // The slot of the last mark with an offset <= `offset`, or NONE.  Sets *offset_out to
+    // its offset.  O(log m).
+    size_t last_at_or_before(size_t offset, size_t *offset_out) const;
+
+    // Text got deleted:  marks with offsets in [lo, hi) get moved to `to`, and marks at or
+    // after hi get moved back by `removed`.  Calls fn(slot, old_offset) on the moved marks
+    // in [lo, hi), in O(log m + k) for k such marks.  The caller makes sure the order of
+    // marks doesn't change.
+    template <class Callable>
+    void collapse_range(size_t lo, size_t hi, size_t to, size_t removed, Callable&& fn) {
+        logic_check(lo <= hi && to <= lo && removed <= hi - to,
+                    "mark_tree::collapse_range bad range");
+        size_t left, middle_right, middle, right;
+        split(root_, 0, lo, &left, &middle_right);
+        split(middle_right, 0, hi, &middle, &right);
+        if (middle != NIL) {
+            visit(middle, 0, fn);
+            // They're all at `to` now:  the root's absolute offset is `to`, and every other
+            // node is relative 0 to its parent.
+            zero_offsets(middle);
+            nodes_[middle].rel = to;
+        }
+        if (right != NIL) {
+            nodes_[right].rel -= removed;
+        }
+        root_ = merge(merge(left, middle), right);
+    }
+
+private:
+    static constexpr size_t NIL = SIZE_MAX;
+
+    struct node {
+        // Offset relative to the parent (or absolute, for the root).
+        size_t rel = 0;
+        uint64_t priority = 0;
+        size_t left = NIL, right = NIL, parent = NIL;
+        bool used = false;
+    };
+
+    // Splits the subtree at t (whose parent's absolute offset is base) into marks with
+    // offsets < key and >= key.  The results are detached roots, with absolute offsets.
+    void split(size_t t, size_t base, size_t key, size_t *lt_out, size_t *ge_out);
+    // Joins two detached roots with absolute offsets, where a's marks are <= b's.
+    size_t merge(size_t a, size_t b);
+    // Makes child t of a node at absolute offset base into a detached root.
+    void detach(size_t t, size_t base);
+    // Attaches detached root t (possibly NIL) as a child of p, at absolute offset p_abs.
+    void attach(size_t t, size_t p, size_t p_abs, bool as_left);
+
+    void zero_offsets(size_t t);
+
+    template <class Callable>
+    void visit(size_t t, size_t base, Callable& fn) const {
+        if (t == NIL) {
+            return;
+        }
+        const size_t abs = base + nodes_[t].rel;
+        visit(nodes_[t].left, abs, fn);
+        fn(t, abs);
+        visit(nodes_[t].right, abs, fn);
+    }
+
+    uint64_t next_priority();
+
+    std::vector<node> nodes_;
+    size_t root_ = NIL;
+    uint64_t priority_state_ = 0;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_MARK_TREE_HPP_
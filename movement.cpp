@@ -57,7 +57,7 @@ void move_backward_word(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf)
 }
 
 // Maybe move_up and move_down should be in term_ui.cpp.
-void move_up(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf) {
+void move_up(scratch_frame *, ui_window_ctx *ui, buffer *buf) {
     const size_t cursor = get_ctx_cursor(ui, buf);
 
     const size_t window_cols = ui->window_cols_or_maxval();
@@ -128,12 +128,11 @@ void move_up(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf) {
         // We're already on the top row.
         return;
     }
-    buf->set_cursor_(prev_row_cursor_proposal);  // For UI rendering (line,col) perf.
-    set_ctx_cursor(ui, buf);
-    recenter_cursor_if_offscreen(scratch, ui, buf);
+    set_ctx_cursor(ui, buf, prev_row_cursor_proposal);
+    recenter_cursor_if_offscreen(ui, buf);
 }
 
-void move_down(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf) {
+void move_down(scratch_frame *, ui_window_ctx *ui, buffer *buf) {
     const size_t cursor = get_ctx_cursor(ui, buf);
     const size_t window_cols = ui->window_cols_or_maxval();
     // TODO: This may compute current_column -- if it does, reuse the value below.
@@ -182,9 +181,8 @@ void move_down(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf) {
         candidate_index = buf->size();
     }
 
-    buf->set_cursor_(candidate_index);
-    set_ctx_cursor(ui, buf);
-    recenter_cursor_if_offscreen(scratch, ui, buf);
+    set_ctx_cursor(ui, buf, candidate_index);
+    recenter_cursor_if_offscreen(ui, buf);
 }
 
 void move_home(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf) {
@@ -0,0 +1,39 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace qwi {
+
+void parallel_for(size_t n, size_t min_per_thread, const std::function<void(size_t)>& fn) {
+    const size_t hardware = std::max<size_t>(1, std::thread::hardware_concurrency());
+    const size_t num_threads = std::min(hardware, n / std::max<size_t>(1, min_per_thread));
+    if (num_threads <= 1) {
+        for (size_t i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    // Threads take values of i in order, so that they read memory roughly front to back
+    // together.
+    std::atomic<size_t> next = 0;
+    auto work = [&] {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n; ) {
+            fn(i);
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads - 1);
+    for (size_t t = 1; t < num_threads; ++t) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+}  // namespace qwi
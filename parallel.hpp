@@ -0,0 +1,19 @@
+#ifndef QWERTILLION_PARALLEL_HPP_
+#define QWERTILLION_PARALLEL_HPP_
+
+#include <stddef.h>
+
+#include <functional>
+
+namespace qwi {
+
+// Calls fn(i) for every i in [0, n), spread over worker threads (and this one), giving
+// each thread at least min_per_thread values of i.  If that makes for just one thread,
+// everything runs on this one.  fn must not throw.
+//
+// Threads are started per call -- callers have enough work to make that cost negligible.
+void parallel_for(size_t n, size_t min_per_thread, const std::function<void(size_t)>& fn);
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_PARALLEL_HPP_
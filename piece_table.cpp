@@ -0,0 +1,211 @@
+#include "piece_table.hpp"
+
+#include <string.h>
+
+#include "arith.hpp"
+#include "parallel.hpp"
+
+namespace qwi {
+
+// The original text is split into pieces at most this big, so that stats_at never scans
+// more than this much.
+constexpr size_t MAX_ORIGINAL_PIECE_SIZE = 1 << 20;
+
+piece_table::piece_table(buffer_string&& str) : original_string_(std::move(str)) {
+    init_original(0, original_string_.size());
+}
+
+piece_table::piece_table(std::shared_ptr<const mapped_file> file) : file_(std::move(file)) {
+    init_original(0, file_->size);
+}
+
+piece_table::piece_table(std::shared_ptr<const mapped_file> file, size_t beg, size_t end) : file_(std::move(file)) {
+    logic_check(beg <= end && end <= file_->size, "piece_table of a file out of range");
+    init_original(beg, end);
+}
+
+void piece_table::init_original(size_t beg, size_t end) {
+    const buffer_char *data = original_data();
+    const size_t size = end - beg;
+    pieces_.resize(ceil_divide(size, MAX_ORIGINAL_PIECE_SIZE));
+    // Each piece is big enough to be worth a thread.
+    parallel_for(pieces_.size(), 1, [&](size_t i) {
+        const size_t off = beg + i * MAX_ORIGINAL_PIECE_SIZE;
+        const size_t length = std::min(MAX_ORIGINAL_PIECE_SIZE, end - off);
+        pieces_[i] = piece{
+            .added = false,
+            .offset = off,
+            .length = length,
+            .stats = compute_stats(data + off, length),
+        };
+    });
+    size_ = size;
+}
+
+void piece_table::ensure_index() const {
+    if (index_valid_) {
+        return;
+    }
+    index_offsets_.resize(pieces_.size() + 1);
+    index_stats_.resize(pieces_.size() + 1);
+    size_t off = 0;
+    region_stats stats{};
+    for (size_t i = 0; i < pieces_.size(); ++i) {
+        index_offsets_[i] = off;
+        index_stats_[i] = stats;
+        off += pieces_[i].length;
+        stats = append_stats(stats, pieces_[i].stats);
+    }
+    index_offsets_[pieces_.size()] = off;
+    index_stats_[pieces_.size()] = stats;
+    index_valid_ = true;
+}
+
+size_t piece_table::find_piece(size_t pos) const {
+    logic_check(pos < size_, "piece_table::find_piece out of range");
+    ensure_index();
+    // The last offset <= pos.  Pieces are non-empty, so it's unique.
+    auto it = std::upper_bound(index_offsets_.begin(), index_offsets_.end(), pos);
+    return (it - index_offsets_.begin()) - 1;
+}
+
+buffer_char piece_table::get(size_t i) const {
+    if (index_valid_ && cache_piece_ < pieces_.size()) {
+        // Typically i is in the same piece as last time, or the next one.
+        for (size_t c = cache_piece_; c < std::min(cache_piece_ + 2, pieces_.size()); ++c) {
+            if (i >= index_offsets_[c] && i < index_offsets_[c + 1]) {
+                cache_piece_ = c;
+                return piece_data(pieces_[c])[i - index_offsets_[c]];
+            }
+        }
+    }
+    logic_check(i < size_, "piece_table::get out of range: i=%zu, size=%zu", i, size_);
+    size_t c = find_piece(i);
+    cache_piece_ = c;
+    return piece_data(pieces_[c])[i - index_offsets_[c]];
+}
+
+region_stats piece_table::stats_at(size_t pos) const {
+    logic_check(pos <= size_, "piece_table::stats_at out of range");
+    if (pos == size_) {
+        ensure_index();
+        return index_stats_.back();
+    }
+    size_t c = find_piece(pos);
+    return append_stats(index_stats_[c],
+                        compute_stats(piece_data(pieces_[c]), pos - index_offsets_[c]));
+}
+
+std::span<const buffer_char> piece_table::chunk_at(size_t i, size_t *beg_out) const {
+    size_t c = find_piece(i);
+    cache_piece_ = c;
+    *beg_out = index_offsets_[c];
+    return {piece_data(pieces_[c]), pieces_[c].length};
+}
+
+void piece_table::copy_to(size_t beg, size_t end, buffer_char *out) const {
+    for_each_span(beg, end, [&](std::span<const buffer_char> span) {
+        memcpy(out, span.data(), span.size());
+        out += span.size();
+    });
+}
+
+size_t piece_table::split_at(size_t pos) {
+    if (pos == size_) {
+        return pieces_.size();
+    }
+    size_t c = find_piece(pos);
+    const size_t k = pos - index_offsets_[c];
+    if (k == 0) {
+        return c;
+    }
+    piece& p = pieces_[c];
+    const buffer_char *data = piece_data(p);
+    region_stats left_stats = compute_stats(data, k);
+    piece right{
+        .added = p.added,
+        .offset = p.offset + k,
+        .length = p.length - k,
+        .stats = subtract_stats_left(p.stats, left_stats, data + k, p.length - k),
+    };
+    p.length = k;
+    p.stats = left_stats;
+    pieces_.insert(pieces_.begin() + (c + 1), right);
+    invalidate_index();
+    return c + 1;
+}
+
+void piece_table::insert(size_t pos, const buffer_char *chs, size_t count) {
+    logic_check(pos <= size_, "piece_table::insert out of range");
+    if (count == 0) {
+        return;
+    }
+    const region_stats stats = compute_stats(chs, count);
+    const size_t c = split_at(pos);
+    // When typing, we extend the previous piece.
+    if (c > 0) {
+        piece& prev = pieces_[c - 1];
+        if (prev.added && prev.offset + prev.length == add_.size()) {
+            add_.append(chs, count);
+            prev.length += count;
+            prev.stats = append_stats(prev.stats, stats);
+            size_ += count;
+            invalidate_index();
+            return;
+        }
+    }
+    pieces_.insert(pieces_.begin() + c, piece{
+            .added = true,
+            .offset = add_.size(),
+            .length = count,
+            .stats = stats,
+        });
+    add_.append(chs, count);
+    size_ += count;
+    invalidate_index();
+}
+
+void piece_table::erase(size_t pos, size_t count, buffer_string *deleted_out) {
+    logic_check(count <= size_ && pos <= size_ - count, "piece_table::erase out of range");
+    if (count == 0) {
+        return;
+    }
+    if (deleted_out) {
+        deleted_out->reserve(deleted_out->size() + count);
+        for_each_span(pos, pos + count, [&](std::span<const buffer_char> span) {
+            deleted_out->append(span.data(), span.size());
+        });
+    }
+    const size_t beg = split_at(pos);
+    const size_t end = split_at(pos + count);
+    pieces_.erase(pieces_.begin() + beg, pieces_.begin() + end);
+    size_ -= count;
+    invalidate_index();
+}
+
+void piece_table::append(piece_table&& other) {
+    if (size_ == 0) {
+        *this = std::move(other);
+        other = piece_table();
+        return;
+    }
+    const bool same_file = file_ != nullptr && file_ == other.file_;
+    for (const piece& p : other.pieces_) {
+        if (same_file && !p.added) {
+            pieces_.push_back(p);
+            continue;
+        }
+        pieces_.push_back(piece{
+                .added = true,
+                .offset = add_.size(),
+                .length = p.length,
+                .stats = p.stats,
+            });
+        add_.append(other.piece_data(p), p.length);
+    }
+    size_ += other.size_;
+    invalidate_index();
+    other = piece_table();
+}
+
+}  // namespace qwi
@@ -0,0 +1,118 @@
+#ifndef QWERTILLION_PIECE_TABLE_HPP_
+#define QWERTILLION_PIECE_TABLE_HPP_
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "chars.hpp"
+#include "error.hpp"
+#include "io.hpp"
+#include "region_stats.hpp"
+
+namespace qwi {
+
+// Buffer text, stored as a sequence of pieces of two immutable sources: the original text
+// (typically a read-only mapping of the file) and an append-only buffer of inserted text.
+// Memory use is proportional to the edits, not to the file.
+//
+// Each piece caches its region_stats.  Offsets and stats of the pieces' starting
+// positions are indexed lazily (after each edit, on the next lookup), so lookups are
+// O(log P) and edits are O(P), for P pieces.
+class piece_table {
+public:
+    piece_table() = default;
+    explicit piece_table(buffer_string&& str);
+    explicit piece_table(std::shared_ptr<const mapped_file> file);
+    // The text [beg, end) of the file.  Tables of the same file append without copying.
+    piece_table(std::shared_ptr<const mapped_file> file, size_t beg, size_t end);
+    explicit piece_table(std::span<const buffer_char> text)
+        : piece_table(buffer_string(text.data(), text.size())) { }
+
+    size_t size() const { return size_; }
+    buffer_char get(size_t i) const;
+
+    void insert(size_t pos, const buffer_char *chs, size_t count);
+    // Erases [pos, pos + count), appending the erased text to *deleted_out (if non-null).
+    void erase(size_t pos, size_t count, buffer_string *deleted_out);
+    // Appends other's text, reusing its stats.  Its pieces of the same mapped file get
+    // shared, and the rest gets copied into the add buffer.
+    void append(piece_table&& other);
+
+    // Stats of the text in [0, pos).
+    region_stats stats_at(size_t pos) const;
+
+    void copy_to(size_t beg, size_t end, buffer_char *out) const;
+
+    // Returns the contiguous piece of text containing i (for i < size()), setting
+    // *beg_out to its offset.
+    std::span<const buffer_char> chunk_at(size_t i, size_t *beg_out) const;
+
+    // Calls fn(std::span<const buffer_char>) on the contiguous pieces of [beg, end), in
+    // order.
+    template <class Callable>
+    void for_each_span(size_t beg, size_t end, Callable&& fn) const {
+        logic_check(beg <= end && end <= size(), "piece_table::for_each_span out of range");
+        if (beg == end) {
+            return;
+        }
+        size_t i = find_piece(beg);
+        size_t off = beg - index_offsets_[i];
+        while (beg < end) {
+            const piece& p = pieces_[i];
+            const size_t n = std::min(p.length - off, end - beg);
+            fn(std::span<const buffer_char>{piece_data(p) + off, n});
+            beg += n;
+            off = 0;
+            ++i;
+        }
+    }
+
+private:
+    struct piece {
+        // From add_ (or else from the original text).
+        bool added;
+        size_t offset;
+        size_t length;
+        region_stats stats;
+    };
+
+    const buffer_char *original_data() const {
+        return file_ ? file_->data : original_string_.data();
+    }
+    const buffer_char *piece_data(const piece& p) const {
+        return (p.added ? add_.data() : original_data()) + p.offset;
+    }
+
+    // Makes pieces of [beg, end) of the original text.
+    void init_original(size_t beg, size_t end);
+    void ensure_index() const;
+    // Returns the index of the piece containing pos, for pos < size().
+    size_t find_piece(size_t pos) const;
+    // Splits pieces so that one starts at pos, and returns its index (or pieces_.size()).
+    size_t split_at(size_t pos);
+    void invalidate_index() { index_valid_ = false; }
+
+    // One of these holds the original text.
+    std::shared_ptr<const mapped_file> file_;
+    buffer_string original_string_;
+
+    buffer_string add_;
+    std::vector<piece> pieces_;
+    size_t size_ = 0;
+
+    // index_offsets_[i] and index_stats_[i] are the offset and stats of the text before
+    // pieces_[i], for i <= pieces_.size().
+    mutable std::vector<size_t> index_offsets_;
+    mutable std::vector<region_stats> index_stats_;
+    mutable bool index_valid_ = false;
+    // The piece last visited by get().
+    mutable size_t cache_piece_ = 0;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_PIECE_TABLE_HPP_
@@ -1,23 +1,16 @@
 #include "region_stats.hpp"
 
+#include <algorithm>
+#include <vector>
+
+#include "arith.hpp"
+#include "char_scan.hpp"
 #include "error.hpp"
+#include "parallel.hpp"
 #include "term_ui.hpp"  // for compute_char_rendering and char_rendering
 
 namespace qwi {
 
-// Belongs in util.cpp, maybe.
-// TODO: Make distance_to_beginning_of_line use this.  (Later.  It would depend on buffer's data structure.)
-size_t find_after_last(const buffer_char *data, size_t count, buffer_char ch) {
-    size_t i = count - 1;
-    // Playing games with underflow.
-    for (; i != size_t(-1); --i) {
-        if (data[i] == ch) {
-            break;
-        }
-    }
-    return i + 1;
-}
-
 region_stats append_stats(const region_stats& left, const region_stats& right) {
     size_t newline_count = left.newline_count + right.newline_count;
     size_t last_line_size = right.last_line_size;
@@ -55,6 +48,12 @@ region_stats append_stats(const region_stats& left, const region_stats& right) {
 
 void compute_line_stats(const buffer_char *data, size_t count,
                         size_t *last_line_size_out, size_t *first_tab_size_out) {
+    // Typically the line has no tabs or control chars, and its width is its length.
+    if (is_single_width(data, count)) {
+        *last_line_size_out = count;
+        *first_tab_size_out = 0;
+        return;
+    }
     size_t line_col = 0;
     bool saw_newline = false;
     size_t first_tab_size = 0;
@@ -72,13 +71,10 @@ void compute_line_stats(const buffer_char *data, size_t count,
     *first_tab_size_out = first_tab_size;
 }
 
-region_stats compute_stats(const buffer_char *data, size_t count) {
+region_stats compute_stats_serial(const buffer_char *data, size_t count) {
     size_t beginning_of_line = find_after_last(data, count, buffer_char{'\n'});
 
-    size_t newline_count = 0;
-    for (size_t i = 0; i < beginning_of_line; ++i) {
-        newline_count += (data[i] == buffer_char{'\n'});
-    }
+    size_t newline_count = count_newlines(data, beginning_of_line);
 
     size_t last_line_size;
     size_t first_tab_size;
@@ -92,9 +88,36 @@ region_stats compute_stats(const buffer_char *data, size_t count) {
     };
 }
 
+region_stats compute_stats(const buffer_char *data, size_t count) {
+    if (count < PARALLEL_STATS_THRESHOLD) {
+        return compute_stats_serial(data, count);
+    }
+    // append_stats is associative, so we can compute chunks' stats in parallel and fold
+    // them.
+    const size_t num_chunks = ceil_divide(count, PARALLEL_STATS_CHUNK_SIZE);
+    std::vector<region_stats> chunk_stats(num_chunks);
+    parallel_for(num_chunks, 1, [&](size_t i) {
+        const size_t beg = i * PARALLEL_STATS_CHUNK_SIZE;
+        chunk_stats[i] = compute_stats_serial(data + beg, std::min(PARALLEL_STATS_CHUNK_SIZE, count - beg));
+    });
+    region_stats ret{};
+    for (const region_stats& stats : chunk_stats) {
+        ret = append_stats(ret, stats);
+    }
+    return ret;
+}
+
 region_stats subtract_stats_right(const region_stats& stats, const buffer_char *data, size_t new_count, size_t count) {
     logic_checkg(new_count <= count);
 
+    if (is_single_width(data + new_count, count - new_count)) {
+        return region_stats{
+            .newline_count = stats.newline_count,
+            .last_line_size = stats.last_line_size - (count - new_count),
+            .first_tab_size = stats.first_tab_size,
+        };
+    }
+
     size_t removed_newlines = 0;
     bool saw_tab = false;
     for (size_t i = new_count; i < count; ++i) {
@@ -26,7 +26,14 @@ struct region_stats {
 
 region_stats append_stats(const region_stats& left, const region_stats& right);
 
+// Inputs at least PARALLEL_STATS_THRESHOLD long get split into chunks, computed on
+// multiple threads.
+constexpr size_t PARALLEL_STATS_THRESHOLD = 8 << 20;
+constexpr size_t PARALLEL_STATS_CHUNK_SIZE = 1 << 20;
+
 region_stats compute_stats(const buffer_char *data, size_t count);
+// The single-threaded version.
+region_stats compute_stats_serial(const buffer_char *data, size_t count);
 
 inline region_stats compute_stats(const buffer_string& str) {
     return compute_stats(str.data(), str.size());
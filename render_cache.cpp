@@ -0,0 +1,378 @@
+#include "render_cache.hpp"
+
+#include <algorithm>
+#include <span>
+
+#include "char_scan.hpp"
+#include "term_ui.hpp"
+
+namespace qwi {
+
+namespace {
+
+// Windows show a few hundred lines at most.  Past this many between redraws, cursor
+// movement has left most lines behind, and we start over.
+constexpr size_t MAX_CACHED_LINES = 4096;
+
+size_t memory_size(const render_cache::line& line) {
+    return sizeof(render_cache::line)
+        + line.cells.capacity() * sizeof(terminal_char)
+        + line.columns.capacity() * sizeof(uint32_t)
+        + line.checkpoints.capacity() * sizeof(size_t);
+}
+
+// Appends count elements to *vec, growing it geometrically.
+template <class T>
+void grow(std::vector<T> *vec, size_t count) {
+    if (vec->capacity() - vec->size() < count) {
+        vec->reserve(std::max(vec->size() + count, 2 * vec->capacity()));
+    }
+    vec->resize(vec->size() + count);
+}
+
+// The column after [chs, chs + count), which has no newlines, starting at line_col.
+size_t column_after(const buffer_char *chs, size_t count, size_t line_col) {
+    // Like line::append.
+    for (size_t i = 0; i < count;) {
+        const size_t tab = i + find_first(chs + i, count - i, buffer_char{'\t'});
+        if (is_single_width(chs + i, tab - i)) {
+            line_col += tab - i;
+            i = tab;
+        }
+        for (; i <= tab && i < count; ++i) {
+            (void)compute_char_rendering(chs[i], &line_col);
+        }
+    }
+    return line_col;
+}
+
+}  // namespace
+
+void render_cache::line::render(const text_storage& text, size_t line_start, size_t min_bytes, size_t min_columns) {
+    size_t line_col = end_column();
+    while (!complete && (end_byte() < min_bytes || line_col < min_columns)) {
+        const size_t pos = line_start + end_byte();
+        if (pos == text.size()) {
+            complete = true;
+            break;
+        }
+        // Every byte before the newline renders in at least one column, so we need at most
+        // this many more of them.
+        const size_t wanted = std::max(min_bytes - std::min(min_bytes, end_byte()),
+                                       min_columns - std::min(min_columns, line_col));
+        size_t chunk_beg;
+        const std::span<const buffer_char> chunk = text.chunk_at(pos, &chunk_beg);
+        const buffer_char *chs = chunk.data() + (pos - chunk_beg);
+        const size_t avail = std::min(chunk.size() - (pos - chunk_beg), wanted);
+        const size_t count = find_first(chs, avail, buffer_char{'\n'});
+        append(chs, count);
+        line_col = end_column();
+        if (count < avail) {
+            // chs[count] is the newline.
+            complete = true;
+            ends_with_newline = true;
+        }
+    }
+    if (complete) {
+        length = end_byte();
+        width = end_column();
+    }
+}
+
+void render_cache::line::append(const buffer_char *chs, size_t count) {
+    size_t line_col = end_column();
+    // Tabs are the control characters text usually has, so we go from tab to tab, and copy
+    // what's between them if it's all single-width.
+    for (size_t i = 0; i < count;) {
+        const size_t tab = i + find_first(chs + i, count - i, buffer_char{'\t'});
+        if (is_single_width(chs + i, tab - i)) {
+            const size_t n = tab - i;
+            const size_t cells_size = cells.size(), columns_size = columns.size();
+            grow(&cells, n);
+            grow(&columns, n);
+            for (size_t j = 0; j < n; ++j) {
+                cells[cells_size + j] = terminal_char{chs[i + j].value};
+                columns[columns_size + j] = uint32_t(line_col + j + 1 - first_column);
+            }
+            line_col += n;
+            i = tab;
+        }
+        for (; i <= tab && i < count; ++i) {
+            char_rendering rend = compute_char_rendering(chs[i], &line_col);
+            cells.insert(cells.end(), rend.buf, rend.buf + rend.count);
+            columns.push_back(uint32_t(line_col - first_column));
+        }
+    }
+}
+
+void render_cache::line::restart(const text_storage& text, size_t line_start, size_t byte) {
+    const size_t line_col = column_at(text, line_start, byte);
+    first_byte = byte;
+    first_column = line_col;
+    cells.clear();
+    columns.assign(1, 0);
+    complete = false;
+    ends_with_newline = false;
+}
+
+void render_cache::line::scan(const text_storage& text, size_t line_start, size_t byte) {
+    if (fully_scanned()) {
+        return;
+    }
+    size_t b = (checkpoints.size() - 1) * CHECKPOINT_BYTES;
+    size_t line_col = checkpoints.back();
+    while (checkpoints.size() - 1 < byte / CHECKPOINT_BYTES) {
+        // We scan up to the next checkpoint, the end of the chunk, or the newline.
+        const size_t pos = line_start + b;
+        if (pos == text.size()) {
+            length = b;
+            width = line_col;
+            break;
+        }
+        size_t chunk_beg;
+        const std::span<const buffer_char> chunk = text.chunk_at(pos, &chunk_beg);
+        const buffer_char *chs = chunk.data() + (pos - chunk_beg);
+        const size_t avail = std::min(chunk.size() - (pos - chunk_beg), CHECKPOINT_BYTES - b % CHECKPOINT_BYTES);
+        const size_t count = find_first(chs, avail, buffer_char{'\n'});
+        line_col = column_after(chs, count, line_col);
+        b += count;
+        if (count < avail) {
+            length = b;
+            width = line_col;
+            break;
+        }
+        if (b % CHECKPOINT_BYTES == 0) {
+            checkpoints.push_back(line_col);
+        }
+    }
+}
+
+size_t render_cache::line::column_at(const text_storage& text, size_t line_start, size_t byte) {
+    if (first_byte <= byte && byte <= end_byte()) {
+        return column(byte);
+    }
+    if (length.has_value() && byte == *length) {
+        return width;
+    }
+    scan(text, line_start, byte);
+    const size_t j = std::min(byte / CHECKPOINT_BYTES, checkpoints.size() - 1);
+    size_t line_col = checkpoints[j];
+    text.for_each_span(line_start + j * CHECKPOINT_BYTES, line_start + byte, [&](std::span<const buffer_char> span) {
+        line_col = column_after(span.data(), span.size(), line_col);
+    });
+    return line_col;
+}
+
+size_t render_cache::line::line_width(const text_storage& text, size_t line_start) {
+    if (!length.has_value()) {
+        scan(text, line_start, SIZE_MAX);
+    }
+    return width;
+}
+
+size_t render_cache::line::byte_ending_after(const text_storage& text, size_t line_start, size_t column) {
+    if (first_column <= column && (column < end_column() || complete)) {
+        // The first byte ending past column is the one before the first byte starting
+        // past it.
+        auto it = std::upper_bound(columns.begin(), columns.end(), column - first_column);
+        return it == columns.end() ? end_byte() : first_byte + (it - columns.begin()) - 1;
+    }
+    // The last checkpoint at or before column, then a scan from there.
+    while (!fully_scanned() && checkpoints.back() <= column) {
+        scan(text, line_start, checkpoints.size() * CHECKPOINT_BYTES);
+    }
+    auto it = std::upper_bound(checkpoints.begin(), checkpoints.end(), column);
+    size_t b = (it - checkpoints.begin() - 1) * CHECKPOINT_BYTES;
+    size_t line_col = checkpoints[b / CHECKPOINT_BYTES];
+    for (;; ++b) {
+        if (line_start + b == text.size() || text.get(line_start + b) == buffer_char{'\n'}) {
+            return b;
+        }
+        (void)compute_char_rendering(text.get(line_start + b), &line_col);
+        if (line_col > column) {
+            return b;
+        }
+    }
+}
+
+void render_cache::line::note_edit(size_t byte) {
+    if (length.has_value() && byte > *length) {
+        // The edit is past our newline.
+        return;
+    }
+    if (byte < first_byte) {
+        first_byte = 0;
+        first_column = 0;
+        cells.clear();
+        columns.assign(1, 0);
+    } else if (byte < end_byte()) {
+        columns.resize(byte - first_byte + 1);
+        cells.resize(columns.back());
+    }
+    complete = false;
+    ends_with_newline = false;
+    checkpoints.resize(std::min(checkpoints.size(), byte / CHECKPOINT_BYTES + 1));
+    length = std::nullopt;
+}
+
+void render_cache::line::reset() {
+    first_byte = 0;
+    first_column = 0;
+    cells.clear();
+    columns.assign(1, 0);
+    complete = false;
+    ends_with_newline = false;
+    checkpoints.assign(1, 0);
+    length = std::nullopt;
+    width = 0;
+}
+
+void render_cache::line::drop_rendering() {
+    first_byte = 0;
+    first_column = 0;
+    cells = std::vector<terminal_char>();
+    columns = std::vector<uint32_t>{0};
+    complete = false;
+    ends_with_newline = false;
+}
+
+render_cache::line *render_cache::lookup(size_t line_start) {
+    size_t start;
+    size_t slot = starts_.last_at_or_before(line_start, &start);
+    if (slot == mark_tree::NONE || start != line_start) {
+        if (lines_.size() - free_slots_.size() == MAX_CACHED_LINES) {
+            clear();
+        }
+        if (free_slots_.empty()) {
+            slot = lines_.size();
+            lines_.emplace_back();
+            in_use_.push_back(true);
+        } else {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+            lines_[slot].reset();
+            in_use_[slot] = true;
+        }
+        starts_.add(slot, line_start);
+    }
+    lines_[slot].redraw = redraw_;
+    return &lines_[slot];
+}
+
+render_cache::line *render_cache::find(size_t line_start) {
+    size_t start;
+    const size_t slot = starts_.last_at_or_before(line_start, &start);
+    return slot != mark_tree::NONE && start == line_start ? &lines_[slot] : nullptr;
+}
+
+size_t render_cache::column_at(const text_storage& text, size_t line_start, size_t byte) {
+    if (line *found = find(line_start)) {
+        return found->column_at(text, line_start, byte);
+    }
+    if (byte >= CHECKPOINT_BYTES) {
+        return lookup(line_start)->column_at(text, line_start, byte);
+    }
+    size_t line_col = 0;
+    text.for_each_span(line_start, line_start + byte, [&](std::span<const buffer_char> span) {
+        line_col = column_after(span.data(), span.size(), line_col);
+    });
+    return line_col;
+}
+
+bool render_cache::measure(const text_storage& text, size_t line_start, size_t *length_out, size_t *width_out) {
+    if (line *found = find(line_start); found && found->length.has_value()) {
+        *length_out = *found->length;
+        *width_out = found->width;
+        return true;
+    }
+    const size_t end = std::min(text.size(), line_start + CHECKPOINT_BYTES);
+    size_t length = 0;
+    size_t line_col = 0;
+    bool found_newline = false;
+    text.for_each_span(line_start, end, [&](std::span<const buffer_char> span) {
+        if (found_newline) {
+            return;
+        }
+        const size_t count = find_first(span.data(), span.size(), buffer_char{'\n'});
+        line_col = column_after(span.data(), count, line_col);
+        length += count;
+        found_newline = count < span.size();
+    });
+    if (!found_newline && end != text.size()) {
+        return false;
+    }
+    *length_out = length;
+    *width_out = line_col;
+    return true;
+}
+
+void render_cache::note_insert(size_t pos, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    // The line containing pos changed.  (It's the last one starting at or before pos -- if
+    // that one is cached and reaches pos.)
+    size_t start;
+    const size_t slot = starts_.last_at_or_before(pos, &start);
+    if (slot != mark_tree::NONE) {
+        lines_[slot].note_edit(pos - start);
+    }
+    starts_.shift_from(pos + 1, count);
+}
+
+void render_cache::note_erase(size_t pos, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    // The line containing pos changed, and lines starting in the erased text (or right
+    // after it) got merged into it.
+    size_t start;
+    const size_t slot = starts_.last_at_or_before(pos, &start);
+    if (slot != mark_tree::NONE) {
+        lines_[slot].note_edit(pos - start);
+    }
+    std::vector<size_t> merged;
+    starts_.collapse_range(pos + 1, pos + count + 1, pos + 1, count,
+                           [&](size_t merged_slot, size_t) { merged.push_back(merged_slot); });
+    for (size_t merged_slot : merged) {
+        evict(merged_slot);
+    }
+}
+
+void render_cache::end_redraw() {
+    size_t bytes = 0;
+    for (const line& elem : lines_) {
+        bytes += memory_size(elem);
+    }
+    if (bytes > MAX_CACHED_BYTES) {
+        for (size_t slot = 0; slot < lines_.size(); ++slot) {
+            line& elem = lines_[slot];
+            if (!in_use_[slot] || elem.redraw != redraw_) {
+                elem.drop_rendering();
+                // Lines without checkpoints past the first have nothing worth keeping.
+                if (in_use_[slot] && elem.checkpoints.size() == 1) {
+                    evict(slot);
+                }
+            }
+        }
+    }
+    ++redraw_;
+}
+
+void render_cache::evict(size_t slot) {
+    starts_.remove(slot);
+    in_use_[slot] = false;
+    free_slots_.push_back(slot);
+}
+
+void render_cache::clear() {
+    // The lines' memory gets reused.
+    starts_ = mark_tree();
+    free_slots_.clear();
+    for (size_t slot = 0; slot < lines_.size(); ++slot) {
+        in_use_[slot] = false;
+        free_slots_.push_back(slot);
+    }
+}
+
+}  // namespace qwi
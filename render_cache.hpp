@@ -0,0 +1,146 @@
+#ifndef QWERTILLION_RENDER_CACHE_HPP_
+#define QWERTILLION_RENDER_CACHE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "mark_tree.hpp"
+#include "terminal_char.hpp"
+#include "text_storage.hpp"
+
+namespace qwi {
+
+// A buffer's lines as render_into_frame draws them, kept between redraws, so that a redraw
+// only renders lines that were edited or scrolled into view.  Lines are rendered without
+// wrapping (which just slices them into rows), so windows of any width share them.  The
+// tab width is fixed, so it needn't be part of the key.
+//
+// Lines also keep the columns of every CHECKPOINT_BYTES'th byte, once something needs
+// them, so that finding the column of a byte far into a long line (or the byte at a column)
+// takes a binary search and a short scan, instead of a scan from the line's beginning.
+// That's what scrolling by visual rows uses.
+//
+// Like line_index, the cache doesn't hold the text.  The buffer calls note_insert and
+// note_erase after every edit, which cut the edited lines short at the edit, and move the
+// lines after them.  Line starts are kept in a mark_tree, so that costs O(log n) for n
+// cached lines, as do lookups.
+//
+// A rendering costs five bytes per rendered byte.  Lines only get rendered as far as a
+// window shows them (see first_visible_row), and once the cache is over MAX_CACHED_BYTES,
+// each redraw throws away the renderings no window showed.  Checkpoints, at a byte per
+// 128 bytes of text, get kept.
+class render_cache {
+public:
+    struct line {
+        // The byte of the line the rendering starts at, and its column.  Zero, except
+        // that we don't keep the beginning of a very long line rendered when only its
+        // middle is visible.
+        size_t first_byte = 0;
+        size_t first_column = 0;
+        // The cells of columns first_column onward.
+        std::vector<terminal_char> cells;
+        // The column of each rendered byte, then the column after them, less first_column.
+        // (Renderings span a window or so, far fewer than 2^32 columns.)
+        std::vector<uint32_t> columns{0};
+        // Whether we reached the end of the line -- a newline (not rendered, but at column
+        // end_column()) or the end of the text.
+        bool complete = false;
+        bool ends_with_newline = false;
+
+        // checkpoints[j] is the column of byte j * CHECKPOINT_BYTES, as far as we've
+        // scanned the line.
+        std::vector<size_t> checkpoints{0};
+        // Once a scan or the rendering reaches the end of the line:  its length in bytes,
+        // and its width (the column of its end).
+        std::optional<size_t> length;
+        size_t width = 0;
+        // The redraw that last looked the line up.
+        size_t redraw = 0;
+
+        // The byte after the rendered bytes.
+        size_t end_byte() const { return first_byte + columns.size() - 1; }
+        size_t end_column() const { return first_column + columns.back(); }
+        // For first_byte <= byte <= end_byte().
+        size_t column(size_t byte) const { return first_column + columns[byte - first_byte]; }
+
+        // Renders more of the line, starting at line_start in text, until byte min_bytes and
+        // column min_columns are reached (or the end of the line).
+        void render(const text_storage& text, size_t line_start, size_t min_bytes, size_t min_columns);
+        // Throws away the rendering, to render from `byte` instead.
+        void restart(const text_storage& text, size_t line_start, size_t byte);
+
+        // The column of `byte`, for byte <= the line's length.
+        size_t column_at(const text_storage& text, size_t line_start, size_t byte);
+        // The line's width.
+        size_t line_width(const text_storage& text, size_t line_start);
+        // The first byte whose rendering ends past `column`, or the line's length if there
+        // is none.
+        size_t byte_ending_after(const text_storage& text, size_t line_start, size_t column);
+
+        // Call after the line's text changed from `byte` on -- if the line reaches byte.
+        void note_edit(size_t byte);
+        // Frees the rendering, keeping what we know about the line's columns.
+        void drop_rendering();
+        // Makes this an unrendered line, to reuse its memory.
+        void reset();
+
+    private:
+        // Renders [chs, chs + count), the line's next bytes, which have no newline.
+        void append(const buffer_char *chs, size_t count);
+        bool fully_scanned() const {
+            return length.has_value() && checkpoints.size() * CHECKPOINT_BYTES > *length;
+        }
+        // Extends checkpoints to cover `byte`, or the whole line.
+        void scan(const text_storage& text, size_t line_start, size_t byte);
+    };
+
+    static constexpr size_t CHECKPOINT_BYTES = 1024;
+    // Past this much memory, end_redraw throws away the renderings that no window showed.
+    static constexpr size_t MAX_CACHED_BYTES = 1 << 20;
+
+    // The cached line starting at line_start, or a new, unrendered one.  The pointer is
+    // good until the next call.
+    line *lookup(size_t line_start);
+
+    // Queries for walking over lines, which don't add lines shorter than CHECKPOINT_BYTES
+    // to the cache -- the text answers them about as fast.  Longer lines get looked up.
+    //
+    // The column of `byte` in the line at line_start.
+    size_t column_at(const text_storage& text, size_t line_start, size_t byte);
+    // Sets the length and width of the line at line_start, and returns true, if the line
+    // is cached with those known, or is shorter than CHECKPOINT_BYTES.
+    bool measure(const text_storage& text, size_t line_start, size_t *length_out, size_t *width_out);
+
+    // Call after [pos, pos + count) got inserted into the text.
+    void note_insert(size_t pos, size_t count);
+    // Call after [pos, pos + count) got erased from the text.
+    void note_erase(size_t pos, size_t count);
+
+    // Call after drawing every window.  If the cache is over MAX_CACHED_BYTES, throws away
+    // the renderings of lines not looked up since the last call.
+    void end_redraw();
+
+private:
+    // The cached line starting at line_start, or null.
+    line *find(size_t line_start);
+    void evict(size_t slot);
+    void clear();
+
+    // The starts of the cached lines, whose slots index lines_.
+    mark_tree starts_;
+    std::vector<line> lines_;
+    std::vector<bool> in_use_;
+    // The other slots of lines_.  Their memory gets reused, and counts against
+    // MAX_CACHED_BYTES.
+    std::vector<size_t> free_slots_;
+    // Counts end_redraw calls.
+    size_t redraw_ = 0;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_RENDER_CACHE_HPP_
@@ -0,0 +1,431 @@
+#include "rope.hpp"
+
+#include <string.h>
+
+#include <atomic>
+#include <iterator>
+#include <utility>
+
+#include "arith.hpp"
+#include "parallel.hpp"
+
+namespace qwi {
+
+// Leaves hold at most MAX_LEAF_SIZE chars, and internal nodes at most MAX_CHILDREN
+// children.  Non-root nodes below the MIN_ values get merged with a neighbor on erase.
+constexpr size_t MAX_LEAF_SIZE = 4096;
+constexpr size_t MIN_LEAF_SIZE = MAX_LEAF_SIZE / 4;
+constexpr size_t MAX_CHILDREN = 16;
+constexpr size_t MIN_CHILDREN = MAX_CHILDREN / 4;
+// Building leaves gets parallelized, with at least this many leaves per thread.
+constexpr size_t PARALLEL_LEAVES = 256;
+
+rope::rope() : root_(std::make_shared<node>()) { }
+
+rope::rope(buffer_string&& str) : rope(std::span<const buffer_char>{str.data(), str.size()}) {
+    str.clear();
+    str.shrink_to_fit();
+}
+
+rope::rope(std::span<const buffer_char> text) {
+    // Build the leaves directly, instead of inserting into one leaf and splitting it.
+    // For big texts, we build them on multiple threads.
+    const size_t total = text.size();
+    const size_t pieces = ceil_divide(total, MAX_LEAF_SIZE);
+    node_vec level(pieces);
+    parallel_for(pieces, PARALLEL_LEAVES, [&](size_t p) {
+        const size_t beg = total * p / pieces;
+        const size_t end = total * (p + 1) / pieces;
+        auto leaf = std::make_shared<node>();
+        leaf->text.assign(text.data() + beg, end - beg);
+        recompute(leaf.get());
+        level[p] = std::move(leaf);
+    });
+    while (level.size() > 1) {
+        level = group_into_parents(std::move(level));
+    }
+    root_ = level.empty() ? std::make_shared<node>() : std::move(level.front());
+}
+
+rope& rope::operator=(const rope& other) {
+    root_ = other.root_;
+    invalidate_cache();
+    return *this;
+}
+
+rope::rope(rope&& other) noexcept
+    : root_(std::move(other.root_)) {
+    other.root_ = std::make_shared<node>();
+    other.invalidate_cache();
+}
+
+rope& rope::operator=(rope&& other) noexcept {
+    root_ = std::move(other.root_);
+    other.root_ = std::make_shared<node>();
+    invalidate_cache();
+    other.invalidate_cache();
+    return *this;
+}
+
+rope::~rope() = default;
+
+buffer_char rope::get(size_t i) const {
+    if (cache_leaf_ != nullptr && i >= cache_offset_ && i - cache_offset_ < cache_leaf_->size) {
+        return cache_leaf_->text[i - cache_offset_];
+    }
+    logic_check(i < size(), "rope::get out of range: i=%zu, size=%zu", i, size());
+    find_leaf(i);
+    return cache_leaf_->text[i - cache_offset_];
+}
+
+void rope::find_leaf(size_t i) const {
+    const node *n = root_.get();
+    size_t off = 0;
+    while (!n->leaf) {
+        for (const node_ptr& child : n->children) {
+            if (i - off < child->size) {
+                n = child.get();
+                break;
+            }
+            off += child->size;
+        }
+    }
+    cache_leaf_ = n;
+    cache_offset_ = off;
+}
+
+std::span<const buffer_char> rope::chunk_at(size_t i, size_t *beg_out) const {
+    logic_check(i < size(), "rope::chunk_at out of range: i=%zu, size=%zu", i, size());
+    if (cache_leaf_ == nullptr || i < cache_offset_ || i - cache_offset_ >= cache_leaf_->size) {
+        find_leaf(i);
+    }
+    *beg_out = cache_offset_;
+    return {cache_leaf_->text.data(), cache_leaf_->text.size()};
+}
+
+region_stats rope::stats_at(size_t pos) const {
+    logic_check(pos <= size(), "rope::stats_at out of range");
+    region_stats ret{};
+    const node *n = root_.get();
+    while (!n->leaf) {
+        const node *next = nullptr;
+        for (const node_ptr& child : n->children) {
+            if (pos < child->size) {
+                next = child.get();
+                break;
+            }
+            ret = append_stats(ret, child->stats);
+            pos -= child->size;
+        }
+        if (next == nullptr) {
+            // pos was the end of n.
+            return ret;
+        }
+        n = next;
+    }
+    return append_stats(ret, compute_stats(n->text.data(), pos));
+}
+
+void rope::copy_to(size_t beg, size_t end, buffer_char *out) const {
+    for_each_span(beg, end, [&](std::span<const buffer_char> span) {
+        memcpy(out, span.data(), span.size());
+        out += span.size();
+    });
+}
+
+rope::node *rope::make_mutable(node_ptr& p) {
+    if (p.use_count() > 1) {
+        p = std::make_shared<node>(*p);
+    } else {
+        // Another thread may have just dropped its reference -- its reads of the node
+        // happened before our writes.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return p.get();
+}
+
+void rope::recompute(node *n) {
+    if (n->leaf) {
+        n->size = n->text.size();
+        n->stats = compute_stats(n->text.data(), n->text.size());
+    } else {
+        size_t size = 0;
+        region_stats stats{};
+        for (const node_ptr& child : n->children) {
+            size += child->size;
+            stats = append_stats(stats, child->stats);
+        }
+        n->size = size;
+        n->stats = stats;
+    }
+}
+
+bool rope::underfull(const node *n) {
+    return n->leaf ? n->text.size() < MIN_LEAF_SIZE : n->children.size() < MIN_CHILDREN;
+}
+
+// Splits an oversized leaf into evenly sized leaves, keeping the first piece in n and
+// returning the rest.
+rope::node_vec rope::split_leaf(node *n) {
+    const size_t total = n->text.size();
+    const size_t pieces = ceil_divide(total, MAX_LEAF_SIZE);
+    if (pieces <= 1) {
+        recompute(n);
+        return {};
+    }
+    const size_t piece_size = ceil_divide(total, pieces);
+    // Big pastes make a lot of leaves, so this is parallel like the constructor.
+    node_vec ret(ceil_divide(total - piece_size, piece_size));
+    parallel_for(ret.size(), PARALLEL_LEAVES, [&](size_t i) {
+        const size_t beg = (i + 1) * piece_size;
+        auto leaf = std::make_shared<node>();
+        leaf->text.assign(n->text, beg, std::min(piece_size, total - beg));
+        recompute(leaf.get());
+        ret[i] = std::move(leaf);
+    });
+    n->text.resize(piece_size);
+    n->text.shrink_to_fit();
+    recompute(n);
+    return ret;
+}
+
+// Like split_leaf, for an internal node with too many children.
+rope::node_vec rope::split_internal(node *n) {
+    node_vec ret = group_into_parents(std::move(n->children));
+    n->children = std::move(ret.front()->children);
+    recompute(n);
+    ret.erase(ret.begin());
+    return ret;
+}
+
+// Groups the nodes (of equal depth) into evenly sized parents.
+rope::node_vec rope::group_into_parents(node_vec&& level) {
+    const size_t total = level.size();
+    const size_t groups = ceil_divide(total, MAX_CHILDREN);
+    node_vec ret;
+    ret.reserve(groups);
+    size_t i = 0;
+    for (size_t g = 0; g < groups; ++g) {
+        // Spread the remainder over the first groups.
+        const size_t count = total / groups + (g < total % groups);
+        auto parent = std::make_shared<node>();
+        parent->leaf = false;
+        parent->children.reserve(count);
+        for (size_t j = 0; j < count; ++j) {
+            parent->children.push_back(std::move(level[i++]));
+        }
+        recompute(parent.get());
+        ret.push_back(std::move(parent));
+    }
+    return ret;
+}
+
+void rope::insert(size_t pos, const buffer_char *chs, size_t count) {
+    logic_check(pos <= size(), "rope::insert out of range");
+    if (count == 0) {
+        return;
+    }
+    invalidate_cache();
+    node_vec extra = insert_rec(make_mutable(root_), pos, chs, count);
+    if (!extra.empty()) {
+        node_vec level;
+        level.reserve(1 + extra.size());
+        level.push_back(std::move(root_));
+        for (node_ptr& n : extra) {
+            level.push_back(std::move(n));
+        }
+        do {
+            level = group_into_parents(std::move(level));
+        } while (level.size() > 1);
+        root_ = std::move(level.front());
+    }
+}
+
+// Returns new right siblings of n, if n overflowed.
+rope::node_vec rope::insert_rec(node *n, size_t pos, const buffer_char *chs, size_t count) {
+    if (n->leaf) {
+        n->text.insert(pos, chs, count);
+        if (n->text.size() <= MAX_LEAF_SIZE) {
+            recompute(n);
+            return {};
+        }
+        return split_leaf(n);
+    }
+
+    size_t i = 0;
+    for (; i + 1 < n->children.size(); ++i) {
+        if (pos <= n->children[i]->size) {
+            break;
+        }
+        pos -= n->children[i]->size;
+    }
+    node_vec extra = insert_rec(make_mutable(n->children[i]), pos, chs, count);
+    n->children.insert(n->children.begin() + (i + 1),
+                       std::make_move_iterator(extra.begin()), std::make_move_iterator(extra.end()));
+    if (n->children.size() <= MAX_CHILDREN) {
+        recompute(n);
+        return {};
+    }
+    return split_internal(n);
+}
+
+size_t rope::height(const node *n) {
+    size_t h = 0;
+    for (; !n->leaf; n = n->children.front().get()) {
+        ++h;
+    }
+    return h;
+}
+
+// Adds t (of height t_height < n_height) as a descendant of n, at the end (or
+// beginning) of n's level t_height + 1.  Returns new right siblings of n, if n
+// overflowed.
+rope::node_vec rope::join_rec(node *n, size_t n_height, node_ptr&& t, size_t t_height, bool at_end) {
+    node_vec extra;
+    if (n_height == t_height + 1) {
+        extra.push_back(std::move(t));
+    } else {
+        node *child = make_mutable(at_end ? n->children.back() : n->children.front());
+        extra = join_rec(child, n_height - 1, std::move(t), t_height, at_end);
+    }
+    const size_t pos = at_end ? n->children.size() : (n_height == t_height + 1 ? 0 : 1);
+    n->children.insert(n->children.begin() + pos,
+                       std::make_move_iterator(extra.begin()), std::make_move_iterator(extra.end()));
+    if (n->children.size() <= MAX_CHILDREN) {
+        recompute(n);
+        return {};
+    }
+    return split_internal(n);
+}
+
+void rope::append(rope&& other) {
+    if (other.size() == 0) {
+        return;
+    }
+    invalidate_cache();
+    other.invalidate_cache();
+    if (size() == 0) {
+        root_ = std::exchange(other.root_, std::make_shared<node>());
+        return;
+    }
+    node_ptr right = std::exchange(other.root_, std::make_shared<node>());
+    const size_t left_height = height(root_.get());
+    const size_t right_height = height(right.get());
+    node_vec level;
+    if (left_height == right_height) {
+        level.push_back(std::move(root_));
+        level.push_back(std::move(right));
+    } else if (left_height > right_height) {
+        level.push_back(std::move(root_));
+        node_vec extra = join_rec(make_mutable(level.front()), left_height, std::move(right), right_height, true);
+        std::move(extra.begin(), extra.end(), std::back_inserter(level));
+    } else {
+        level.push_back(std::move(right));
+        node_vec extra = join_rec(make_mutable(level.front()), right_height, std::move(root_), left_height, false);
+        std::move(extra.begin(), extra.end(), std::back_inserter(level));
+    }
+    while (level.size() > 1) {
+        level = group_into_parents(std::move(level));
+    }
+    root_ = std::move(level.front());
+}
+
+void rope::erase(size_t pos, size_t count, buffer_string *deleted_out) {
+    logic_check(count <= size() && pos <= size() - count, "rope::erase out of range");
+    if (count == 0) {
+        return;
+    }
+    invalidate_cache();
+    if (deleted_out) {
+        deleted_out->reserve(deleted_out->size() + count);
+    }
+    erase_rec(make_mutable(root_), pos, count, deleted_out);
+    while (!root_->leaf && root_->children.size() <= 1) {
+        root_ = root_->children.empty() ? std::make_shared<node>() : node_ptr(root_->children.front());
+    }
+}
+
+void rope::erase_rec(node *n, size_t pos, size_t count, buffer_string *deleted_out) {
+    if (n->leaf) {
+        if (deleted_out) {
+            deleted_out->append(n->text, pos, count);
+        }
+        n->text.erase(pos, count);
+        recompute(n);
+        return;
+    }
+
+    const size_t end = pos + count;
+    size_t off = 0;
+    size_t i = 0;
+    while (i < n->children.size() && off < end) {
+        node *child = n->children[i].get();
+        const size_t child_end = off + child->size;
+        if (child_end <= pos) {
+            off = child_end;
+            ++i;
+            continue;
+        }
+        const size_t beg_in_child = std::max(pos, off) - off;
+        const size_t end_in_child = std::min(end, child_end) - off;
+        if (beg_in_child == 0 && end_in_child == child->size) {
+            if (deleted_out) {
+                auto append_span = [&](std::span<const buffer_char> span) {
+                    deleted_out->append(span.data(), span.size());
+                };
+                for_each_span_rec(child, 0, child->size, append_span);
+            }
+            n->children.erase(n->children.begin() + i);
+        } else {
+            erase_rec(make_mutable(n->children[i]), beg_in_child, end_in_child - beg_in_child, deleted_out);
+            ++i;
+        }
+        off = child_end;
+    }
+
+    for (size_t j = 0; j < n->children.size() && n->children.size() > 1; ) {
+        if (underfull(n->children[j].get())) {
+            merge_children(n, j + 1 < n->children.size() ? j : j - 1);
+        } else {
+            ++j;
+        }
+    }
+    recompute(n);
+}
+
+// Merges children i and i + 1 of n, then splits them in half if that's too big.
+void rope::merge_children(node *n, size_t i) {
+    node *left = make_mutable(n->children[i]);
+    node_ptr right = std::move(n->children[i + 1]);
+    make_mutable(right);
+    n->children.erase(n->children.begin() + (i + 1));
+
+    node_vec extra;
+    if (left->leaf) {
+        left->text.append(right->text);
+        if (left->text.size() > MAX_LEAF_SIZE) {
+            right->text.assign(left->text, left->text.size() / 2);
+            left->text.resize(left->text.size() / 2);
+            recompute(right.get());
+            extra.push_back(std::move(right));
+        }
+    } else {
+        for (node_ptr& c : right->children) {
+            left->children.push_back(std::move(c));
+        }
+        if (left->children.size() > MAX_CHILDREN) {
+            const size_t half = left->children.size() / 2;
+            right->children.assign(std::make_move_iterator(left->children.begin() + half),
+                                   std::make_move_iterator(left->children.end()));
+            left->children.resize(half);
+            recompute(right.get());
+            extra.push_back(std::move(right));
+        }
+    }
+    recompute(left);
+    if (!extra.empty()) {
+        n->children.insert(n->children.begin() + (i + 1), std::move(extra.front()));
+    }
+}
+
+}  // namespace qwi
@@ -0,0 +1,132 @@
+#ifndef QWERTILLION_ROPE_HPP_
+#define QWERTILLION_ROPE_HPP_
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "chars.hpp"
+#include "error.hpp"
+#include "region_stats.hpp"
+
+namespace qwi {
+
+// Buffer text, stored in a B-tree whose leaves hold chunks of text.  Every node caches
+// the size and region_stats of its subtree -- append_stats is associative, so a node's
+// stats are the fold of its children's stats.  Thus stats_at (used for (line, col)
+// computation) is O(log n), instead of a scan of the buffer.
+//
+// All leaves are at the same depth.  Nodes other than the root stay between a minimum
+// and maximum size, approximately -- erase merges underfull nodes with a neighbor where
+// it can.
+//
+// Nodes are reference counted and copied on write:  copying a rope is O(1), and editing
+// either copy clones the O(log n) nodes on the path to the edit.  Nodes shared by copies
+// are never modified, so a copy is a snapshot that another thread can read while this
+// thread keeps editing the original.  (get and chunk_at write the copy's cache_leaf_, so
+// two threads must not read the same copy -- each takes its own, which is O(1).)
+class rope {
+public:
+    rope();
+    explicit rope(buffer_string&& str);
+    explicit rope(std::span<const buffer_char> text);
+    rope(const rope& other) : root_(other.root_) { }
+    rope& operator=(const rope& other);
+    rope(rope&& other) noexcept;
+    rope& operator=(rope&& other) noexcept;
+    ~rope();
+
+    size_t size() const { return root_->size; }
+    // Amortized O(1) when called on successive positions (as rendering does), because we
+    // remember the last leaf we looked at.
+    buffer_char get(size_t i) const;
+
+    void insert(size_t pos, const buffer_char *chs, size_t count);
+    // Erases [pos, pos + count), appending the erased text to *deleted_out (if non-null).
+    void erase(size_t pos, size_t count, buffer_string *deleted_out);
+    // Appends other's text in O(log n), by joining the trees.
+    void append(rope&& other);
+
+    // Stats of the text in [0, pos).
+    region_stats stats_at(size_t pos) const;
+
+    void copy_to(size_t beg, size_t end, buffer_char *out) const;
+
+    // Returns the contiguous piece of text containing i (for i < size()), setting
+    // *beg_out to its offset.
+    std::span<const buffer_char> chunk_at(size_t i, size_t *beg_out) const;
+
+    // Calls fn(std::span<const buffer_char>) on the contiguous pieces of [beg, end), in
+    // order.
+    template <class Callable>
+    void for_each_span(size_t beg, size_t end, Callable&& fn) const {
+        logic_check(beg <= end && end <= size(), "rope::for_each_span out of range");
+        if (beg < end) {
+            for_each_span_rec(root_.get(), beg, end, fn);
+        }
+    }
+
+private:
+    struct node;
+    using node_ptr = std::shared_ptr<node>;
+    struct node {
+        bool leaf = true;
+        size_t size = 0;
+        region_stats stats;
+        // Only for leaves.
+        buffer_string text;
+        // Only for internal nodes.
+        std::vector<node_ptr> children;
+    };
+    using node_vec = std::vector<node_ptr>;
+
+    template <class Callable>
+    static void for_each_span_rec(const node *n, size_t beg, size_t end, Callable& fn) {
+        if (n->leaf) {
+            fn(std::span<const buffer_char>{n->text.data() + beg, end - beg});
+            return;
+        }
+        size_t off = 0;
+        for (const node_ptr& child : n->children) {
+            const size_t child_end = off + child->size;
+            if (beg < child_end) {
+                for_each_span_rec(child.get(), std::max(beg, off) - off,
+                                  std::min(end, child_end) - off, fn);
+            }
+            if (child_end >= end) {
+                break;
+            }
+            off = child_end;
+        }
+    }
+
+    // Clones *p if another rope shares it, so that it can be modified.  Returns p.get().
+    static node *make_mutable(node_ptr& p);
+    static void recompute(node *n);
+    static bool underfull(const node *n);
+    static node_vec split_leaf(node *n);
+    static node_vec split_internal(node *n);
+    static node_vec group_into_parents(node_vec&& level);
+    static node_vec insert_rec(node *n, size_t pos, const buffer_char *chs, size_t count);
+    static void erase_rec(node *n, size_t pos, size_t count, buffer_string *deleted_out);
+    static void merge_children(node *n, size_t i);
+    static size_t height(const node *n);
+    static node_vec join_rec(node *n, size_t n_height, node_ptr&& t, size_t t_height, bool at_end);
+
+    // Sets cache_leaf_ to the leaf containing i.
+    void find_leaf(size_t i) const;
+    void invalidate_cache() const { cache_leaf_ = nullptr; }
+
+    node_ptr root_;
+
+    // The leaf last visited by get() or chunk_at(), and its offset.
+    mutable const node *cache_leaf_ = nullptr;
+    mutable size_t cache_offset_ = 0;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_ROPE_HPP_
@@ -0,0 +1,83 @@
+#include "shared_text.hpp"
+
+#include "error.hpp"
+#include "io.hpp"
+
+namespace qwi {
+
+shared_text::shared_text(buffer_string&& s) {
+    if (!s.empty()) {
+        ptr_ = std::make_shared<payload>();
+        ptr_->owned.storage = std::move(s);
+    }
+}
+
+shared_text::shared_text(std::shared_ptr<const mapped_file> file, uint64_t file_tag, size_t offset, size_t count) {
+    if (count != 0) {
+        ptr_ = std::make_shared<payload>();
+        ptr_->mapped = std::span<const buffer_char>(file->data + offset, count);
+        ptr_->mapping = std::move(file);
+        ptr_->file_tag = file_tag;
+        ptr_->file_offset = offset;
+    }
+}
+
+std::span<const buffer_char> shared_text::span() const {
+    if (!ptr_) {
+        return {};
+    }
+    return ptr_->mapping ? ptr_->mapped : ptr_->owned.span();
+}
+
+void shared_text::unshare() {
+    if (!ptr_) {
+        ptr_ = std::make_shared<payload>();
+    } else if (ptr_.use_count() > 1 || ptr_->mapping) {
+        auto copy = std::make_shared<payload>();
+        copy->owned.storage.assign(span().begin(), span().end());
+        ptr_ = std::move(copy);
+    }
+    // The text is changing, so whatever is in the undo file is outdated.
+    ptr_->file_tag = 0;
+}
+
+void shared_text::prepend(const buffer_char *chs, size_t count) {
+    if (count != 0) {
+        unshare();
+        ptr_->owned.prepend(chs, count);
+    }
+}
+
+void shared_text::append(const buffer_char *chs, size_t count) {
+    if (count != 0) {
+        unshare();
+        ptr_->owned.append(chs, count);
+    }
+}
+
+size_t shared_text::memory() const {
+    if (!ptr_) {
+        return 0;
+    }
+    // Short strings live inside the string object, and mapped text is in the page cache.
+    static const size_t local_capacity = buffer_string().capacity();
+    const size_t cap = ptr_->owned.storage.capacity();
+    const size_t heap = cap > local_capacity ? (cap + 1) * sizeof(buffer_char) : 0;
+    // make_shared allocates the payload with its reference counts.
+    return sizeof(payload) + 2 * sizeof(long) + heap;
+}
+
+std::optional<uint64_t> shared_text::file_offset(uint64_t file_tag) const {
+    if (ptr_ && ptr_->file_tag != 0 && ptr_->file_tag == file_tag) {
+        return ptr_->file_offset;
+    }
+    return std::nullopt;
+}
+
+void shared_text::set_file_offset(uint64_t file_tag, uint64_t offset) {
+    logic_check(ptr_ != nullptr, "set_file_offset on empty shared_text");
+    ptr_->file_tag = file_tag;
+    ptr_->file_offset = offset;
+}
+
+}  // namespace qwi
@@ -0,0 +1,62 @@
+#ifndef QWERTILLION_SHARED_TEXT_HPP_
+#define QWERTILLION_SHARED_TEXT_HPP_
+
+#include <stdint.h>
+
+#include <memory>
+#include <optional>
+#include <span>
+
+#include "chars.hpp"
+
+struct mapped_file;
+
+namespace qwi {
+
+// Immutable text that copies share.  A deletion's text gets handed to the undo history
+// and the kill ring without being copied, and undo items share it between past, future
+// and mountains.  prepend and append copy it first if it's shared.
+class shared_text {
+public:
+    shared_text() = default;
+    shared_text(buffer_string&& s);
+    // Text at [offset, offset + count) of an undo file (see undo_file.hpp), which it keeps
+    // mapped.
+    shared_text(std::shared_ptr<const mapped_file> file, uint64_t file_tag, size_t offset, size_t count);
+
+    std::span<const buffer_char> span() const;
+    size_t size() const { return span().size(); }
+    bool empty() const { return span().empty(); }
+    const buffer_char *data() const { return span().data(); }
+
+    // Both amortized O(count), for growing the text of coalesced edits and consecutive
+    // kills.
+    void prepend(const buffer_char *chs, size_t count);
+    void append(const buffer_char *chs, size_t count);
+
+    // The heap memory behind the text, counting it in full even if it's shared.
+    size_t memory() const;
+
+    // Where the text is in the undo file with the given tag, if it's been written there.
+    std::optional<uint64_t> file_offset(uint64_t file_tag) const;
+    void set_file_offset(uint64_t file_tag, uint64_t offset);
+
+private:
+    // Makes ptr_ a payload we alone own, in memory, so that we can change its text.
+    void unshare();
+
+    struct payload {
+        front_slack_string owned;
+        // Or else the text is in a mapped undo file.
+        std::shared_ptr<const mapped_file> mapping;
+        std::span<const buffer_char> mapped;
+        // file_tag is 0 if the text isn't in an undo file.
+        uint64_t file_tag = 0;
+        uint64_t file_offset = 0;
+    };
+    std::shared_ptr<payload> ptr_;
+};
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_SHARED_TEXT_HPP_
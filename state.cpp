@@ -2,6 +2,7 @@
 
 #include "arith.hpp"
 #include "buffer.hpp"  // for insert_result and delete_result in undo logic
+#include "char_scan.hpp"
 #include "editing.hpp"
 #include "error.hpp"
 #include "term_ui.hpp"
@@ -9,61 +10,27 @@
 namespace qwi {
 
 void buffer::line_info_at_pos(size_t pos, size_t *line_out, size_t *col_out) const {
-    region_stats stats;
-    if (pos == bef_.size()) {
-        stats = bef_stats_;
-    } else if (pos < bef_.size()) {
-        // Unsure what fraction is optimal; we're just making a Statement that
-        // subtract_stats_right is more complicated.
-        if (pos < (bef_.size() / 4) * 3) {
-            stats = compute_stats(bef_.data(), pos);
-        } else {
-            stats = subtract_stats_right(bef_stats_, bef_.data(), pos, bef_.size());
-        }
-    } else {
-        logic_check(pos <= bef_.size() + aft_.size(),
-                    "line_info_at_pos: pos=%zu, bef_.size()=%zu, aft_.size()=%zu, sum=%zu",
-                    pos, bef_.size(), aft_.size(), bef_.size() + aft_.size());
-        size_t apos = pos - bef_.size();
-        if (apos < (aft_.size() / 4) * 3) {
-            stats = append_stats(bef_stats_,
-                                 compute_stats(aft_.data(), apos));
-        } else {
-            stats = append_stats(bef_stats_,
-                                 subtract_stats_right(aft_stats_, aft_.data(), apos, aft_.size()));
-        }
-    }
-
-    return stats_to_line_info(stats, line_out, col_out);
+    // The line number comes from the index.  The column comes from the render_cache, whose
+    // checkpoints keep it from costing the length of the line up to pos.  Neither depends
+    // on where the text storage's gap or last piece is.
+    const size_t line_start = lines_.line_beginning(text_, pos);
+    *line_out = lines_.line_at(text_, pos) + 1;
+    *col_out = rendered_lines_.column_at(text_, line_start, pos - line_start);
 }
 
-size_t buffer::cursor_distance_to_beginning_of_line() const {
-    return distance_to_beginning_of_line(*this, bef_.size());
+std::string buffer::copy_to_string() const {
+    std::string ret;
+    ret.resize(text_.size());
+    text_.copy_to(0, text_.size(), as_buffer_chars(ret.data()));
+    return ret;
 }
 
-void buffer::set_cursor(size_t pos) {
-    if (pos < bef_.size()) {
-        bef_stats_ = subtract_stats_right(bef_stats_, bef_.data(), pos, bef_.size());
-        aft_stats_ = append_stats(compute_stats(bef_.data() + pos, bef_.size() - pos), aft_stats_);
-        aft_.insert(aft_.begin(), bef_.begin() + pos, bef_.end());
-        bef_.resize(pos);
-    } else {
-        size_t aft_pos = pos - bef_.size();
-        logic_check(aft_pos <= aft_.size(), "set_cursor outside buf range");
-        region_stats segstats = compute_stats(aft_.data(), aft_pos);
-        bef_stats_ = append_stats(bef_stats_, segstats);
-        aft_stats_ = subtract_stats_left(aft_stats_, segstats, aft_.data() + aft_pos, aft_.size() - aft_pos);
-        bef_.append(aft_.data(), aft_pos);
-        aft_.erase(0, aft_pos);
-    }
+void buffer::unmap_text() {
+    text_ = text_storage(copy_substr(0, size()));
 }
 
-std::string buffer::copy_to_string() const {
-    std::string ret;
-    ret.reserve(bef_.size() + aft_.size());
-    ret.append(as_chars(bef_.data()), bef_.size());
-    ret.append(as_chars(aft_.data()), aft_.size());
-    return ret;
+text_snapshot buffer::snapshot() const {
+    return { .text = text_, .stats = text_.stats_at(text_.size()) };
 }
 
 buffer_string buffer::copy_substr(size_t beg, size_t end) const {
@@ -71,21 +38,14 @@ buffer_string buffer::copy_substr(size_t beg, size_t end) const {
                 beg, end, size());
     buffer_string ret;
     ret.reserve(end - beg);
-    if (end <= bef_.size()) {
-        ret = bef_.substr(beg, end - beg);
-    } else if (beg < bef_.size()) {
-        ret = bef_.substr(beg, bef_.size() - beg) + aft_.substr(0, end - bef_.size());
-    } else {
-        ret = aft_.substr(beg - bef_.size(), end - beg);
-    }
+    text_.for_each_span(beg, end, [&](std::span<const buffer_char> span) {
+        ret.append(span.data(), span.size());
+    });
     return ret;
 }
 
 buffer buffer::from_data(buffer_id id, buffer_string&& data) {
-    buffer ret(id);
-    ret.bef_stats_ = compute_stats(data);
-    ret.bef_ = std::move(data);
-    return ret;
+    return buffer(id, std::move(data));
 }
 
 // TODO: With C++ exceptions lurking, this actually does need to be in some destructor.
@@ -109,9 +69,9 @@ ui_window_ctx *ui_window::point_at(buffer_id id, state *st) {
     if (active_tab.value == SIZE_MAX) {
         active_tab.value = 0;
     }
-    // TODO: XXX: point_at should take an optional param from another ui_window_ctx from which it borrows first_visible_offset and cursor.  In fact this is just broken because it sets the cursor but first_visible_offset is zero..
+    // TODO: point_at should take an optional param from another ui_window_ctx from which it borrows first_visible_offset and cursor.
     window_ctxs.emplace(window_ctxs.begin() + active_tab.value,
-                        buf->id, std::make_unique<ui_window_ctx>(buf->add_mark(0), buf->add_mark(buf->cursor_())));
+                        buf->id, std::make_unique<ui_window_ctx>(buf->add_mark(0), buf->add_mark(0)));
     return window_ctxs[active_tab.value].second.get();
 }
 
@@ -174,8 +134,13 @@ buffer_string buffer_name(const state *state, buffer_id buf_number) {
 
 size_t distance_to_eol(const buffer& buf, size_t pos) {
     size_t p = pos;
-    for (size_t e = buf.size(); p < e; ++p) {
-        if (buf.get(p) == buffer_char{'\n'}) {
+    for (size_t e = buf.size(); p < e; ) {
+        size_t chunk_beg;
+        std::span<const buffer_char> chunk = buf.text().chunk_at(p, &chunk_beg);
+        size_t off = p - chunk_beg;
+        size_t i = find_first(chunk.data() + off, chunk.size() - off, buffer_char{'\n'});
+        p += i;
+        if (i < chunk.size() - off) {
             break;
         }
     }
@@ -184,16 +149,7 @@ size_t distance_to_eol(const buffer& buf, size_t pos) {
 
 size_t distance_to_beginning_of_line(const buffer& buf, size_t pos) {
     logic_check(pos <= buf.size(), "distance_to_beginning_of_line with out of range pos");
-    size_t p = pos;
-    for (;;) {
-        if (p == 0) {
-            return pos;
-        }
-        --p;
-        if (buf.get(p) == buffer_char{'\n'}) {
-            return pos - (p + 1);
-        }
-    }
+    return pos - buf.line_beginning(pos);
 }
 
 window_size main_buf_window_from_terminal_window(const terminal_size& term_window) {
@@ -203,23 +159,23 @@ window_size main_buf_window_from_terminal_window(const terminal_size& term_windo
     };
 }
 
-void record_yank(clip_board *clb, const buffer_string& deletedText, yank_side side) {
-    if (clb->justRecorded) {
+void record_yank(clip_board *clb, const shared_text& deletedText, yank_side side) {
+    if (clb->justRecorded && side != yank_side::none) {
         runtime_check(!clb->clips.empty(), "justRecorded true, clips empty");
-        switch (side) {
-        case yank_side::left:
-            clb->clips.back() = deletedText + clb->clips.back();
-            break;
-        case yank_side::right:
-            clb->clips.back() += deletedText;
-            break;
-        case yank_side::none:
-            clb->clips.push_back(deletedText);
-            break;
+        if (side == yank_side::left) {
+            clb->clips.back().prepend(deletedText.data(), deletedText.size());
+        } else {
+            clb->clips.back().append(deletedText.data(), deletedText.size());
         }
     } else {
         clb->clips.push_back(deletedText);
     }
+    clb->bytes += deletedText.size();
+    while (clb->clips.size() > 1
+           && (clb->clips.size() > clb->limits.max_clips || clb->bytes > clb->limits.max_bytes)) {
+        clb->bytes -= clb->clips.front().size();
+        clb->clips.pop_front();
+    }
     switch (side) {
     case yank_side::left:
         clb->justRecorded = true;
@@ -235,16 +191,17 @@ void record_yank(clip_board *clb, const buffer_string& deletedText, yank_side si
     clb->justYanked = std::nullopt;
 }
 
-std::optional<const buffer_string *> do_yank(clip_board *clb) {
+std::optional<shared_text> do_yank(clip_board *clb) {
     clb->justRecorded = false;
     if (clb->clips.empty()) {
         clb->justYanked = 0;
         return std::nullopt;
     }
     size_t sz = clb->clips.size();
-    buffer_string *str = &clb->clips.at(sz - 1 - clb->pasteNumber % sz);
-    clb->justYanked = str->size();
-    return std::make_optional(str);
+    // The yank (and its undo item) shares the clip's text.
+    const shared_text& text = clb->clips.at(sz - 1 - clb->pasteNumber % sz);
+    clb->justYanked = text.size();
+    return std::make_optional(text);
 }
 
 void no_yank(clip_board *clb) {
@@ -273,16 +230,16 @@ buffer_id find_or_create_buf(state *state, const std::string& name, bool make_re
 
 mark_id buffer::add_mark(size_t offset) {
     uint64_t new_version = ++prev_mark_version;
-    for (size_t i = 0; i < marks.size(); ++i) {
-        if (marks[i].version == mark_data::unused) {
-            marks[i].version = new_version;
-            marks[i].offset = offset;
-            return mark_id{.index = i, .assertion_version = new_version};
-        }
+    size_t index = first_free_mark;
+    if (index != SIZE_MAX) {
+        first_free_mark = marks[index].next_free;
+        marks[index] = {.version = new_version};
+    } else {
+        index = marks.size();
+        marks.push_back({.version = new_version});
     }
-    mark_id ret = {.index = marks.size(), .assertion_version = new_version};
-    marks.push_back({.version = new_version, .offset = offset});
-    return ret;
+    mark_offsets.add(index, offset);
+    return mark_id{.index = index, .assertion_version = new_version};
 }
 
 size_t buffer::get_mark_offset(mark_id id) const {
@@ -290,7 +247,7 @@ size_t buffer::get_mark_offset(mark_id id) const {
     const mark_data& elem = marks[id.index];
     logic_check(elem.version != mark_data::unused, "get_mark_offset");
     logic_check(id.assertion_version == elem.version, "get_mark_offset");
-    return elem.offset;
+    return mark_offsets.offset(id.index);
 }
 
 void buffer::remove_mark(mark_id id) {
@@ -299,15 +256,18 @@ void buffer::remove_mark(mark_id id) {
     logic_check(elem.version != mark_data::unused, "remove_mark");
     logic_check(id.assertion_version == elem.version, "remove_mark");
     elem.version = mark_data::unused;
-    elem.offset = 0;
+    elem.next_free = first_free_mark;
+    first_free_mark = id.index;
+    ++marks_removed_since_sweep;
+    mark_offsets.remove(id.index);
 }
 
 void buffer::replace_mark(mark_id id, size_t new_offset) {
     logic_check(id.index < marks.size(), "replace_mark");
-    mark_data& elem = marks[id.index];
+    const mark_data& elem = marks[id.index];
     logic_check(elem.version != mark_data::unused, "replace_mark");
     logic_check(id.assertion_version == elem.version, "replace_mark");
-    elem.offset = new_offset;
+    mark_offsets.set_offset(id.index, new_offset);
 }
 
 weak_mark_id buffer::make_weak_mark_ref(mark_id id) const {
@@ -320,13 +280,18 @@ weak_mark_id buffer::make_weak_mark_ref(mark_id id) const {
     };
 }
 
+void buffer::sweep_dead_mark_refs() {
+    prune_dead_mark_adjustments(&undo_info, *this);
+    marks_removed_since_sweep = 0;
+}
+
 std::optional<size_t> buffer::try_get_mark_offset(weak_mark_id id) const {
     logic_check(id.index < marks.size(), "try_get_mark_offset");
     const mark_data& elem = marks[id.index];
     if (elem.version != id.version) {
         return std::nullopt;
     }
-    return std::make_optional(elem.offset);
+    return std::make_optional(mark_offsets.offset(id.index));
 }
 
 
@@ -3,6 +3,7 @@
 
 #include <inttypes.h>
 
+#include <deque>
 #include <functional>
 #include <memory>
 #include <optional>
@@ -11,8 +12,14 @@
 #include <vector>
 
 #include "error.hpp"
+#include "file_loader.hpp"
+#include "journal.hpp"
+#include "text_storage.hpp"
 #include "keyboard.hpp"
+#include "line_index.hpp"
+#include "mark_tree.hpp"
 #include "region_stats.hpp"
+#include "render_cache.hpp"
 #include "state_types.hpp"
 #include "undo.hpp"
 // TODO: We don't want this dependency exactly -- we kind of want ui info to be separate from state.
@@ -36,13 +43,6 @@ struct tab_number {
     size_t value;
 };
 
-struct buffer_id {
-    uint64_t value;
-    // Zero is an invalid buffer_id -- they start at 1.
-    bool empty() const { return value == 0; }
-    friend auto operator<=>(buffer_id x, buffer_id y) = default;
-};
-
 }  // namespace qwi
 
 template<>
@@ -104,6 +104,12 @@ struct ui_window_ctx {
 
 void detach_ui_window_ctx(buffer *buf, ui_window_ctx *ui);
 
+struct text_snapshot {
+    text_storage text;
+    // Stats of the whole text.
+    region_stats stats;
+};
+
 void ensure_virtual_column_initialized(ui_window_ctx *ui, const buffer *buf);
 
 struct buffer {
@@ -111,8 +117,13 @@ struct buffer {
     explicit buffer(buffer_id _id) : id(_id), undo_info(), non_modified_undo_node(undo_info.current_node) { }
     explicit buffer(buffer_id _id, buffer_string&& str)
         : id(_id),
-          bef_(std::move(str)),
-          bef_stats_(compute_stats(bef_ /* careful about initialization order */)),
+          text_(std::move(str)),
+          lines_(text_),
+          undo_info(), non_modified_undo_node(undo_info.current_node) { }
+    explicit buffer(buffer_id _id, text_storage&& text)
+        : id(_id),
+          text_(std::move(text)),
+          lines_(text_),
           undo_info(), non_modified_undo_node(undo_info.current_node) { }
 
     buffer_id id;
@@ -124,6 +135,8 @@ struct buffer {
     uint64_t name_number = 0;  // TODO: Maybe can be size_t.
 
     std::optional<std::string> married_file;
+    // Unsaved edits of the married file (see journal.hpp).
+    edit_journal journal;
 
 private:
     struct mark_data {
@@ -133,15 +146,20 @@ private:
         // Zero value means the mark is unused.
         static constexpr uint64_t unused = 0;
         uint64_t version;
-        // offset into the buffer.
-        size_t offset;
+        // For unused marks, the next unused mark in the free list, or SIZE_MAX.
+        size_t next_free = SIZE_MAX;
     };
 
     uint64_t prev_mark_version = 0;
 
-    // SIZE_MAX is the value for invalid, removed, reusable marks.
-    // The values of these range within `0 <= marks[_] <= size()`.
+    // Indexed by mark_id::index.  Unused entries are reusable, linked together starting
+    // at first_free_mark.
     std::vector<mark_data> marks;
+    size_t first_free_mark = SIZE_MAX;
+    // Marks removed since the last sweep_dead_mark_refs.
+    size_t marks_removed_since_sweep = 0;
+    // The marks' offsets, which range within `0 <= offset <= size()`.
+    mark_tree mark_offsets;
 
     friend void add_to_marks_as_of(buffer *buf, size_t first_offset, size_t count);
     friend void update_marks_for_delete_left_range(buffer *buf, size_t range_beg, size_t range_end,
@@ -157,6 +175,14 @@ public:
 
     weak_mark_id make_weak_mark_ref(mark_id id) const;
     std::optional<size_t> try_get_mark_offset(weak_mark_id id) const;
+    bool is_live_mark(weak_mark_id id) const {
+        return id.index < marks.size() && marks[id.index].version == id.version;
+    }
+
+    // Undo history holds weak mark refs.  Once their marks are removed, they're dead
+    // weight, which we sweep away when idle.
+    bool has_dead_mark_refs() const { return marks_removed_since_sweep != 0; }
+    void sweep_dead_mark_refs();
 
     // Same as remove_mark and add_mark.
     void replace_mark(mark_id, size_t offset);
@@ -164,57 +190,63 @@ public:
     // Buffer content is private to ensure that everything respects read-only.
 private:
 
-    // We just have strings for text before/after the cursor.  Very bad perf.
-    buffer_string bef_;
-    region_stats bef_stats_;
-
-    buffer_string aft_;
-    region_stats aft_stats_;
+    text_storage text_;
+    // Updated alongside text_ by the mutation functions below.
+    line_index lines_;
+    // Likewise, and filled in by render_into_frame.
+    mutable render_cache rendered_lines_;
 
     // True friends, necessary mutation functions.
-    friend insert_result insert_chars(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, const buffer_char *chs, size_t count, bool keep_marks_left);
-    friend insert_result insert_chars_right(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, const buffer_char *chs, size_t count);
+    friend insert_result insert_chars(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, shared_text text, bool keep_marks_left);
+    friend insert_result insert_chars_right(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, shared_text text);
     friend delete_result delete_left(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, size_t og_count);
     friend delete_result delete_right(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, size_t og_count);
 
     // Half friends -- a function I don't want to exist.
     friend void force_insert_chars_end_before_cursor(
         buffer *buf, const buffer_char *chs, size_t count);
+    friend void append_loaded_text(buffer *buf, text_storage&& chunk, line_index&& chunk_lines);
 
-    // False friends, that access bef and aft, but we'd like them to use the buf more abstractly.
-    friend void move_right_by(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, size_t count);
-    friend void move_left_by(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf, size_t count);
-    friend ui_result save_buf_to_married_file_and_mark_unmodified(buffer *buf);
-    friend ui_result open_file_into_detached_buffer(state *state, const std::string& dirty_path, buffer *out);
-
-    static void stats_to_line_info(const region_stats& stats, size_t *line_out, size_t *col_out) {
-        *line_out = stats.newline_count + 1;
-        *col_out = stats.last_line_size;
-    }
 public:
     void line_info_at_pos(size_t pos, size_t *line_out, size_t *col_out) const;
 
+    // The offset of the beginning of the line containing pos.
+    size_t line_beginning(size_t pos) const { return lines_.line_beginning(text_, pos); }
+    // The offset of the beginning of line number `line` (counting from 1, like
+    // line_info_at_pos), or size() if there are fewer lines.  For going to a line.
+    size_t line_start(size_t line) const {
+        return line == 0 ? 0 : lines_.line_start(text_, line - 1);
+    }
+    size_t line_count() const { return lines_.newline_count() + 1; }
+
+    // The lines as rendered for the terminal.  A cache, so it's mutable through a const
+    // buffer.
+    render_cache& rendered_lines() const { return rendered_lines_; }
+
     // Absolute position of the mark, if there is one.
     std::optional<mark_id> mark;
 
     bool read_only = false;
 
-    // TODO: Remove these as public functions.
-    size_t cursor() const { return bef_.size(); }
-    void set_cursor(size_t pos);
-
-    size_t cursor_() const { return cursor(); }
-    void set_cursor_(size_t pos) { set_cursor(pos); }
+    // A file_loader is still appending to the buffer (which is read-only meanwhile).
+    bool loading = false;
 
 public:
-    size_t size() const { return bef_.size() + aft_.size(); }
+    size_t size() const { return text_.size(); }
     buffer_char at(size_t i) const {
-        return i < bef_.size() ? bef_[i] : aft_.at(i - bef_.size());
+        logic_check(i < text_.size(), "buffer::at out of range: i=%zu, size=%zu", i, text_.size());
+        return text_.get(i);
     }
     buffer_char get(size_t i) const {
-        return i < bef_.size() ? bef_[i] : aft_[i - bef_.size()];
+        return text_.get(i);
     }
 
+    // Read-only access to the text, e.g. for writing it to a file.
+    const text_storage& text() const { return text_; }
+    // Makes the text storage hold its own copy of the text, instead of referring to a
+    // mapped file (see piece_table) -- before that file gets overwritten.
+    void unmap_text();
+
     /* Undo info -- tracked per-buffer, apparently.  In principle, undo history could be a
        global ordered bag of past actions (including undo actions) but instead it's per
        buffer. */
@@ -224,11 +256,13 @@ public:
 
     bool modified_flag() const { return non_modified_undo_node != undo_info.current_node; }
 
-    // Returns distance_to_beginning_of_line(*this, this->cursor()).
-    size_t cursor_distance_to_beginning_of_line() const;
-
     std::string copy_to_string() const;
 
+    // An immutable copy of the text, which another thread can read while this buffer keeps
+    // getting edited.  O(1) with the rope, which shares nodes between versions.  Reads
+    // update the copy's lookup cache, so each reader thread needs its own copy.
+    text_snapshot snapshot() const;
+
     buffer_string copy_substr(size_t beg, size_t end) const;
 
     static buffer from_data(buffer_id id, buffer_string&& data);
@@ -237,16 +271,10 @@ public:
 inline size_t get_ctx_cursor(const ui_window_ctx *ui, const buffer *buf) {
     return buf->get_mark_offset(ui->cursor_mark);
 }
-inline void set_ctx_cursor(ui_window_ctx *ui, buffer *buf) {
-    buf->replace_mark(ui->cursor_mark, buf->cursor_());
+inline void set_ctx_cursor(ui_window_ctx *ui, buffer *buf, size_t pos) {
+    buf->replace_mark(ui->cursor_mark, pos);
 }
 
-// Loads and sets cursor_mark.  It's ugly.  We'll soon remove buf->cursor() (as an
-// externally exposed concept) altogether.  TODO: Remove these (replacing some callers with set_ctx_cursor).
-// TODO: These should be defined in state.cpp, not wherever they are.
-void load_ctx_cursor(ui_window_ctx *ui, buffer *buf);
-void save_ctx_cursor(ui_window_ctx *ui, buffer *buf);
-
 // Generated and returned to indicate that the code exhaustively handles undo and killring behavior.
 struct [[nodiscard]] undo_killring_handled { };
 
@@ -272,10 +300,21 @@ struct popup {
     ui_window_ctx win_ctx{buf.add_mark(0), buf.add_mark(0)};
 };
 
+// The kill ring keeps at most this many clips and bytes -- except that it always keeps
+// the newest clip.
+struct kill_ring_limits {
+    size_t max_clips = 120;
+    size_t max_bytes = size_t(256) << 20;
+};
+
 struct clip_board {
-    // TODO: There are no limits on kill ring size.
-    // A list of strings stored in the clipboard.
-    std::vector<buffer_string> clips;
+    // The strings stored in the clipboard, oldest first.  A kill's clip shares the text
+    // with its undo item.  Consecutive kills extend the clip in amortized O(killed bytes).
+    std::deque<shared_text> clips;
+    // The total size of clips.
+    size_t bytes = 0;
+    // Enforced by record_yank, which evicts the oldest clips.
+    kill_ring_limits limits;
     // Did we just record some text?  Future text recordings will be appended to the
     // previous.  For example, if we typed C-k C-k C-k, we'd want those contiguous
     // cuttings to be concatenated into one.
@@ -460,6 +499,23 @@ public:
 
     clip_board clipboard;
 
+    // Enforced by enforce_undo_budget.
+    undo_budget undo_limits;
+
+    // Created when first needed (see flush_journals).
+    std::unique_ptr<journal_writer> journal_writer_;
+    journal_writer *journals() {
+        if (!journal_writer_) {
+            journal_writer_ = std::make_unique<journal_writer>();
+        }
+        return journal_writer_.get();
+    }
+    // Journal writes since the last sync.
+    bool journals_unsynced = false;
+
+    // Background loads of big files, appended to their buffers by apply_file_loader_progress.
+    std::vector<std::unique_ptr<file_loader>> file_loaders;
+
     ui_mode ui_config;
 
     std::unique_ptr<scratch_frame> scratch_;
@@ -489,8 +545,8 @@ inline void close_status_prompt(state *st) {
 size_t distance_to_eol(const buffer& buf, size_t pos);
 size_t distance_to_beginning_of_line(const buffer& buf, size_t pos);
 
-void record_yank(clip_board *clb, const buffer_string& deletedText, yank_side side);
-std::optional<const buffer_string *> do_yank(clip_board *clb);
+void record_yank(clip_board *clb, const shared_text& deletedText, yank_side side);
+std::optional<shared_text> do_yank(clip_board *clb);
 
 void no_yank(clip_board *clb);
 
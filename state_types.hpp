@@ -4,11 +4,20 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include <compare>
+
 // Certain types are defined here (for reasons such as circular reference avoidance
 // between state.hpp and undo.hpp).
 
 namespace qwi {
 
+struct buffer_id {
+    uint64_t value;
+    // Zero is an invalid buffer_id -- they start at 1.
+    bool empty() const { return value == 0; }
+    friend auto operator<=>(buffer_id x, buffer_id y) = default;
+};
+
 // This is used for _strong_ mark references -- the mark needs to get removed when the
 // owning object goes away.
 struct mark_id {
@@ -1,10 +1,13 @@
 #include "term_ui.hpp"
 
+#include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <ranges>
 
 #include "arith.hpp"
+#include "terminal.hpp"
 #include "util.hpp"
 
 namespace ranges = std::ranges;
@@ -12,16 +15,8 @@ namespace ranges = std::ranges;
 namespace qwi {
 
 size_t pos_current_column(const buffer& buf, const size_t pos) {
-    size_t line_col = 0;
-    bool saw_newline = false;
-    for (size_t i = pos - distance_to_beginning_of_line(buf, pos); i < pos; ++i) {
-        buffer_char ch = buf.get(i);
-        char_rendering rend = compute_char_rendering(ch, &line_col);
-        saw_newline |= (rend.count == SIZE_MAX);
-    }
-    runtime_check(!saw_newline, "encountered impossible newline in pos_current_column");
-
-    return line_col;
+    const size_t line_start = buf.line_beginning(pos);
+    return buf.rendered_lines().column_at(buf.text(), line_start, pos - line_start);
 }
 
 // TODO: Fix this cyclic reference cleanly somehow.
@@ -70,6 +65,46 @@ char_rendering compute_char_rendering(const buffer_char bch, size_t *line_col) {
     return ret;
 }
 
+// We render (or keep rendered) at most this much of a line before the part of it that's in
+// view, before we skip ahead instead.
+constexpr size_t LONG_LINE_SKIP = 1 << 16;
+
+// The cached line at line_start, rendering from column first_column or earlier.
+render_cache::line *lookup_line(const buffer& buf, size_t line_start, size_t first_column) {
+    render_cache::line *line = buf.rendered_lines().lookup(line_start);
+    if (first_column < line->first_column) {
+        // It was a first visible line whose beginning we skipped.
+        line->restart(buf.text(), line_start, 0);
+    }
+    return line;
+}
+
+// first_visible_offset is the first rendered character in the buffer -- this may be a tab
+// character or 2-column-rendered control character, only part of which was rendered.  So
+// the first visible row of its line is the one where that character ends.  (Or where the
+// line ends, if first_visible_offset is there.)  Returns that row, for a window cols wide,
+// and sets *line_start_out to the start of the line.
+size_t first_visible_row(const buffer& buf, const ui_window_ctx& ui, size_t cols, size_t *line_start_out) {
+    const size_t first_visible_offset = buf.get_mark_offset(ui.first_visible_offset);
+    const size_t line_start = buf.line_beginning(first_visible_offset);
+    *line_start_out = line_start;
+    render_cache::line *line = buf.rendered_lines().lookup(line_start);
+    const size_t byte = first_visible_offset - line_start;
+    // Rows start at most cols bytes before byte.  If a lot of the line is (or would have to
+    // be) rendered before byte, we just count columns up to there.
+    const size_t restart_byte = byte > cols ? byte - cols : 0;
+    if (byte < line->first_byte || byte - line->first_byte > LONG_LINE_SKIP) {
+        line->restart(buf.text(), line_start, restart_byte);
+    }
+    line->render(buf.text(), line_start, byte + 1, 0);
+    size_t first_row = byte < line->end_byte() ? (line->column(byte + 1) - 1) / cols : line->end_column() / cols;
+    if (first_row * cols < line->first_column) {
+        line->restart(buf.text(), line_start, restart_byte);
+        line->render(buf.text(), line_start, byte + 1, 0);
+    }
+    return first_row;
+}
+
 template <class T>
 void resize_and_refill(std::vector<T> *vec, size_t new_size, T value) {
     std::fill(vec->begin(), vec->begin() + std::min<size_t>(vec->size(), new_size),
@@ -104,8 +139,7 @@ void render_into_frame(terminal_frame *frame_ptr, terminal_coord window_topleft,
                        const window_size& window, const ui_window_ctx& ui, const buffer& buf,
                        std::span<render_coord> render_coords) {
     if (window.cols == 0) {
-        // This window.cols check is important, for the invariant maintained that col <
-        // window.cols at the top of the while loop below.
+        // This window.cols check is important, for the division by cols below.
         return;
     }
 
@@ -116,120 +150,347 @@ void render_into_frame(terminal_frame *frame_ptr, terminal_coord window_topleft,
     runtime_check(u32_add(window_topleft.col, window.cols) <= frame.window.cols,
                   "buf window cols exceeds frame window");
 
-    // first_visible_offset is the first rendered character in the buffer -- this may be a
-    // tab character or 2-column-rendered control character, only part of which was
-    // rendered.  We render the entire line first_visible_offset was part of, and
-    // copy_row_if_visible conditionally copies the line into the `frame` for rendering --
-    // taking care to call it before incrementing i for partially rendered characters, and
-    // _after_ incrementing i for the completely rendered character.
+    // Lines come from buf's render_cache, and get sliced into rows of cols cells.
+    const size_t cols = window.cols;
+    uint32_t row = 0;
+    auto copy_row = [&](const terminal_char *cells, size_t count) {
+        terminal_char *out = &frame.data[(window_topleft.row + row) * frame.window.cols + window_topleft.col];
+        std::copy(cells, cells + count, out);
+        std::fill(out + count, out + cols, terminal_char{' '});
+        ++row;
+    };
+    size_t render_coords_begin = 0;
 
-    // TODO: We actually don't want to re-render a whole line
-    size_t first_visible_offset = buf.get_mark_offset(ui.first_visible_offset);
-    size_t i = first_visible_offset - distance_to_beginning_of_line(buf, first_visible_offset);
+    size_t line_start;
+    size_t first_row = first_visible_row(buf, ui, cols, &line_start);
+    while (row < window.rows) {
+        render_cache::line *line = lookup_line(buf, line_start, first_row * cols);
+        line->render(buf.text(), line_start, 0, (first_row + window.rows - row) * cols);
+        const size_t last_row = line->complete ? line->end_column() / cols : SIZE_MAX;
+        const uint32_t line_top = row;
+        for (size_t r = first_row; r <= last_row && row < window.rows; ++r) {
+            const size_t begin = r * cols - line->first_column;
+            const size_t end = std::min((r + 1) * cols, line->end_column()) - line->first_column;
+            copy_row(line->cells.data() + begin, std::max(begin, end) - begin);
+        }
 
-    std::vector<terminal_char> render_row(window.cols, terminal_char{0});
-    size_t render_coords_begin = 0;
-    size_t render_coords_end = 0;
-    size_t line_col = 0;
-    size_t col = 0;
-    size_t row = 0;
-    // This gets called after we paste our character into the row and i is the offset
-    // after the last completely written character.  Called precisely when col ==
-    // window.cols.
-    auto copy_row_if_visible = [&]() {
-        col = 0;
-        if (i > first_visible_offset) {
-            // It simplifies code to throw in this (row < window.rows) check here, instead
-            // of carefully calculating where we might need to check it.
-            if (row < window.rows) {
-                std::copy(render_row.begin(), render_row.end(),
-                          &frame.data[(window_topleft.row + row) * frame.window.cols + window_topleft.col]);
-
-                while (render_coords_begin < render_coords_end) {
-                    render_coords[render_coords_begin].rendered_pos->row = row;
-                    ++render_coords_begin;
+        const size_t line_end = line_start + line->end_byte();
+        for (; render_coords_begin < render_coords.size()
+                 && render_coords[render_coords_begin].buf_pos <= line_end; ++render_coords_begin) {
+            render_coord& coord = render_coords[render_coords_begin];
+            coord.rendered_pos = std::nullopt;
+            if (coord.buf_pos >= line_start + line->first_byte) {
+                const size_t col = line->column(coord.buf_pos - line_start);
+                if (col / cols >= first_row && col / cols - first_row < row - line_top) {
+                    coord.rendered_pos = {uint32_t(line_top + col / cols - first_row), uint32_t(col % cols)};
                 }
             }
-            ++row;
         }
-        // Note that this only does anything if the while loop above wasn't hit.
-        while (render_coords_begin < render_coords_end) {
-            render_coords[render_coords_begin].rendered_pos = std::nullopt;
-            ++render_coords_begin;
+
+        if (!line->ends_with_newline) {
+            // The end of the buffer, or of the window.
+            break;
         }
-    };
-    size_t render_coord_target = render_coords_end < render_coords.size() ? render_coords[render_coords_end].buf_pos : SIZE_MAX;
-    while (row < window.rows && i < buf.size()) {
-        // col < window.cols (in part because we exited early if window.cols == 0)
-        while (i == render_coord_target) {
-            render_coords[render_coords_end].rendered_pos = {UINT32_MAX, uint32_t(col)};
-            ++render_coords_end;
-            render_coord_target = render_coords_end < render_coords.size() ? render_coords[render_coords_end].buf_pos : SIZE_MAX;
+        line_start = line_end + 1;
+        first_row = 0;
+    }
+
+    while (row < window.rows) {
+        copy_row(nullptr, 0);
+    }
+    for (; render_coords_begin < render_coords.size(); ++render_coords_begin) {
+        render_coords[render_coords_begin].rendered_pos = std::nullopt;
+    }
+}
+
+bool too_small_to_render(const window_size& window) {
+    return window.cols < 2 || window.rows == 0;
+}
+
+namespace {
+
+void append_new_terminal_style(std::string *buf, const terminal_style& style) {
+
+    // Right now this code is non-general -- it assumes there is _only_ a bold bit.
+    *buf += TESC();
+    *buf += '0';
+    if (style.mask & terminal_style::BOLD_BIT) {
+        *buf += ";1";
+    }
+    if (style.mask & terminal_style::FOREGROUND_BIT) {
+        *buf += ';';
+        *buf += (style.foreground & terminal_style::BRIGHT) ? '9' : '3';
+        *buf += '0' + (style.foreground & 7);
+    }
+    if (style.mask & terminal_style::BACKGROUND_BIT) {
+        *buf += (style.background & terminal_style::BRIGHT) ? ";4" : ";10";
+        *buf += '0' + (style.background & 7);
+    }
+    *buf += 'm';
+}
+
+// Moves the terminal cursor from `from` (nullopt if we don't know where it is) to `to`.
+// A col of window.cols means the cursor is on the last column, having just written it.
+void append_cursor_move(std::string *buf, const std::optional<terminal_coord>& from, terminal_coord to) {
+    if (from.has_value() && from->row == to.row && from->col <= to.col) {
+        if (from->col < to.col) {
+            *buf += TERMINAL_ESCAPE_SEQUENCE;
+            if (to.col - from->col > 1) {
+                *buf += std::to_string(to.col - from->col);
+            }
+            *buf += 'C';
+        }
+    } else if (from.has_value() && to.col == 0 && (to.row == from->row || to.row == from->row + 1)) {
+        *buf += to.row == from->row ? "\r" : "\r\n";
+    } else {
+        *buf += TERMINAL_ESCAPE_SEQUENCE;
+        *buf += std::to_string(to.row + 1);
+        if (to.col != 0) {
+            *buf += ';';
+            *buf += std::to_string(to.col + 1);
         }
+        *buf += 'H';
+    }
+}
 
-        buffer_char ch = buf.get(i);
+// Unchanged cells between two changed ones get rewritten, instead of moved over, if there
+// are at most this many (and they don't need a style change).  Moving costs 3-5 bytes.
+constexpr uint32_t MAX_REWRITTEN_GAP = 3;
+
+uint64_t hash_bytes(uint64_t h, const void *data, size_t count) {
+    // A collision only makes us pick a worse scroll, so this needn't be a good hash, just a
+    // fast one.
+    const char *p = static_cast<const char *>(data);
+    for (; count >= 8; p += 8, count -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15;
+        h ^= h >> 32;
+    }
+    uint64_t word = 0;
+    memcpy(&word, p, count);
+    return (h ^ word) * 0x9e3779b97f4a7c15;
+}
 
-        char_rendering rend = compute_char_rendering(ch, &line_col);
-        if (rend.count != SIZE_MAX) {
-            // Always, count > 0.
-            for (size_t j = 0; j < rend.count - 1; ++j) {
-                render_row[col] = rend.buf[j];
-                ++col;
-                if (col == window.cols) {
-                    copy_row_if_visible();
-                }
+void hash_rows(const terminal_char *data, const terminal_style *style_data, const terminal_size& window,
+               std::vector<uint64_t> *out) {
+    static_assert(sizeof(terminal_style) == 2);
+    out->resize(window.rows);
+    for (uint32_t i = 0; i < window.rows; ++i) {
+        const size_t offset = size_t(i) * window.cols;
+        (*out)[i] = hash_bytes(hash_bytes(0, data + offset, window.cols),
+                               style_data + offset, window.cols * sizeof(terminal_style));
+    }
+}
+
+// Rows top..bottom of the screen, shifted up by `shift` rows, or down if it's negative.
+struct screen_scroll {
+    uint32_t top;
+    uint32_t bottom;
+    int32_t shift;
+};
+
+// Rows a scroll needs to fix, net of the rows it would break, for it to be worth the
+// escape sequences.
+constexpr uint32_t MIN_SCROLL_BENEFIT = 2;
+
+// Finds the scroll of the screen after which the most rows match the frame, if one is worth
+// doing.  The terminal can only scroll whole rows, so side-by-side windows only scroll if
+// they scroll together.
+std::optional<screen_scroll> find_scroll(terminal_screen *screen, const terminal_frame& frame) {
+    const uint32_t rows = frame.window.rows;
+    const size_t cols = frame.window.cols;
+    uint32_t changed_rows = 0;
+    for (uint32_t i = 0; i < rows && changed_rows < MIN_SCROLL_BENEFIT; ++i) {
+        const size_t offset = i * cols;
+        changed_rows += 0 != memcmp(&screen->data[offset], &frame.data[offset], cols)
+            || 0 != memcmp(&screen->style_data[offset], &frame.style_data[offset], cols * sizeof(terminal_style));
+    }
+    if (changed_rows < MIN_SCROLL_BENEFIT) {
+        return std::nullopt;
+    }
+    std::vector<uint64_t>& old_hashes = screen->old_row_hashes;
+    std::vector<uint64_t>& new_hashes = screen->new_row_hashes;
+    hash_rows(screen->data.data(), screen->style_data.data(), screen->window, &old_hashes);
+    hash_rows(frame.data.data(), frame.style_data.data(), frame.window, &new_hashes);
+
+    std::optional<screen_scroll> best;
+    int64_t best_benefit = MIN_SCROLL_BENEFIT - 1;
+    for (int32_t shift = 1 - int32_t(rows); shift < int32_t(rows); ++shift) {
+        if (shift == 0) {
+            continue;
+        }
+        // For each run of rows i with new row i equal to old row i + shift, we could scroll
+        // the run (and the rows it comes from) into place.
+        const uint32_t distance = uint32_t(std::abs(shift));
+        const uint32_t begin = shift > 0 ? 0 : distance;
+        const uint32_t end = shift > 0 ? rows - distance : rows;
+        auto matches_shifted = [&](uint32_t i) {
+            return new_hashes[i] == old_hashes[size_t(int64_t(i) + shift)];
+        };
+        for (uint32_t i = begin; i < end; ) {
+            if (!matches_shifted(i)) {
+                ++i;
+                continue;
             }
-            render_row[col] = rend.buf[rend.count - 1];
-            ++col;
-            ++i;
-            if (col == window.cols) {
-                copy_row_if_visible();
+            int64_t benefit = 0;
+            const uint32_t run_begin = i;
+            for (; i < end && matches_shifted(i); ++i) {
+                benefit += new_hashes[i] != old_hashes[i];
+            }
+            // The rows the scroll blanks out, which might have been fine already.
+            const uint32_t exposed_begin = shift > 0 ? i : run_begin - distance;
+            for (uint32_t j = exposed_begin; j < exposed_begin + distance; ++j) {
+                benefit -= new_hashes[j] == old_hashes[j];
+            }
+            if (benefit > best_benefit) {
+                best_benefit = benefit;
+                best = screen_scroll{
+                    .top = shift > 0 ? run_begin : run_begin - distance,
+                    .bottom = shift > 0 ? i - 1 + distance : i - 1,
+                    .shift = shift,
+                };
             }
-        } else {
-            // TODO: We could use '\x1bK'
-            // clear to EOL
-            do {
-                render_row[col] = terminal_char{' '};
-                ++col;
-            } while (col < window.cols);
-            ++i;
-            copy_row_if_visible();
         }
     }
+    return best;
+}
+
+// Moves the screen's rows like the terminal does when it scrolls.
+void apply_scroll(terminal_screen *screen, const screen_scroll& scroll) {
+    const size_t cols = screen->window.cols;
+    const uint32_t distance = uint32_t(std::abs(scroll.shift));
+    auto move_rows = [&](auto *vec, auto blank) {
+        auto row = [&](uint32_t i) { return vec->begin() + i * cols; };
+        if (scroll.shift > 0) {
+            std::copy(row(scroll.top + distance), row(scroll.bottom + 1), row(scroll.top));
+            std::fill(row(scroll.bottom + 1 - distance), row(scroll.bottom + 1), blank);
+        } else {
+            std::copy_backward(row(scroll.top), row(scroll.bottom + 1 - distance), row(scroll.bottom + 1));
+            std::fill(row(scroll.top), row(scroll.top + distance), blank);
+        }
+    };
+    move_rows(&screen->data, terminal_char{' '});
+    move_rows(&screen->style_data, terminal_style::zero());
+}
 
-    while (i == render_coord_target) {
-        render_coords[render_coords_end].rendered_pos = {UINT32_MAX, uint32_t(col)};
-        ++render_coords_end;
-        render_coord_target = render_coords_end < render_coords.size() ? render_coords[render_coords_end].buf_pos : SIZE_MAX;
+}  // namespace
+
+void encode_frame(const terminal_frame& frame, terminal_screen *screen) {
+    std::string& buf = screen->write_buffer;
+    buf.resize(0);
+
+    // Everything gets written if we don't know what's on the screen.
+    const bool full = !screen->valid || screen->window != frame.window;
+    const uint32_t cols = frame.window.cols;
+    auto unchanged = [&](size_t offset) {
+        return !full && screen->data[offset].value == frame.data[offset].value
+            && screen->style_data[offset] == frame.style_data[offset];
+    };
+
+    // Where the terminal cursor is, whether it might be visible, and the current style.
+    std::optional<terminal_coord> pos = full ? std::nullopt : screen->cursor;
+    bool cursor_shown = full || screen->cursor.has_value();
+    terminal_style pen = terminal_style::zero();
+    auto hide_cursor = [&]() {
+        if (cursor_shown) {
+            buf += TESC(?25l);
+            cursor_shown = false;
+        }
+    };
+    auto write_cell = [&](size_t offset) {
+        if (pen != frame.style_data[offset]) {
+            append_new_terminal_style(&buf, frame.style_data[offset]);
+            pen = frame.style_data[offset];
+        }
+        buf += frame.data[offset].as_char();
+    };
+
+    if (!full) {
+        if (std::optional<screen_scroll> scroll = find_scroll(screen, frame)) {
+            hide_cursor();
+            // Scrolled-in rows are blank with the current style, which is zero here.  A
+            // scrolling region moves the cursor home; scrolling the whole screen doesn't,
+            // but we don't rely on that.
+            const bool whole_screen = scroll->top == 0 && scroll->bottom == frame.window.rows - 1;
+            if (!whole_screen) {
+                buf += TERMINAL_ESCAPE_SEQUENCE;
+                buf += std::to_string(scroll->top + 1);
+                buf += ';';
+                buf += std::to_string(scroll->bottom + 1);
+                buf += 'r';
+            }
+            buf += TERMINAL_ESCAPE_SEQUENCE;
+            if (std::abs(scroll->shift) > 1) {
+                buf += std::to_string(std::abs(scroll->shift));
+            }
+            buf += scroll->shift > 0 ? 'S' : 'T';
+            if (!whole_screen) {
+                buf += TESC(r);
+            }
+            pos = std::nullopt;
+            apply_scroll(screen, *scroll);
+        }
     }
 
-    // If we reached end of buffer, we might still need to copy the current render_row and
-    // the remaining screen.
-    while (row < window.rows) {
-        do {
-            render_row[col] = terminal_char{' '};
-            ++col;
-        } while (col < window.cols);
-        std::copy(render_row.begin(), render_row.end(),
-                  &frame.data[(window_topleft.row + row) * frame.window.cols + window_topleft.col]);
-        while (render_coords_begin < render_coords_end) {
-            render_coords[render_coords_begin].rendered_pos->row = row;
-            ++render_coords_begin;
+    for (uint32_t i = 0; i < frame.window.rows; ++i) {
+        const size_t row_offset = size_t(i) * cols;
+        uint32_t j = 0;
+        while (j < cols) {
+            if (unchanged(row_offset + j)) {
+                ++j;
+                continue;
+            }
+            hide_cursor();
+            append_cursor_move(&buf, pos, terminal_coord{i, j});
+            while (j < cols) {
+                if (!unchanged(row_offset + j)) {
+                    write_cell(row_offset + j);
+                    ++j;
+                    continue;
+                }
+                uint32_t k = j;
+                while (k < cols && k - j < MAX_REWRITTEN_GAP && unchanged(row_offset + k)
+                       && frame.style_data[row_offset + k] == pen) {
+                    ++k;
+                }
+                if (k == cols || unchanged(row_offset + k)) {
+                    break;
+                }
+                for (; j < k; ++j) {
+                    write_cell(row_offset + j);
+                }
+            }
+            pos = terminal_coord{i, j};
         }
-        ++row;
-        col = 0;
     }
-    while (render_coords_begin < render_coords_end) {
-        render_coords[render_coords_begin].rendered_pos = std::nullopt;
-        ++render_coords_begin;
+    if (pen != terminal_style::zero()) {
+        append_new_terminal_style(&buf, terminal_style::zero());
     }
-}
 
-bool too_small_to_render(const window_size& window) {
-    return window.cols < 2 || window.rows == 0;
+    if (frame.cursor.has_value()) {
+        append_cursor_move(&buf, pos, *frame.cursor);
+        if (!cursor_shown) {
+            // TODO: Make cursor visible when exiting program.
+            buf += TESC(?25h);
+        }
+    } else {
+        hide_cursor();
+    }
+
+    screen->valid = true;
+    screen->window = frame.window;
+    screen->cursor = frame.cursor;
+    screen->data = frame.data;
+    screen->style_data = frame.style_data;
+    screen->frames += 1;
+    screen->total_bytes += buf.size();
 }
 
-bool cursor_is_offscreen(scratch_frame *scratch_frame, const ui_window_ctx *ui, const buffer *buf, size_t cursor) {
+// Whether render_into_frame would leave cursor out of the window.  We count the rows from
+// the first visible one to cursor's, using buf's render_cache -- usually the lines are
+// already rendered, for the last redraw.
+bool cursor_is_offscreen(const ui_window_ctx *ui, const buffer *buf, size_t cursor) {
     if (!ui->rendered_window.has_value()) {
         // We treat as infinite window, and specifically any buf without a window should
         // have no scrolling.
@@ -242,85 +503,75 @@ bool cursor_is_offscreen(scratch_frame *scratch_frame, const ui_window_ctx *ui,
         return false;
     }
 
-    // We might say this is generic code -- even if the buf is for a smaller window, this
-    // terminal frame is artificially constructed.
-
     if (cursor < buf->get_mark_offset(ui->first_visible_offset)) {
         // Take this easy early exit.  Note that sometimes when cursor ==
         // buf->first_visible_offset we still will return true.
         return true;
     }
 
-    terminal_size window = terminal_size{rendered_window.rows, rendered_window.cols};
-    reinit_frame(scratch_frame, window);
-    render_coord coords[1] = { {cursor, std::nullopt} };
-    terminal_coord window_topleft = { 0, 0 };
-    render_into_frame(scratch_frame, window_topleft, rendered_window, *ui, *buf, std::span{coords});
-    return !coords[0].rendered_pos.has_value();
+    const size_t cols = rendered_window.cols;
+    const size_t cursor_line_start = buf->line_beginning(cursor);
+    size_t line_start;
+    size_t first_row = first_visible_row(*buf, *ui, cols, &line_start);
+    // Window rows above line_start's first visible row.
+    size_t rows_above = 0;
+    while (line_start != cursor_line_start) {
+        // The line ends in a newline, and takes all the rows up to its end column's.  We
+        // render it only as far as the window goes, if it's long.
+        size_t length, width;
+        if (first_row != 0 || !buf->rendered_lines().measure(buf->text(), line_start, &length, &width)) {
+            render_cache::line *line = lookup_line(*buf, line_start, first_row * cols);
+            line->render(buf->text(), line_start, 0, (first_row + rendered_window.rows - rows_above) * cols);
+            if (!line->complete) {
+                return true;
+            }
+            length = line->end_byte();
+            width = line->end_column();
+        }
+        rows_above += width / cols + 1 - first_row;
+        if (rows_above >= rendered_window.rows) {
+            return true;
+        }
+        line_start += length + 1;
+        first_row = 0;
+    }
+    const size_t row = buf->rendered_lines().column_at(buf->text(), line_start, cursor - line_start) / cols;
+    return row < first_row || rows_above + (row - first_row) >= rendered_window.rows;
 }
 
 // Scrolls buf so that buf_pos is close to rowno.  (Sometimes it can't get there, e.g. we
 // can't scroll past front of buffer, or a very narrow window might force buf_pos's row <
 // rowno without equality).
 void scroll_to_row(ui_window_ctx *ui, buffer *buf, const uint32_t rowno, const size_t buf_pos) {
-    // We're going to back up and render one line at a time.
+    // We back up a line at a time, counting rows with the render_cache's column lookups.
     const size_t window_cols = ui->window_cols_or_maxval();
-
-    size_t rows_stepbacked = 0;
-    size_t pos = buf_pos;
-    for (;;) {
-        size_t col = pos_current_column(*buf, pos);
-        size_t row_in_line = col / window_cols;
-        rows_stepbacked += row_in_line;
-        pos = pos - distance_to_beginning_of_line(*buf, pos);
-        if (rows_stepbacked == rowno || pos == 0) {
-            // First visible offset is pos, at beginning of line.
-            buf->replace_mark(ui->first_visible_offset, pos);
-            return;
-        } else if (rows_stepbacked < rowno) {
-            // pos > 0, as we tested.
-            --pos;
-            ++rows_stepbacked;
-        } else {
-            // We stepped back too far -- first_visible_offset >= pos and <= previous
-            // value of pos.
-            break;
+    const text_storage& text = buf->text();
+    render_cache& cache = buf->rendered_lines();
+
+    size_t line_start = buf->line_beginning(buf_pos);
+    size_t rows_stepbacked = cache.column_at(text, line_start, buf_pos - line_start) / window_cols;
+    while (rows_stepbacked < rowno && line_start != 0) {
+        // The previous line takes the rows up to its newline's.
+        const size_t prev_start = buf->line_beginning(line_start - 1);
+        size_t length, width;
+        if (!cache.measure(text, prev_start, &length, &width)) {
+            width = cache.lookup(prev_start)->line_width(text, prev_start);
         }
+        rows_stepbacked += width / window_cols + 1;
+        line_start = prev_start;
     }
 
-    // We stepped back too far.  We have rows_stepbacked > rowno.  pos is the beginning of
-    // the line.  We want to walk pos forward until we've rendered `rows_stepbacked -
-    // rowno` lines, and compute a new first_visible_offset.
-
-    size_t i = pos;
-    size_t line_col = 0;
-    size_t col = 0;
-    bool saw_newline = false;
-    for (;; ++i) {
-        if (i == buf_pos) {
-            // idk how this would be possible; just a simple way to prove no infinite traversal.
-            buf->replace_mark(ui->first_visible_offset, pos);
-            break;
-        }
-
-        buffer_char ch = buf->get(i);
-        char_rendering rend = compute_char_rendering(ch, &line_col);
-        saw_newline |= (rend.count == SIZE_MAX);
-        col += rend.count == SIZE_MAX ? 0 : rend.count;
-        while (col >= window_cols) {
-            --rows_stepbacked;
-            col -= window_cols;
-            if (rows_stepbacked == rowno) {
-                // Now what?  If col > 0, then first_visible_offset is i.  If col == 0, then
-                // first_visible_offset is i + 1.
-                buf->replace_mark(ui->first_visible_offset, i + (col == 0));
-
-                goto done_loop;
-            }
-        }
+    if (rows_stepbacked <= rowno) {
+        // First visible offset is line_start, at beginning of line.
+        buf->replace_mark(ui->first_visible_offset, line_start);
+        return;
     }
- done_loop:
-    runtime_check(!saw_newline, "encountered impossible newline in scroll_to_row");
+
+    // We stepped back too far -- the first visible offset is in line_start's line, at the
+    // first byte whose rendering goes past the rows we don't want to see.
+    const size_t hidden_columns = (rows_stepbacked - rowno) * window_cols;
+    buf->replace_mark(ui->first_visible_offset,
+                      line_start + cache.lookup(line_start)->byte_ending_after(text, line_start, hidden_columns));
 }
 
 // Scrolls buf so that buf_pos is close to the middle (as close as possible, e.g. if it's
@@ -331,17 +582,12 @@ void scroll_to_mid(ui_window_ctx *ui, buffer *buf, size_t buf_pos) {
     scroll_to_row(ui, buf, ui->rendered_window->rows / 2, buf_pos);
 }
 
-void recenter_cursor_if_offscreen(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf) {
-    if (cursor_is_offscreen(scratch_frame, ui, buf, get_ctx_cursor(ui, buf))) {
+void recenter_cursor_if_offscreen(ui_window_ctx *ui, buffer *buf) {
+    if (cursor_is_offscreen(ui, buf, get_ctx_cursor(ui, buf))) {
         scroll_to_mid(ui, buf, get_ctx_cursor(ui, buf));
     }
 }
 
-void recenter_cursor_if_offscreen_(ui_window_ctx *ui, buffer *buf) {
-    scratch_frame scratch_frame;
-    recenter_cursor_if_offscreen(&scratch_frame, ui, buf);
-}
-
 
 #if 0
 void resize_buf_window(ui_window_ctx *ui, const window_size& buf_window) {
@@ -5,9 +5,11 @@
 
 #include <optional>
 #include <span>
+#include <string>
 #include <vector>
 
 #include "state.hpp"
+#include "terminal_char.hpp"
 #include "terminal_size.hpp"
 
 namespace qwi {
@@ -17,16 +19,6 @@ namespace qwi {
    clean separation.  Includes terminal_frame and render_into_frame because some general
    buffer-update code makes use of it (instead of slickly duplicating its logic). */
 
-struct terminal_char {
-    uint8_t value;
-    char as_char() const { return char(value); }
-};
-
-inline const char *as_chars(const terminal_char *p) {
-    static_assert(sizeof(terminal_char) == 1);
-    return reinterpret_cast<const char *>(p);
-}
-
 struct terminal_style {
     static constexpr uint8_t BOLD_BIT = 1 << 0;
     static constexpr uint8_t FOREGROUND_BIT = 1 << 1;
@@ -98,14 +90,38 @@ void render_into_frame(terminal_frame *frame_ptr, terminal_coord window_topleft,
 
 bool too_small_to_render(const window_size& window);
 
+// What the terminal screen shows, as of the last frame we encoded, so that the next frame
+// only has to write the cells that changed -- after scrolling the screen, if its rows moved
+// up or down.
+struct terminal_screen {
+    // False until a frame is written, and after something else draws on the terminal.
+    bool valid = false;
+    terminal_size window;
+    std::optional<terminal_coord> cursor;
+    std::vector<terminal_char> data;
+    std::vector<terminal_style> style_data;
+
+    // The bytes to write for the last encoded frame.
+    std::string write_buffer;
+    // Scratch space for finding scrolled rows.
+    std::vector<uint64_t> old_row_hashes;
+    std::vector<uint64_t> new_row_hashes;
+    // Frames encoded, and the bytes written for them.
+    uint64_t frames = 0;
+    uint64_t total_bytes = 0;
+};
+
+// Puts the escape sequences that turn the screen into frame in screen->write_buffer, and
+// updates screen to hold frame.
+void encode_frame(const terminal_frame& frame, terminal_screen *screen);
+
 // This isn't some option you can configure.
 constexpr bool INIT_FRAME_INITIALIZES_WITH_SPACES = true;
 
 
 size_t pos_current_column(const buffer& buf, const size_t pos);
 size_t current_column(const ui_window_ctx *ui, const buffer *buf);
-void recenter_cursor_if_offscreen(scratch_frame *scratch_frame, ui_window_ctx *ui, buffer *buf);
-void recenter_cursor_if_offscreen_(ui_window_ctx *ui, buffer *buf);
+void recenter_cursor_if_offscreen(ui_window_ctx *ui, buffer *buf);
 
 #if 0
 // Changes buf->window; also resets virtual_column.
@@ -0,0 +1,20 @@
+#ifndef QWERTILLION_TERMINAL_CHAR_HPP_
+#define QWERTILLION_TERMINAL_CHAR_HPP_
+
+#include <stdint.h>
+
+namespace qwi {
+
+struct terminal_char {
+    uint8_t value;
+    char as_char() const { return char(value); }
+};
+
+inline const char *as_chars(const terminal_char *p) {
+    static_assert(sizeof(terminal_char) == 1);
+    return reinterpret_cast<const char *>(p);
+}
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_TERMINAL_CHAR_HPP_
@@ -0,0 +1,70 @@
+#ifndef QWERTILLION_TEXT_STORAGE_HPP_
+#define QWERTILLION_TEXT_STORAGE_HPP_
+
+#include <stddef.h>
+
+#include <concepts>
+#include <span>
+
+#include "chars.hpp"
+#include "gap_buffer.hpp"
+#include "piece_table.hpp"
+#include "region_stats.hpp"
+#include "rope.hpp"
+
+// Selects the data structure holding buffer text.  Set with the QWI_TEXT_STORAGE CMake
+// option (rope, gap_buffer or piece_table).
+#define QWI_TEXT_STORAGE_ROPE 1
+#define QWI_TEXT_STORAGE_GAP_BUFFER 2
+// Files get mapped read-only instead of read into memory.
+#define QWI_TEXT_STORAGE_PIECE_TABLE 3
+
+#ifndef QWI_TEXT_STORAGE
+#define QWI_TEXT_STORAGE QWI_TEXT_STORAGE_ROPE
+#endif
+
+namespace qwi {
+
+// What buffer needs from the data structure holding its text.  A copy must be
+// independent of the original, so that another thread can read it as a snapshot while the
+// original gets edited (see buffer::snapshot).  Const reads may update a cache in the
+// object read from, so one copy is for one thread at a time.
+template <class T>
+concept text_storage_backend =
+    std::default_initializable<T> && std::copyable<T>
+    && std::constructible_from<T, buffer_string&&>
+    && std::constructible_from<T, std::span<const buffer_char>>
+    && requires(T t, const T ct, T&& other, size_t i, const buffer_char *chs,
+                buffer_string *deleted_out, buffer_char *out, size_t *beg_out) {
+        { ct.size() } -> std::same_as<size_t>;
+        { ct.get(i) } -> std::same_as<buffer_char>;
+        t.insert(i, chs, i);
+        // Erases [pos, pos + count), appending the erased text to *deleted_out (if non-null).
+        t.erase(i, i, deleted_out);
+        t.append(std::move(other));
+        // Stats of the text in [0, pos).
+        { ct.stats_at(i) } -> std::same_as<region_stats>;
+        ct.copy_to(i, i, out);
+        // The contiguous piece of text containing i, and its offset.
+        { ct.chunk_at(i, beg_out) } -> std::same_as<std::span<const buffer_char>>;
+        // Calls fn on the contiguous pieces of [beg, end), in order.
+        ct.for_each_span(i, i, [](std::span<const buffer_char>) { });
+    };
+
+static_assert(text_storage_backend<rope>);
+static_assert(text_storage_backend<gap_buffer>);
+static_assert(text_storage_backend<piece_table>);
+
+#if QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_ROPE
+using text_storage = rope;
+#elif QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_GAP_BUFFER
+using text_storage = gap_buffer;
+#elif QWI_TEXT_STORAGE == QWI_TEXT_STORAGE_PIECE_TABLE
+using text_storage = piece_table;
+#else
+#error "Unknown QWI_TEXT_STORAGE"
+#endif
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_TEXT_STORAGE_HPP_
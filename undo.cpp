@@ -1,13 +1,90 @@
 #include "undo.hpp"
 
+#include <algorithm>
+#include <utility>
+
 #include "arith.hpp"
 #include "buffer.hpp"
+#include "io.hpp"
+#include "term_ui.hpp"
 
 namespace qwi {
 
+namespace {
+
+void push_past(undo_history *history, undo_item&& item) {
+    history->memory_used += undo_memory(item);
+    history->past.push_back(std::move(item));
+}
+
+undo_item pop_past(undo_history *history) {
+    undo_item ret = std::move(history->past.back());
+    history->past.pop_back();
+    history->memory_used -= undo_memory(ret);
+    return ret;
+}
+
+void push_future(undo_history *history, atomic_undo_item&& item) {
+    history->memory_used += undo_memory(item);
+    history->future.push_back(std::move(item));
+}
+
+// Whether item can be applied to buf:  it leaves the current node, and the text it deletes
+// is there.  History loaded from an undo file might not fit, if the file changed in a way
+// load_undo_file didn't notice.
+bool item_fits(const buffer& buf, const atomic_undo_item& item) {
+    if (item.before_node != buf.undo_info.current_node || item.beg > buf.size()) {
+        return false;
+    }
+    const size_t count = item.text_deleted.size();
+    size_t beg = item.beg;
+    if (item.side == Side::left) {
+        if (count > beg) {
+            return false;
+        }
+        beg -= count;
+    } else if (count > buf.size() - beg) {
+        return false;
+    }
+    const std::span<const buffer_char> deleted = item.text_deleted.span();
+    size_t i = 0;
+    bool equal = true;
+    buf.text().for_each_span(beg, beg + count, [&](std::span<const buffer_char> span) {
+        equal = equal && std::ranges::equal(span, deleted.subspan(i, span.size()));
+        i += span.size();
+    });
+    return equal;
+}
+
+}  // namespace
+
+size_t undo_memory(const atomic_undo_item& item) {
+    return sizeof(atomic_undo_item) + item.text_deleted.memory() + item.text_inserted.memory()
+        + item.mark_adjustments.capacity() * sizeof(item.mark_adjustments[0]);
+}
+
+size_t undo_memory(const undo_item& item) {
+    size_t ret = sizeof(undo_item) + undo_memory(item.atomic) - sizeof(atomic_undo_item);
+    ret += (item.history.capacity() - item.history.size()) * sizeof(atomic_undo_item);
+    for (const atomic_undo_item& it : item.history) {
+        ret += undo_memory(it);
+    }
+    return ret;
+}
+
+void evict_old_undo_items(undo_history *history, size_t budget) {
+    while (history->memory_used > budget && history->past.size() > 1) {
+        history->memory_used -= undo_memory(history->past.front());
+        history->past.pop_front();
+    }
+}
+
 void move_future_to_mountain(undo_history *history) {
     if (!history->future.empty()) {
-        history->past.push_back({
+        for (const atomic_undo_item& item : history->future) {
+            history->memory_used -= undo_memory(item);
+        }
+        push_past(history, {
                 .type = undo_item::Type::mountain,
                 .atomic = {},
                 .history = std::move(history->future)
@@ -45,11 +122,12 @@ void add_edit(undo_history *history, atomic_undo_item&& item) {
     move_future_to_mountain(history);
 
     if (item_has_effect(item)) {
-        history->past.push_back({
+        const undo_node_number before_node = item.before_node;
+        push_past(history, {
                 .type = undo_item::Type::atomic,
                 .atomic = std::move(item),
             });
-        history->current_node = item.before_node;
+        history->current_node = before_node;
         history->next_node_number.value += 1;
     }
 }
@@ -60,6 +138,11 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
         undo_item& back_item = history->past.back();
         if (back_item.type != undo_item::Type::mountain) {
             atomic_undo_item& back = back_item.atomic;
+            // Every case below that returns has modified back, so we re-account for it.
+            const size_t back_memory = undo_memory(back);
+            auto reaccount = [&] {
+                history->memory_used += undo_memory(back) - back_memory;
+            };
             // Kind of unnecessary (we'd catch it when we try to undo).
             logic_check(back.before_node == history->current_node, "add_coalescent_edit observing mismatching before_node");
 
@@ -72,9 +155,10 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
                 logic_check(back.side == Side::left && item.side == Side::left, "incompatible insert_char coalescence");
                 logic_check(back.text_inserted.empty() && item.text_inserted.empty(), "incompatible insert_char coalescence");
                 logic_check(back.beg == size_sub(item.beg, item.text_deleted.size()), "incompatible insert_char coalescence");
-                back.text_deleted += item.text_deleted;
+                back.text_deleted.append(item.text_deleted.data(), item.text_deleted.size());
                 back.beg = item.beg;
                 {
+                    reaccount();
                     return;
                 }
             case undo_history::char_coalescence::delete_left: {
@@ -96,10 +180,11 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
 
                 back.mark_adjustments.insert(back.mark_adjustments.end(), item.mark_adjustments.begin(), item.mark_adjustments.end());
 
-                back.text_inserted = std::move(item.text_inserted) + back.text_inserted;
+                back.text_inserted.prepend(item.text_inserted.data(), item.text_inserted.size());
 
                 back.beg = item.beg;
                 {
+                    reaccount();
                     return;
                 }
             }
@@ -114,8 +199,9 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
 
                 back.mark_adjustments.insert(back.mark_adjustments.end(), item.mark_adjustments.begin(), item.mark_adjustments.end());
 
-                back.text_inserted += item.text_inserted;
+                back.text_inserted.append(item.text_inserted.data(), item.text_inserted.size());
                 {
+                    reaccount();
                     return;
                 }
             }
@@ -123,16 +209,18 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
         }
     }
     history->coalescence = coalescence;
-    history->past.push_back({
+    const undo_node_number before_node = item.before_node;
+    push_past(history, {
             .type = undo_item::Type::atomic,
             .atomic = std::move(item),
         });
-    history->current_node = item.before_node;
+    history->current_node = before_node;
     history->next_node_number.value += 1;
 }
 
 // Returns the opposite undo item that we should push onto future or use for other purposes.
-[[nodiscard]] atomic_undo_item atomic_undo(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf, atomic_undo_item&& item) {
+// It shares item's text.
+[[nodiscard]] atomic_undo_item atomic_undo(scratch_frame *scratch, ui_window_ctx *ui, buffer *buf, const atomic_undo_item& item) {
     logic_check(item.before_node == buf->undo_info.current_node, "atomic_undo node number mismatch, item.before_node=%" PRIu64 " vs %" PRIu64,
                 item.before_node.value, buf->undo_info.current_node.value);
 
@@ -151,7 +239,7 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
             d_res = delete_right(scratch, ui, buf, item.text_deleted.size());
             break;
         }
-        logic_check(d_res.deletedText == item.text_deleted, "undo deletion action expecting text to match deleted text");
+        logic_check(std::ranges::equal(d_res.deletedText.span(), item.text_deleted.span()), "undo deletion action expecting text to match deleted text");
     }
 
     insert_result i_res;
@@ -162,7 +250,7 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
         switch (item.side) {
         case Side::left: {
             const size_t num_inserted = item.text_inserted.size();
-            i_res = insert_chars(scratch, ui, buf, item.text_inserted.data(), num_inserted, false);
+            i_res = insert_chars(scratch, ui, buf, item.text_inserted, false);
             for (const std::pair<weak_mark_id, size_t>& elem : item.mark_adjustments) {
                 if (elem.first.index == ui->cursor_mark.index) {
                     continue;
@@ -175,7 +263,7 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
 
         } break;
         case Side::right:
-            i_res = insert_chars_right(scratch, ui, buf, item.text_inserted.data(), item.text_inserted.size());
+            i_res = insert_chars_right(scratch, ui, buf, item.text_inserted);
 
             for (const std::pair<weak_mark_id, size_t>& elem : item.mark_adjustments) {
                 if (elem.first.index == ui->cursor_mark.index) {
@@ -196,8 +284,10 @@ void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_hi
     logic_checkg(inserted ? get_ctx_cursor(ui, buf) == i_res.new_cursor : deleted ? get_ctx_cursor(ui, buf) == d_res.new_cursor : true);
     atomic_undo_item ret = {
         .beg = get_ctx_cursor(ui, buf),
-        .text_deleted = inserted ? std::move(i_res.insertedText) : buffer_string{},
-        .text_inserted = deleted ? std::move(d_res.deletedText) : buffer_string{},
+        // The reverse action deletes what we inserted and inserts what we deleted -- the
+        // same text.
+        .text_deleted = item.text_inserted,
+        .text_inserted = item.text_deleted,
         .side = item.side,  // or d_res.side, or i_res.side, all the same value
         .mark_adjustments = std::move(d_res.squeezed_marks),
 
@@ -214,30 +304,125 @@ void perform_undo(state *st, ui_window_ctx *ui, buffer *buf) {
         st->note_error_message("No further undo information");  // TODO: UI logic
         return;
     }
-    undo_item item = std::move(buf->undo_info.past.back());
-    buf->undo_info.past.pop_back();
-    switch (item.type) {
+    if (buf->read_only) {
+        // Undoing would edit the text.
+        st->note_error_message("Buffer is read-only");  // TODO: UI logic
+        return;
+    }
+    undo_history *history = &buf->undo_info;
+    const undo_item& back = history->past.back();
+    if (!item_fits(*buf, back.type == undo_item::Type::atomic ? back.atomic : back.history.back())) {
+        // Node numbers go on, so that the buffer's modified flag stays right.
+        history->past.clear();
+        history->future.clear();
+        history->memory_used = 0;
+        history->coalescence = undo_history::char_coalescence::none;
+        st->note_error_message("Undo history does not match the text, discarded it");  // TODO: UI logic
+        return;
+    }
+    switch (back.type) {
     case undo_item::Type::atomic: {
-        atomic_undo_item reverse_item = atomic_undo(st->scratch(), ui, buf, std::move(item.atomic));
-        buf->undo_info.future.push_back(std::move(reverse_item));
+        undo_item item = pop_past(history);
+        atomic_undo_item reverse_item = atomic_undo(st->scratch(), ui, buf, item.atomic);
+        push_future(history, std::move(reverse_item));
     } break;
     case undo_item::Type::mountain: {
-        atomic_undo_item it = std::move(item.history.back());
+        // We don't use pop_past and push_past, which would walk the whole mountain to
+        // account for its memory.
+        undo_item item = std::move(history->past.back());
+        history->past.pop_back();
+        atomic_undo_item reverse_it = atomic_undo(st->scratch(), ui, buf, item.history.back());
+        // The popped item's slot in the vector stays allocated.
+        history->memory_used -= undo_memory(item.history.back()) - sizeof(atomic_undo_item);
         item.history.pop_back();
-        // TODO: As this code now makes clear, it is always bad that we are duplicating the undo item (and deep copying the strings, etc.)
-        atomic_undo_item reverse_it = atomic_undo(st->scratch(), ui, buf, atomic_undo_item(it));
 
-        buf->undo_info.future.push_back(reverse_it);
-        buf->undo_info.past.push_back({
+        // The copy shares reverse_it's text.
+        push_future(history, atomic_undo_item(reverse_it));
+        push_past(history, {
                 .type = undo_item::Type::atomic,
                 .atomic = std::move(reverse_it),
             });
         if (!item.history.empty()) {
-            buf->undo_info.past.push_back(std::move(item));
+            history->past.push_back(std::move(item));
+        } else {
+            history->memory_used -= undo_memory(item);
         }
     } break;
     }
 }
 
+void perform_undo_steps(state *st, ui_window_ctx *ui, buffer *buf, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (buf->undo_info.past.empty() || buf->read_only) {
+        // perform_undo reports why not.
+        perform_undo(st, ui, buf);
+        return;
+    }
+    // Edits in a window with no rendered size don't scroll, so without it, each step skips
+    // rendering the window to check the cursor.  We recenter once, at the end.
+    std::optional<window_size> rendered_window = std::exchange(ui->rendered_window, std::nullopt);
+    for (size_t i = 0; i < count && !buf->undo_info.past.empty(); ++i) {
+        perform_undo(st, ui, buf);
+    }
+    ui->rendered_window = rendered_window;
+    recenter_cursor_if_offscreen(ui, buf);
+}
+
+std::optional<size_t> undo_steps_to_node(const undo_history& history, undo_node_number node) {
+    if (history.current_node == node) {
+        return 0;
+    }
+    // This follows perform_undo:  undoing a mountain's items, last to first, pushes their
+    // reverse items underneath it, and those get undone next, first to last.
+    size_t steps = 0;
+    for (auto it = history.past.rbegin(); it != history.past.rend(); ++it) {
+        if (it->type == undo_item::Type::atomic) {
+            ++steps;
+            if (it->atomic.after_node == node) {
+                return steps;
+            }
+            continue;
+        }
+        for (auto jt = it->history.rbegin(); jt != it->history.rend(); ++jt) {
+            ++steps;
+            if (jt->after_node == node) {
+                return steps;
+            }
+        }
+        for (const atomic_undo_item& item : it->history) {
+            ++steps;
+            if (item.before_node == node) {
+                return steps;
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+void prune_dead_mark_adjustments(atomic_undo_item *item, const buffer& buf) {
+    if (std::erase_if(item->mark_adjustments, [&](const std::pair<weak_mark_id, size_t>& elem) {
+            return !buf.is_live_mark(elem.first);
+        }) != 0) {
+        item->mark_adjustments.shrink_to_fit();
+    }
+}
+
+void prune_dead_mark_adjustments(undo_history *history, const buffer& buf) {
+    for (undo_item& item : history->past) {
+        history->memory_used -= undo_memory(item);
+        prune_dead_mark_adjustments(&item.atomic, buf);
+        for (atomic_undo_item& it : item.history) {
+            prune_dead_mark_adjustments(&it, buf);
+        }
+        history->memory_used += undo_memory(item);
+    }
+    for (atomic_undo_item& item : history->future) {
+        history->memory_used -= undo_memory(item);
+        prune_dead_mark_adjustments(&item, buf);
+        history->memory_used += undo_memory(item);
+    }
+}
 
 }  // namespace qwi
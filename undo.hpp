@@ -1,9 +1,15 @@
 #ifndef QWERTILLION_UNDO_HPP_
 #define QWERTILLION_UNDO_HPP_
 
+#include <deque>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
 #include <vector>
 
 #include "chars.hpp"
+#include "shared_text.hpp"
 #include "state_types.hpp"
 
 namespace qwi {
@@ -25,11 +31,11 @@ struct atomic_undo_item {
     // mark_adjustments to update other windows' mid-range marks upon insertion, if
     // applicable, and update the undo node number of the buffer (which is used for the
     // file modification flag and other lawful purposes).)
-    buffer_string text_deleted{};
-    buffer_string text_inserted{};
+    shared_text text_deleted{};
+    shared_text text_inserted{};
     Side side = Side::left;
 
-    // TODO: At some point, when we have limited undo info, we'll also want to GC expired weak mark refs.
+    // Expired weak mark refs get removed by prune_dead_mark_adjustments.
 
     /* If we have text_inserted non-empty, then we may need to adjust marks, if their
        offset is exactly at the insertion point.
@@ -75,9 +81,19 @@ struct undo_item {
 };
 
 struct undo_history {
-    // TODO: There are no limits on undo history size.
-    std::vector<undo_item> past;
+    // Oldest first.  The oldest items get evicted when undo history goes over its memory
+    // budget (see evict_old_undo_items).
+    std::deque<undo_item> past;
     std::vector<atomic_undo_item> future;
+    // Bytes used by past and future (as computed by undo_memory), kept up to date by the
+    // functions below.
+    size_t memory_used = 0;
+
+    // The undo file we last loaded or saved (see undo_file.hpp), and its size.  Text that
+    // is in it has its file_tag.  Zero means there is none.
+    std::string undo_file_path;
+    uint64_t undo_file_tag = 0;
+    uint64_t undo_file_size = 0;
 
     undo_node_number current_node{1};
 
@@ -100,11 +116,34 @@ void add_nop_edit(undo_history *history);
 void add_edit(undo_history *history, atomic_undo_item&& item);
 void add_coalescent_edit(undo_history *history, atomic_undo_item&& item, undo_history::char_coalescence coalescence);
 
+// Memory owned by an undo item, including the item itself.
+size_t undo_memory(const atomic_undo_item& item);
+size_t undo_memory(const undo_item& item);
+
+// Drops the oldest past items until memory_used is at most budget, but always keeps the
+// most recent one.  Nodes only get lost off the far end of history, so current_node (and
+// the buffer's non_modified_undo_node, which it might no longer reach) stay coherent.
+void evict_old_undo_items(undo_history *history, size_t budget);
+
+// Undo memory limits, for each buffer and for all of them together.
+struct undo_budget {
+    size_t per_buffer = size_t(64) << 20;
+    size_t total = size_t(256) << 20;
+};
+
 struct buffer;
 struct state;
 struct ui_window_ctx;
 // TODO: Make error reporting object be a separate type, member object of state.
 void perform_undo(state *st, ui_window_ctx *ui, buffer *buf);
+// Performs count undo steps (or as many as there are), recentering the window only once,
+// at the end.
+void perform_undo_steps(state *st, ui_window_ctx *ui, buffer *buf, size_t count);
+// How many undo steps take history to node, if undoing ever gets there.
+std::optional<size_t> undo_steps_to_node(const undo_history& history, undo_node_number node);
+
+// Removes mark_adjustments of marks that buf no longer has.  (Undo would skip them.)
+void prune_dead_mark_adjustments(undo_history *history, const buffer& buf);
 
 }  // namespace qwi
 
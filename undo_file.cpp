@@ -0,0 +1,392 @@
+#include "undo_file.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <unordered_set>
+#include <utility>
+
+#include "io.hpp"
+
+namespace fs = std::filesystem;
+
+namespace qwi {
+
+namespace {
+
+// The file is a sequence of native-endian uint64_t's, and text:
+//
+//   HEADER_MAGIC
+//   text and tables, appended by each save
+//   offset and size of the last table, FOOTER_MAGIC
+//
+// A table is TABLE_MAGIC, the saved file's size, modification time and content_hash,
+// current_node and next_node_number, then the past items (a count, and for each a type, an item count and
+// the items) and the future items (a count and the items).  An item is ITEM_FIELDS
+// numbers:  beg, side, before_node, after_node, and the offset and size of text_deleted
+// and text_inserted.
+//
+// Mark adjustments aren't saved -- marks don't outlive the process.
+constexpr uint64_t HEADER_MAGIC = 0x31'4f'44'4e'55'49'57'51;  // "QWIUNDO1"
+constexpr uint64_t TABLE_MAGIC = 0x32'4c'42'41'54'49'57'51;  // "QWITABL2"
+constexpr uint64_t FOOTER_MAGIC = 0x52'54'4f'4f'46'49'57'51;  // "QWIFOOTR"
+constexpr uint64_t WORD = sizeof(uint64_t);
+constexpr uint64_t HEADER_SIZE = WORD;
+constexpr uint64_t FOOTER_SIZE = 3 * WORD;
+constexpr uint64_t ITEM_FIELDS = 8;
+constexpr uint64_t ATOMIC_TYPE = 0;
+constexpr uint64_t MOUNTAIN_TYPE = 1;
+
+constexpr mode_t UNDO_FILE_MODE = 0600;
+
+// Saving rewrites the file if less than half of it would be in use, once it's this big.
+constexpr uint64_t COMPACTION_MIN_SIZE = 1 << 20;
+
+uint64_t next_file_tag() {
+    static uint64_t prev = 0;
+    return ++prev;
+}
+
+uint64_t mtime_ns(const struct stat& st) {
+    return uint64_t(st.st_mtim.tv_sec) * 1000000000 + uint64_t(st.st_mtim.tv_nsec);
+}
+
+uint64_t hash_text(const text_storage& text) {
+    content_hash hash;
+    text.for_each_span(0, text.size(), [&](std::span<const buffer_char> span) {
+        hash.add(span.data(), span.size());
+    });
+    return hash.finish();
+}
+
+void put(buffer_string *out, uint64_t x) {
+    buffer_char bytes[WORD];
+    memcpy(bytes, &x, WORD);
+    out->append(bytes, WORD);
+}
+
+// Reads words in [pos, end) of data, setting ok to false if it reads past end.
+struct reader {
+    const buffer_char *data;
+    uint64_t pos;
+    uint64_t end;
+    bool ok = true;
+
+    uint64_t next() {
+        if (end - pos < WORD) {
+            ok = false;
+            return 0;
+        }
+        uint64_t x;
+        memcpy(&x, data + pos, WORD);
+        pos += WORD;
+        return x;
+    }
+};
+
+template <class Callable>
+void for_each_item(undo_history *history, Callable&& fn) {
+    for (undo_item& item : history->past) {
+        if (item.type == undo_item::Type::atomic) {
+            fn(&item.atomic);
+        }
+        for (atomic_undo_item& it : item.history) {
+            fn(&it);
+        }
+    }
+    for (atomic_undo_item& item : history->future) {
+        fn(&item);
+    }
+}
+
+uint64_t table_size(const undo_history& history) {
+    uint64_t words = 6;
+    for (const undo_item& item : history.past) {
+        words += 2 + ITEM_FIELDS * (item.type == undo_item::Type::atomic ? 1 : item.history.size());
+    }
+    words += 1 + ITEM_FIELDS * history.future.size();
+    return words * WORD;
+}
+
+// Whether the undo file for history can be appended to, rather than rewritten.
+bool can_append(const fs::path& path, undo_history *history) {
+    struct stat st;
+    if (history->undo_file_tag == 0 || history->undo_file_path != path.native()
+        || stat(path.c_str(), &st) == -1 || uint64_t(st.st_size) != history->undo_file_size) {
+        return false;
+    }
+    // Text in the file that's still in use, and text we'd append.
+    uint64_t live = 0, fresh = 0;
+    std::unordered_set<uint64_t> seen;
+    for_each_item(history, [&](atomic_undo_item *item) {
+        for (const shared_text *text : {&item->text_deleted, &item->text_inserted}) {
+            std::optional<uint64_t> offset = text->file_offset(history->undo_file_tag);
+            if (!offset.has_value()) {
+                fresh += text->size();
+            } else if (seen.insert(*offset).second) {
+                live += text->size();
+            }
+        }
+    });
+    const uint64_t appended = fresh + table_size(*history) + FOOTER_SIZE;
+    const uint64_t new_size = history->undo_file_size + appended;
+    return new_size < COMPACTION_MIN_SIZE || new_size <= 2 * (HEADER_SIZE + live + appended);
+}
+
+ui_result append_to_file(const fs::path& path, const buffer_string& data) {
+    file_descriptor fd{::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC)};
+    if (fd.fd == -1) {
+        return ui_result::error("error opening file " + path.native());
+    }
+    ui_result res = write_all(fd.fd, data.data(), data.size());
+    if (res.errored()) {
+        return res;
+    }
+    // Like a rewritten file, the table has to be on disk before the file it describes is
+    // trusted with it.
+    return sync_and_close(&fd, path);
+}
+
+ui_result write_new_file(const fs::path& path, const buffer_string& data) {
+    file_descriptor fd;
+    std::string tmp_path;
+    // The history has all the text ever deleted, which only the user should read.
+    ui_result res = open_replacement_file(path, &fd, &tmp_path, UNDO_FILE_MODE);
+    if (res.errored()) {
+        return res;
+    }
+    res = write_all(fd.fd, data.data(), data.size());
+    if (res.errored()) {
+        int discard = unlink(tmp_path.c_str());
+        (void)discard;
+        return res;
+    }
+    return commit_replacement_file(&fd, tmp_path, path);
+}
+
+}  // namespace
+
+void content_hash::mix(uint64_t word) {
+    h_ = (h_ ^ word) * 0x9e3779b97f4a7c15;
+    h_ ^= h_ >> 32;
+}
+
+void content_hash::add(const buffer_char *data, size_t count) {
+    size_t i = 0;
+    for (; i < count && size_ % WORD != 0; ++i, ++size_) {
+        partial_ |= uint64_t(data[i].value) << (8 * (size_ % WORD));
+        if ((size_ + 1) % WORD == 0) {
+            mix(std::exchange(partial_, 0));
+        }
+    }
+    for (; count - i >= WORD; i += WORD, size_ += WORD) {
+        uint64_t word;
+        memcpy(&word, data + i, WORD);
+        mix(word);
+    }
+    for (; i < count; ++i, ++size_) {
+        partial_ |= uint64_t(data[i].value) << (8 * (size_ % WORD));
+    }
+}
+
+uint64_t content_hash::finish() const {
+    content_hash copy = *this;
+    copy.mix(partial_);
+    copy.mix(size_);
+    return copy.h_;
+}
+
+fs::path undo_file_path(const fs::path& file_path) {
+    return file_path.parent_path() / ("." + file_path.filename().native() + ".qwi-undo");
+}
+
+ui_result save_undo_file(const fs::path& file_path, const text_storage& text, undo_history *history) {
+    struct stat file_st;
+    if (stat(file_path.c_str(), &file_st) == -1) {
+        return ui_result::error("error reading file status of " + file_path.native());
+    }
+    const fs::path path = undo_file_path(file_path);
+    const bool append = can_append(path, history);
+    const uint64_t tag = append ? history->undo_file_tag : next_file_tag();
+    const uint64_t base = append ? history->undo_file_size : 0;
+    // Texts get tagged as we go.  If writing fails, the file is in an unknown state, and
+    // the next save rewrites it with a new tag.
+    history->undo_file_tag = 0;
+
+    // New text goes into out, followed by the table.
+    buffer_string out;
+    if (!append) {
+        put(&out, HEADER_MAGIC);
+    }
+    buffer_string table;
+    auto put_text = [&](shared_text *text) {
+        std::optional<uint64_t> offset = text->file_offset(tag);
+        if (text->empty()) {
+            offset = 0;
+        } else if (!offset.has_value()) {
+            offset = base + out.size();
+            out.append(text->data(), text->size());
+            text->set_file_offset(tag, *offset);
+        }
+        put(&table, *offset);
+        put(&table, text->size());
+    };
+    auto put_item = [&](atomic_undo_item *item) {
+        put(&table, item->beg);
+        put(&table, item->side == Side::left ? 0 : 1);
+        put(&table, item->before_node.value);
+        put(&table, item->after_node.value);
+        put_text(&item->text_deleted);
+        put_text(&item->text_inserted);
+    };
+
+    put(&table, TABLE_MAGIC);
+    put(&table, file_st.st_size);
+    put(&table, mtime_ns(file_st));
+    put(&table, hash_text(text));
+    put(&table, history->current_node.value);
+    put(&table, history->next_node_number.value);
+    put(&table, history->past.size());
+    for (undo_item& item : history->past) {
+        if (item.type == undo_item::Type::atomic) {
+            put(&table, ATOMIC_TYPE);
+            put(&table, 1);
+            put_item(&item.atomic);
+        } else {
+            put(&table, MOUNTAIN_TYPE);
+            put(&table, item.history.size());
+            for (atomic_undo_item& it : item.history) {
+                put_item(&it);
+            }
+        }
+    }
+    put(&table, history->future.size());
+    for (atomic_undo_item& item : history->future) {
+        put_item(&item);
+    }
+
+    const uint64_t table_offset = base + out.size();
+    out += table;
+    put(&out, table_offset);
+    put(&out, table.size());
+    put(&out, FOOTER_MAGIC);
+
+    ui_result res = append ? append_to_file(path, out) : write_new_file(path, out);
+    if (res.errored()) {
+        return res;
+    }
+    history->undo_file_path = path.native();
+    history->undo_file_tag = tag;
+    history->undo_file_size = base + out.size();
+    return ui_result::success();
+}
+
+bool load_undo_file(const fs::path& file_path, std::optional<uint64_t> file_hash, undo_history *history) {
+    struct stat file_st;
+    if (stat(file_path.c_str(), &file_st) == -1) {
+        return false;
+    }
+    const fs::path path = undo_file_path(file_path);
+    std::shared_ptr<const mapped_file> mapping;
+    if (map_file(path, false, &mapping).errored() || mapping->size < HEADER_SIZE + FOOTER_SIZE) {
+        return false;
+    }
+    const uint64_t size = mapping->size;
+    reader header{mapping->data, 0, HEADER_SIZE};
+    reader footer{mapping->data, size - FOOTER_SIZE, size};
+    const uint64_t table_offset = footer.next();
+    const uint64_t table_bytes = footer.next();
+    if (header.next() != HEADER_MAGIC || footer.next() != FOOTER_MAGIC
+        || table_offset < HEADER_SIZE || table_offset > size - FOOTER_SIZE
+        || table_bytes != size - FOOTER_SIZE - table_offset) {
+        return false;
+    }
+
+    reader r{mapping->data, table_offset, size - FOOTER_SIZE};
+    if (r.next() != TABLE_MAGIC || r.next() != uint64_t(file_st.st_size) || r.next() != mtime_ns(file_st)) {
+        return false;
+    }
+    if (!file_hash.has_value()) {
+        // That costs a read of the file, but only when there's history for it.
+        std::shared_ptr<const mapped_file> file_mapping;
+        if (map_file(file_path, true, &file_mapping).errored() || file_mapping->size != uint64_t(file_st.st_size)) {
+            return false;
+        }
+        content_hash hash;
+        hash.add(file_mapping->data, file_mapping->size);
+        file_hash = hash.finish();
+    }
+    if (r.next() != *file_hash) {
+        return false;
+    }
+    const uint64_t tag = next_file_tag();
+    auto get_text = [&](shared_text *text) {
+        const uint64_t offset = r.next();
+        const uint64_t count = r.next();
+        if (count == 0) {
+            return;
+        }
+        if (offset < HEADER_SIZE || offset > table_offset || count > table_offset - offset) {
+            r.ok = false;
+            return;
+        }
+        *text = shared_text(mapping, tag, offset, count);
+    };
+    auto get_item = [&](atomic_undo_item *item) {
+        item->beg = r.next();
+        const uint64_t side = r.next();
+        r.ok &= side <= 1;
+        item->side = side == 0 ? Side::left : Side::right;
+        item->before_node.value = r.next();
+        item->after_node.value = r.next();
+        get_text(&item->text_deleted);
+        get_text(&item->text_inserted);
+    };
+
+    undo_history loaded;
+    loaded.current_node.value = r.next();
+    loaded.next_node_number.value = r.next();
+    const uint64_t past_count = r.next();
+    for (uint64_t i = 0; i < past_count && r.ok; ++i) {
+        const uint64_t type = r.next();
+        const uint64_t count = r.next();
+        if (type == ATOMIC_TYPE && count == 1) {
+            undo_item item{.type = undo_item::Type::atomic, .atomic = {}};
+            get_item(&item.atomic);
+            loaded.past.push_back(std::move(item));
+        } else if (type == MOUNTAIN_TYPE && count != 0 && count <= (r.end - r.pos) / (ITEM_FIELDS * WORD)) {
+            undo_item item{.type = undo_item::Type::mountain, .atomic = {}};
+            item.history.resize(count);
+            for (atomic_undo_item& it : item.history) {
+                get_item(&it);
+            }
+            loaded.past.push_back(std::move(item));
+        } else {
+            r.ok = false;
+        }
+    }
+    const uint64_t future_count = r.next();
+    for (uint64_t i = 0; i < future_count && r.ok; ++i) {
+        atomic_undo_item item;
+        get_item(&item);
+        loaded.future.push_back(std::move(item));
+    }
+    if (!r.ok || r.pos != r.end) {
+        return false;
+    }
+
+    for (const undo_item& item : loaded.past) {
+        loaded.memory_used += undo_memory(item);
+    }
+    for (const atomic_undo_item& item : loaded.future) {
+        loaded.memory_used += undo_memory(item);
+    }
+    loaded.undo_file_path = path.native();
+    loaded.undo_file_tag = tag;
+    loaded.undo_file_size = size;
+    *history = std::move(loaded);
+    return true;
+}
+
+}  // namespace qwi
@@ -0,0 +1,51 @@
+#ifndef QWERTILLION_UNDO_FILE_HPP_
+#define QWERTILLION_UNDO_FILE_HPP_
+
+#include <filesystem>
+#include <optional>
+
+#include "error.hpp"
+#include "text_storage.hpp"
+#include "undo.hpp"
+
+namespace qwi {
+
+// Undo history gets saved next to its file, as .<filename>.qwi-undo, so that it survives
+// restarts.  The undo file is append-only:  each save appends the text of new undo items
+// and then a table of the whole history, which refers to text written by earlier saves.
+// (It gets rewritten from scratch when it's mostly outdated tables and dead text.)  Opening
+// the file maps the undo file and reads only the last table, so undo text gets paged in
+// when it's used.
+
+std::filesystem::path undo_file_path(const std::filesystem::path& file_path);
+
+// A hash of a file's contents, which undo files record, in case the file changes without
+// its size or modification time changing.  The text can come in spans of any size.
+class content_hash {
+public:
+    void add(const buffer_char *data, size_t count);
+    uint64_t finish() const;
+
+private:
+    void mix(uint64_t word);
+
+    uint64_t h_ = 0;
+    uint64_t size_ = 0;
+    // The bytes of a partial word, from the end of the last span.
+    uint64_t partial_ = 0;
+};
+
+// Call right after saving text to file_path.  Writes what has changed in history since it
+// was last saved or loaded.
+ui_result save_undo_file(const std::filesystem::path& file_path, const text_storage& text, undo_history *history);
+
+// Loads the history saved with file_path, if there is some, and file_path hasn't changed
+// since it was saved (going by its size, modification time and a hash of its contents).
+// Returns true if it did, in which case file_path's contents are the text as of
+// history->current_node.  (Undo still checks each item against the text.)  file_hash is
+// the file's content_hash, if the caller has it -- otherwise we read the file for it.
+bool load_undo_file(const std::filesystem::path& file_path, std::optional<uint64_t> file_hash, undo_history *history);
+
+}  // namespace qwi
+
+#endif  // QWERTILLION_UNDO_FILE_HPP_